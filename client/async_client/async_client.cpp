@@ -1,5 +1,7 @@
 #include "async_client.h"
 
+#include <algorithm>
+
 using namespace fi;
 
 async_tcp_client::async_tcp_client( ) {
@@ -9,113 +11,125 @@ async_tcp_client::async_tcp_client( ) {
 #endif // _WIN32
 }
 
+async_tcp_client::async_tcp_client( client_loop& loop ) : async_tcp_client( ) {
+	loop_ = &loop;
+}
+
 async_tcp_client::~async_tcp_client( ) {
 	disconnect( );
 
-	if ( processing_thread_.joinable( ) )
-		processing_thread_.join( );
-
-	if ( receiving_thread_.joinable( ) )
-		receiving_thread_.join( );
+	// Our own loop has nobody else to drive
+	own_loop_.reset( );
 
 #ifdef _WIN32
 	WSACleanup( );
 #endif // _WIN32
 }
 
-bool async_tcp_client::connect( std::string_view ip, std::string_view port ) {
-	if ( connected_ )
-		throw exception( exception::reason_id::already_connected, "async_tcp_client::connect: attempted to connect while a connection was open" );
+void async_tcp_client::connect_operation::await_suspend( std::coroutine_handle< > h ) {
+	client_->begin_connect( ip_, port_, engine_ );
 
-	// Confirm that we have a callback set
-	if ( !process_callback_ )
-		throw exception( exception::reason_id::no_callback, "async_tcp_client::connect: no processing callback set" );
+	// The loop thread doesn't know about us yet, so nobody can race us here
+	client_->connect_waiter_ = h;
+	client_->start_loop( );
+}
 
-	addrinfo hints = { }, * result = nullptr;
+bool async_tcp_client::connect( std::string_view ip, std::string_view port, io_engine engine ) {
+	begin_connect( ip, port, engine );
+	start_loop( );
 
-	hints.ai_family = AF_INET;
-	hints.ai_protocol = IPPROTO_TCP;
-	hints.ai_socktype = SOCK_STREAM;
+	bool refused = false;
 
-	if ( getaddrinfo( ip.data( ), port.data( ), &hints, &result ) != 0 )
-		throw exception( exception::reason_id::getaddrinfo_failure, "async_tcp_client::connect: getaddrinfo error" );
+	{
+		std::unique_lock lock( mtx_ );
+		connect_cv_.wait( lock, [ & ]( ) { return connect_done_; } );
 
-	socket_ = ::socket( result->ai_family, result->ai_socktype, result->ai_protocol );
-
-	if ( socket_ == INVALID_SOCKET ) {
-		freeaddrinfo( result );
-		throw exception( exception::reason_id::socket_failure, "async_tcp_client::connect: failed to create socket" );
+		refused = connect_refused_;
 	}
 
-	if ( ::connect( socket_, result->ai_addr, int( result->ai_addrlen ) ) == SOCKET_ERROR ) {
-		freeaddrinfo( result );
-		throw exception( exception::reason_id::connection_error, "async_tcp_client::connect: error connecting" );
-	}
+	if ( is_connected( ) )
+		return true;
 
-	freeaddrinfo( result );
-
-	if ( !perform_handshake( ) ) {
-		disconnect_internal( disconnect_reasons::reason_handshake_fail );
-		return false;
-	}
+	// The loop thread is still cleaning up after us
+	wait_detached( );
 
-	connected_ = true;
+	if ( refused )
+		throw exception( exception::reason_id::connection_error, "async_tcp_client::connect: error connecting" );
 
-	processing_thread_ = std::thread( &async_tcp_client::process_data, this );
-	receiving_thread_ = std::thread( &async_tcp_client::receive_data, this );
+	return false;
+}
 
-	return true;
+async_tcp_client::connect_operation async_tcp_client::async_connect( std::string_view ip, std::string_view port, io_engine engine ) {
+	return connect_operation( this, ip, port, engine );
 }
 
 void async_tcp_client::disconnect( ) {
-	if ( connected_ )
+	// Our own callbacks can't wait for themselves, the loop thread finishes up once they return
+	if ( on_loop_thread( ) ) {
 		disconnect_internal( disconnect_reasons::reason_stop );
+		return;
+	}
+
+	if ( state_ != state::disconnected ) {
+		{
+			std::lock_guard guard( mtx_ );
+			disconnect_requested_ = true;
+		}
+
+		wake_loop( );
+	}
+
+	// Waiting on one of the loop's threads could hold up the very thread that has to disconnect us
+	if ( loop_ && loop_->is_loop_thread( ) )
+		return;
+
+	wait_detached( );
 }
 
 bool async_tcp_client::is_connected( ) {
-	return connected_;
+	return state_ == state::connected;
 }
 
-void async_tcp_client::send_packet( packets::base_packet* const packet ) {
-	if ( !packet )
-		throw exception( exception::reason_id::packet_nullptr, "async_tcp_client::send_packet: packet was nullptr" );
+std::uint32_t async_tcp_client::calls_in_flight( ) const {
+	return calls_in_flight_;
+}
 
-	std::lock_guard guard( send_mtx_ );
+std::uint64_t async_tcp_client::send_backlog( ) const {
+	// Written never passes queued, unless a new connection just reset both
+	auto sent = bytes_sent_.load( );
+	auto queued = bytes_queued_.load( );
 
-	serializer.reset( );
+	return queued > sent ? queued - sent : 0;
+}
 
-	// Serialize our data
-	packet->serialize( serializer );
+std::chrono::steady_clock::time_point async_tcp_client::last_receive( ) const {
+	return std::chrono::steady_clock::time_point( std::chrono::steady_clock::duration( last_receive_.load( ) ) );
+}
 
-	// Allocate a buffer for our packet
-	std::vector< std::uint8_t > packet_data( sizeof( packets::header ) + serializer.get_serialized_data_length( ) );
+void async_tcp_client::register_callback( std::function< void( async_tcp_client* const, const packets::packet_id, packets::detail::packet_reader& ) > callback_fn ) {
+	if ( !callback_fn )
+		throw exception( exception::reason_id::null_callback, "async_tcp_client::register_callback: no callback given" );
 
-	// Construct our packet header
-	packets::header packet_header = construct_packet_header(
-		serializer.get_serialized_data_length( ),
-		packet->get_id( ),
-		packets::flags::fl_none
-	);
+	process_callback_ = callback_fn;
+}
 
-	// Write our packet into the buffer
-	memcpy( packet_data.data( ), &packet_header, sizeof( packets::header ) );
+void async_tcp_client::register_batch_callback( std::function< void( async_tcp_client* const, std::span< const packets::received_packet > ) > callback_fn ) {
+	if ( !callback_fn )
+		throw exception( exception::reason_id::null_callback, "async_tcp_client::register_batch_callback: no callback given" );
 
-	memcpy(
-		packet_data.data( ) + sizeof( packets::header ),
-		serializer.get_serialized_data( ),
-		serializer.get_serialized_data_length( )
-	);
+	batch_callback_ = callback_fn;
+}
 
-	// Attempt to send the packet
-	if ( !send_packet_internal( packet_data.data( ), packet_data.size( ) ) )
-		disconnect_internal( disconnect_reasons::reason_error );
+void async_tcp_client::set_receive_limit( std::uint32_t limit ) {
+	receive_limit_ = limit;
 }
 
-void async_tcp_client::register_callback( std::function< void( async_tcp_client* const, const packets::packet_id, packets::detail::binary_serializer& ) > callback_fn ) {
-	if ( !callback_fn )
-		throw exception( exception::reason_id::null_callback, "async_tcp_client::register_callback: no callback given" );
+void async_tcp_client::set_handshake_mode( handshake_mode mode ) {
+	handshake_mode_ = mode;
+}
 
-	process_callback_ = callback_fn;
+void async_tcp_client::set_socket_options( const socket_options& options ) {
+	socket_options_ = options;
 }
 
 void async_tcp_client::register_disconnect_callback( std::function< void( async_tcp_client* const ) > callback_fn ) {
@@ -130,28 +144,212 @@ packets::header async_tcp_client::construct_packet_header( packets::packet_lengt
 	packet_header.length = sizeof( packets::header ) + length;
 	packet_header.magic = PACKET_MAGIC;
 
-	return packet_header;
+	// Ready to go out as is
+	return packets::detail::to_wire( packet_header );
 }
 
-bool async_tcp_client::perform_handshake( ) {
-	packets::header packet_header = construct_packet_header( 0, packets::ids::id_handshake, packets::flags::fl_handshake_cl );
+detail::shared_buffer async_tcp_client::build_packet( packets::packet_id id, packets::packet_flags flags ) {
+	packets::header packet_header = construct_packet_header( 0, id, flags );
 
-	auto buffer = reinterpret_cast< char* >( &packet_header );
+	auto packet_data = detail::shared_buffer::allocate( sizeof( packets::header ) );
+	memcpy( packet_data.data( ), &packet_header, sizeof( packets::header ) );
 
-	// Send our header with no body and the handshake_cl flag
-	if ( !send_packet_internal( &packet_header, sizeof( packets::header ) ) )
-		return false;
+	return packet_data;
+}
 
-	// Receive a response back. Should be the header with handshake_sv flag
-	int bytes_received = 0;
-	do {
-		int received = recv( socket_, buffer + bytes_received, sizeof( packets::header ) - bytes_received, 0 );
+void async_tcp_client::begin_connect( std::string_view ip, std::string_view port, io_engine engine ) {
+	if ( state_ != state::disconnected )
+		throw exception( exception::reason_id::already_connected, "async_tcp_client::connect: attempted to connect while a connection was open" );
 
-		if ( received <= 0 )
-			return false;
+	// Confirm that we have a callback set
+	if ( !process_callback_ && !batch_callback_ && handlers_.empty( ) )
+		throw exception( exception::reason_id::no_callback, "async_tcp_client::connect: no processing callback set" );
+
+	// The loop thread might still be finishing up our previous connection
+	if ( on_loop_thread( ) && !is_finished( ) )
+		throw exception( exception::reason_id::already_connected, "async_tcp_client::connect: attempted to connect while a connection was open" );
+
+	wait_detached( );
+
+	// Running on our own we get a loop with a single thread and small io_uring rings
+	if ( !loop_ && ( !own_loop_ || own_loop_->engine( ) != engine || own_loop_->cpu_affinity_ != socket_options_.cpu_affinity ) ) {
+		own_loop_.reset( );
+
+		try {
+			own_loop_.reset( new client_loop( 1, engine, socket_options_.cpu_affinity, 64, 16 ) );
+		} catch ( client_loop::exception& e ) {
+			if ( e.get_reason( ) == client_loop::exception::reason_id::engine_unavailable )
+				throw exception( exception::reason_id::engine_unavailable, "async_tcp_client::connect: io_uring is not available" );
+
+			if ( e.get_reason( ) == client_loop::exception::reason_id::affinity_failure )
+				throw exception( exception::reason_id::affinity_failure, "async_tcp_client::connect: failed to pin loop thread" );
+
+			throw exception( exception::reason_id::reactor_failure, "async_tcp_client::connect: failed to create reactor" );
+		}
+	}
+
+	engine_ = loop( ).engine( );
+	context_ = &loop( ).next_context( );
+
+	addrinfo hints = { }, * result = nullptr;
+
+	hints.ai_family = AF_INET;
+	hints.ai_protocol = IPPROTO_TCP;
+	hints.ai_socktype = SOCK_STREAM;
+
+	// getaddrinfo wants null terminated strings
+	if ( getaddrinfo( std::string( ip ).c_str( ), std::string( port ).c_str( ), &hints, &result ) != 0 )
+		throw exception( exception::reason_id::getaddrinfo_failure, "async_tcp_client::connect: getaddrinfo error" );
+
+	socket_ = ::socket( result->ai_family, result->ai_socktype, result->ai_protocol );
+
+	if ( socket_ == INVALID_SOCKET ) {
+		freeaddrinfo( result );
+		throw exception( exception::reason_id::socket_failure, "async_tcp_client::connect: failed to create socket" );
+	}
+
+	memcpy( &address_, result->ai_addr, std::min< std::size_t >( result->ai_addrlen, sizeof( address_ ) ) );
+	address_length_ = std::uint32_t( result->ai_addrlen );
+
+	freeaddrinfo( result );
+
+	auto fail = [ & ]( exception::reason_id reason, std::string_view what ) {
+		closesocket( socket_ );
+		socket_ = INVALID_SOCKET;
+
+		throw exception( reason, what );
+	};
+
+	// Our loop thread must never block on the socket
+	if ( !detail::set_non_blocking( socket_ ) )
+		fail( exception::reason_id::socket_failure, "async_tcp_client::connect: failed to make socket non-blocking" );
+
+	// Buffer sizes only make it into the window scale if they're set before connecting
+	if ( !detail::apply_socket_options( socket_, socket_options_ ) )
+		fail( exception::reason_id::socket_failure, "async_tcp_client::connect: failed to apply socket options" );
+
+	// Leftovers from a previous connection
+	process_buffer_.clear( );
+	send_queue_.clear( );
+
+	flush_pending_ = sending_ = disconnect_requested_ = false;
+	connect_done_ = connect_refused_ = false;
+	server_hello_pending_ = false;
+	bytes_queued_ = bytes_sent_ = 0;
+	last_receive_ = std::chrono::steady_clock::now( ).time_since_epoch( ).count( );
+
+	{
+		std::lock_guard guard( mtx_ );
+		detached_ = false;
+	}
+
+	state_ = state::connecting;
+}
+
+void async_tcp_client::start_loop( ) {
+	{
+		std::lock_guard guard( context_->mtx );
+		attached_ = true;
+	}
+
+	// The loop thread picks us up like any client with pending work
+	wake_loop( );
+}
+
+void async_tcp_client::wait_detached( ) {
+	std::unique_lock lock( mtx_ );
+	detached_cv_.wait( lock, [ & ]( ) { return detached_; } );
+}
+
+void async_tcp_client::finish_detach( ) {
+	// Notify while holding the lock, we may be gone the moment the waiter sees detached_
+	std::lock_guard guard( mtx_ );
+
+	detached_ = true;
+	detached_cv_.notify_all( );
+}
+
+client_loop& async_tcp_client::loop( ) {
+	return loop_ ? *loop_ : *own_loop_;
+}
+
+bool async_tcp_client::on_loop_thread( ) const {
+	return context_ && std::this_thread::get_id( ) == context_->loop_id;
+}
+
+void async_tcp_client::start_connect( ) {
+	set_deadline( );
+
+	// io_uring tells us once we're connected, so does the reactor by reporting the socket as writable
+	if ( engine_ == io_engine::uring ) {
+		connect_pending_ = context_->uring.connect( socket_, reinterpret_cast< const sockaddr* >( &address_ ), address_length_, token_ );
+
+		// Our ring is swamped, we don't hang around until it isn't
+		if ( !connect_pending_ )
+			disconnect_internal( disconnect_reasons::reason_handshake_fail );
+
+		return;
+	}
+
+	bool failed = ::connect( socket_, reinterpret_cast< const sockaddr* >( &address_ ), int( address_length_ ) ) == SOCKET_ERROR && !detail::connect_in_progress( );
 
-		bytes_received += received;
-	} while ( bytes_received < sizeof( packets::header ) );
+	if ( failed || !context_->reactor.add( socket_, token_, detail::reactor::ev_read | detail::reactor::ev_write ) )
+		disconnect_internal( disconnect_reasons::reason_handshake_fail );
+}
+
+void async_tcp_client::begin_handshake( ) {
+	state_ = state::handshaking;
+	set_deadline( );
+
+	// From now on we only care about writing once the server's window fills up
+	if ( engine_ == io_engine::reactor && !context_->reactor.modify( socket_, token_, detail::reactor::ev_read ) ) {
+		disconnect_internal( disconnect_reasons::reason_handshake_fail );
+		return;
+	}
+
+	if ( handshake_mode_ == handshake_mode::zero_rtt ) {
+		// Our hello goes in front of whatever got queued while connecting, so the loop
+		// writes all of it with the same syscall once it flushes us
+		auto hello = build_packet( packets::ids::id_handshake, packets::flags::fl_handshake_cl );
+
+		std::lock_guard guard( mtx_ );
+
+		// Senders waiting on their packets have to wait for the hello as well
+		for ( auto sender : senders_ )
+			sender->bytes += hello.size( );
+
+		bytes_queued_ += hello.size( );
+		send_queue_.push_front( std::move( hello ) );
+	} else {
+		packets::header packet_header = construct_packet_header( 0, packets::ids::id_handshake, packets::flags::fl_handshake_cl );
+
+		// Send our header with no body and the handshake_cl flag
+		if ( !send_packet_internal( &packet_header, sizeof( packets::header ) ) ) {
+			disconnect_internal( disconnect_reasons::reason_handshake_fail );
+			return;
+		}
+	}
+
+	if ( engine_ == io_engine::uring && !context_->uring.recv_multishot( socket_, token_ ) ) {
+		disconnect_internal( disconnect_reasons::reason_handshake_fail );
+		return;
+	}
+
+	// The server reads our hello and everything behind it in one go, his
+	// hello still has to arrive before the deadline
+	if ( handshake_mode_ == handshake_mode::zero_rtt ) {
+		server_hello_pending_ = true;
+
+		state_ = state::connected;
+		finish_connect( true );
+	}
+}
+
+bool async_tcp_client::complete_handshake( ) {
+	// The response should be the header with handshake_sv flag
+	packets::header packet_header = { };
+	process_buffer_.peek( &packet_header, sizeof( packets::header ) );
+	packet_header = packets::detail::from_wire( packet_header );
 
 	// Check the header information for the information we are expecting
 	if ( packet_header.flags != packets::flags::fl_handshake_sv )
@@ -166,19 +364,50 @@ bool async_tcp_client::perform_handshake( ) {
 	if ( packet_header.magic != PACKET_MAGIC )
 		return false;
 
+	process_buffer_.consume( sizeof( packets::header ) );
+
+	server_hello_pending_ = false;
+
+	state_ = state::connected;
+	finish_connect( true );
+
+	context_->timers.cancel( std::exchange( deadline_timer_, 0 ) );
+
 	return true;
 }
 
+void async_tcp_client::finish_connect( bool success ) {
+	{
+		std::lock_guard guard( mtx_ );
+
+		// We only ever fail once connecting, everything after that is a disconnect
+		if ( connect_done_ )
+			return;
+
+		connect_done_ = true;
+		connect_refused_ = !success && state_ == state::connecting;
+
+		connect_cv_.notify_all( );
+	}
+
+	if ( connect_waiter_ )
+		to_resume_.push_back( std::exchange( connect_waiter_, { } ) );
+}
+
 bool async_tcp_client::send_packet_internal( void* const data, const packets::packet_length length ) {
 	std::uint32_t bytes_sent = 0;
 	do {
-		int sent = send(
+		int sent = ::send(
 			socket_,
 			reinterpret_cast< char* >( data ) + bytes_sent,
 			length - bytes_sent,
-			0
+			SOCKET_SEND_FLAGS
 		);
 
+		if ( sent < 0 && detail::interrupted( ) )
+			continue;
+
+		// Nothing else was sent yet, so this only fails if something is wrong
 		if ( sent <= 0 )
 			return false;
 
@@ -188,109 +417,707 @@ bool async_tcp_client::send_packet_internal( void* const data, const packets::pa
 	return true;
 }
 
+void async_tcp_client::send_buffer( const detail::shared_buffer& data ) {
+	bool needs_wake = false;
+
+	{
+		std::lock_guard guard( mtx_ );
+		needs_wake = enqueue( data );
+	}
+
+	if ( needs_wake )
+		wake_loop( );
+}
+
+bool async_tcp_client::enqueue( const detail::shared_buffer& data ) {
+	// Nothing gets queued once we're shutting down
+	if ( !is_open( ) )
+		return false;
+
+	send_queue_.push( data );
+	bytes_queued_ += data.size( );
+
+	// Only wake the loop thread up if it isn't already going to flush
+	if ( flush_pending_ || sending_ )
+		return false;
+
+	flush_pending_ = true;
+	return true;
+}
+
+void async_tcp_client::wake_loop( ) {
+	if ( !context_ )
+		return;
+
+	auto& ctx = *context_;
+	bool needs_wake = false;
+
+	{
+		std::lock_guard guard( ctx.mtx );
+
+		// Once we're detached there's nothing left for the loop thread to do
+		if ( !attached_ || queued_ )
+			return;
+
+		queued_ = true;
+
+		// Only wake the loop thread up if it doesn't already have clients to go through
+		needs_wake = ctx.pending.empty( );
+		ctx.pending.push_back( this );
+	}
+
+	// The loop thread goes through its pending clients before it goes back to sleep anyway
+	if ( needs_wake && !on_loop_thread( ) ) {
+		ctx.reactor.wake( );
+		ctx.uring.wake( );
+	}
+}
+
+bool async_tcp_client::is_open( ) const {
+	auto current = state_.load( );
+	return current == state::connecting || current == state::handshaking || current == state::connected;
+}
+
+bool async_tcp_client::add_receiver( detail::receive_waiter& waiter ) {
+	// Only the loop thread touches the receivers, everyone else hands theirs over
+	if ( on_loop_thread( ) ) {
+		if ( !is_open( ) )
+			return false;
+
+		receivers_.push_back( &waiter );
+		return true;
+	}
+
+	{
+		std::lock_guard guard( mtx_ );
+
+		if ( !is_open( ) )
+			return false;
+
+		receivers_to_add_.push_back( &waiter );
+	}
+
+	wake_loop( );
+	return true;
+}
+
+bool async_tcp_client::add_sender( detail::send_waiter& waiter, const detail::shared_buffer& data ) {
+	bool needs_wake = false;
+
+	{
+		std::lock_guard guard( mtx_ );
+
+		if ( !is_open( ) )
+			return false;
+
+		needs_wake = enqueue( data );
+
+		// The loop thread resumes us once everything up to our packet was written
+		waiter.bytes = bytes_queued_;
+		senders_.push_back( &waiter );
+	}
+
+	if ( needs_wake )
+		wake_loop( );
+
+	return true;
+}
+
+bool async_tcp_client::add_call( detail::call_waiter& waiter, const detail::shared_buffer& data ) {
+	bool needs_wake = false;
+
+	{
+		std::lock_guard guard( mtx_ );
+
+		if ( !is_open( ) )
+			return false;
+
+		needs_wake = enqueue( data );
+		calls_in_flight_++;
+
+		// The request can't be answered before the loop thread picks the call up,
+		// it only goes out once the loop thread flushes
+		if ( !on_loop_thread( ) )
+			calls_to_add_.push_back( &waiter );
+	}
+
+	if ( on_loop_thread( ) )
+		track_call( &waiter );
+
+	// Other threads hand the call over, so the loop thread has to hear from us either way
+	if ( needs_wake || !on_loop_thread( ) )
+		wake_loop( );
+
+	return true;
+}
+
+void async_tcp_client::track_call( detail::call_waiter* waiter ) {
+	calls_[ waiter->call ] = waiter;
+
+	if ( waiter->deadline != std::chrono::steady_clock::time_point::max( ) )
+		waiter->timer = context_->timers.schedule( waiter->deadline, [ this, call = waiter->call ]( ) { expire_call( call ); } );
+}
+
+void async_tcp_client::expire_call( packets::call_id call ) {
+	auto it = calls_.find( call );
+
+	if ( it == calls_.end( ) )
+		return;
+
+	// Resumes empty handed, a late response gets dropped
+	to_resume_.push_back( it->second->handle );
+	calls_.erase( it );
+	calls_in_flight_--;
+
+	mark_ready( );
+}
+
+void async_tcp_client::complete_call( packets::call_id call, packets::packet_id id, packets::detail::packet_reader& reader ) {
+	auto it = calls_.find( call );
+
+	// Responses to calls we gave up on are dropped
+	if ( it == calls_.end( ) )
+		return;
+
+	auto waiter = it->second;
+
+	calls_.erase( it );
+	calls_in_flight_--;
+	context_->timers.cancel( waiter->timer );
+
+	// A response that doesn't match the type we expect leaves the call empty handed
+	if ( id == waiter->response_id )
+		waiter->deliver( waiter, reader );
+
+	waiter->handle.resume( );
+}
+
+void async_tcp_client::drop_waiters( ) {
+	{
+		std::lock_guard guard( mtx_ );
+
+		for ( auto waiter : receivers_to_add_ )
+			to_resume_.push_back( waiter->handle );
+
+		for ( auto waiter : calls_to_add_ )
+			to_resume_.push_back( waiter->handle );
+
+		calls_in_flight_ -= std::uint32_t( calls_to_add_.size( ) );
+
+		receivers_to_add_.clear( );
+		calls_to_add_.clear( );
+	}
+
+	for ( auto waiter : receivers_ )
+		to_resume_.push_back( waiter->handle );
+
+	for ( auto& [ call, waiter ] : calls_ ) {
+		context_->timers.cancel( waiter->timer );
+		to_resume_.push_back( waiter->handle );
+	}
+
+	calls_in_flight_ -= std::uint32_t( calls_.size( ) );
+
+	receivers_.clear( );
+	calls_.clear( );
+}
+
 void async_tcp_client::disconnect_internal( const disconnect_reasons reason ) {
-	// This may be called from multiple threads
-	std::lock_guard guard( disconnect_mtx_ );
+	auto current = state_.load( );
 
-	connected_ = false;
+	if ( current == state::disconnected )
+		return;
 
-	switch ( reason ) {
-		case disconnect_reasons::reason_handshake_fail:
-			if ( socket_ ) {
-				shutdown( socket_, SD_BOTH );
-				closesocket( socket_ );
-				socket_ = 0;
-			}
-			break;
-		case disconnect_reasons::reason_stop: // Send a disconnect packet as the client has requested a disconnect
+	// Whatever happens here, the loop has to look at us before it goes back to sleep
+	mark_ready( );
+
+	// Send a disconnect packet as the client has requested a disconnect. It goes
+	// out after everything queued up, we close the socket once all of it is written.
+	if ( reason == disconnect_reasons::reason_stop && current == state::connected ) {
 		{
-			packets::header packet_header = construct_packet_header( 0, packets::ids::id_disconnect, packets::flags::fl_disconnect );
-			send_packet_internal( &packet_header, sizeof( packets::header ) );
+			std::lock_guard guard( mtx_ );
+
+			enqueue( build_packet( packets::ids::id_disconnect, packets::flags::fl_disconnect ) );
+			flush_pending_ = true;
+
+			state_ = state::disconnecting;
 		}
-		case disconnect_reasons::reason_error:
-		case disconnect_reasons::reason_server_stop:
-			if ( socket_ ) {
-				shutdown( socket_, SD_BOTH );
-				closesocket( socket_ );
-				socket_ = 0;
-
-				if ( on_disconnect_callback_ )
-					on_disconnect_callback_( this );
-			}
+
+		// Nothing will arrive for them anymore
+		drop_waiters( );
+
+		set_deadline( );
+		return;
+	}
+
+	// Whoever is waiting on connect learns that it failed
+	if ( current == state::connecting || current == state::handshaking )
+		finish_connect( false );
+
+	context_->timers.cancel( std::exchange( deadline_timer_, 0 ) );
+
+	if ( engine_ == io_engine::reactor )
+		context_->reactor.remove( socket_ );
+
+	// Whatever io_uring still has in flight completes once the socket is shut down
+	shutdown( socket_, SD_BOTH );
+	closesocket( socket_ );
+
+	socket_ = INVALID_SOCKET;
+
+	{
+		std::lock_guard guard( mtx_ );
+
+		state_ = state::disconnected;
+
+		// Coroutines still waiting learn that we're gone
+		for ( auto waiter : senders_ )
+			to_resume_.push_back( waiter->handle );
+
+		senders_.clear( );
+
+		// The kernel might still be reading from the queue, it's cleared once the send completes
+		if ( !sending_ )
+			send_queue_.clear( );
 	}
+
+	drop_waiters( );
+
+	// The user never heard of connections that didn't finish their handshake
+	if ( on_disconnect_callback_ && ( current == state::connected || current == state::disconnecting ) )
+		on_disconnect_callback_( this );
 }
 
-void async_tcp_client::process_data( ) {
+void async_tcp_client::handle_pending( ) {
+	std::vector< detail::receive_waiter* > receivers_to_add = { };
+	std::vector< detail::call_waiter* > calls_to_add = { };
+	bool disconnect_requested = false;
+
+	{
+		std::lock_guard guard( mtx_ );
+
+		receivers_to_add.swap( receivers_to_add_ );
+		calls_to_add.swap( calls_to_add_ );
+		disconnect_requested = std::exchange( disconnect_requested_, false );
+	}
+
+	for ( auto waiter : receivers_to_add ) {
+		if ( is_open( ) )
+			receivers_.push_back( waiter );
+		else
+			to_resume_.push_back( waiter->handle );
+	}
+
+	for ( auto waiter : calls_to_add ) {
+		if ( is_open( ) ) {
+			track_call( waiter );
+			continue;
+		}
+
+		to_resume_.push_back( waiter->handle );
+		calls_in_flight_--;
+	}
+
+	if ( disconnect_requested )
+		disconnect_internal( disconnect_reasons::reason_stop );
+}
+
+void async_tcp_client::handle_event( std::uint32_t events ) {
+	if ( state_ == state::disconnected )
+		return;
+
+	// The socket becomes writable once we're connected, errors show up as well
+	if ( state_ == state::connecting ) {
+		if ( events & ( detail::reactor::ev_write | detail::reactor::ev_close ) ) {
+			if ( detail::socket_error( socket_ ) != 0 )
+				disconnect_internal( disconnect_reasons::reason_handshake_fail );
+			else
+				begin_handshake( );
+		}
+
+		return;
+	}
+
+	if ( events & detail::reactor::ev_write && sending_ ) {
+		{
+			std::lock_guard guard( mtx_ );
+			sending_ = false;
+		}
+
+		// Back to only caring about reads until the server's window fills up again
+		if ( !context_->reactor.modify( socket_, token_, detail::reactor::ev_read ) || !write_pending( ) ) {
+			disconnect_internal( disconnect_reasons::reason_error );
+			return;
+		}
+	}
+
+	if ( events & ( detail::reactor::ev_read | detail::reactor::ev_close ) )
+		receive_data( );
+}
+
+void async_tcp_client::mark_ready( ) {
+	if ( ready_ )
+		return;
+
+	ready_ = true;
+	context_->ready.push_back( this );
+}
+
+bool async_tcp_client::is_finished( ) const {
+	// io_uring may still be reading our address or send queue
+	return state_ == state::disconnected && !sending_ && !connect_pending_;
+}
+
+void async_tcp_client::set_deadline( ) {
+	context_->timers.cancel( deadline_timer_ );
+	deadline_timer_ = context_->timers.schedule( std::chrono::steady_clock::now( ) + timeout_, [ this ]( ) {
+		deadline_timer_ = 0;
+		check_deadline( );
+	} );
+}
+
+void async_tcp_client::check_deadline( ) {
+	auto current = state_.load( );
+
+	if ( ( current == state::connected && !server_hello_pending_ ) || current == state::disconnected )
+		return;
+
+	// A server that doesn't take what's left isn't worth waiting for either
+	disconnect_internal( current == state::disconnecting ? disconnect_reasons::reason_error : disconnect_reasons::reason_handshake_fail );
+}
+
+void async_tcp_client::flush_sends( ) {
+	{
+		std::lock_guard guard( mtx_ );
+		flush_pending_ = false;
+	}
+
+	auto current = state_.load( );
+
+	// Packets sent while we're connecting go out once the handshake is done
+	if ( current != state::connected && current != state::disconnecting )
+		return;
+
+	// io_uring fails to queue the send if our ring is swamped, there's no waiting for it here
+	if ( engine_ == io_engine::uring ? !submit_uring_send( ) : !write_pending( ) ) {
+		disconnect_internal( disconnect_reasons::reason_error );
+		return;
+	}
+
+	if ( current != state::disconnecting )
+		return;
+
+	bool drained = false;
+
+	{
+		std::lock_guard guard( mtx_ );
+		drained = send_queue_.empty( ) && !sending_;
+	}
+
+	// Our disconnect packet went out, we're done
+	if ( drained )
+		disconnect_internal( disconnect_reasons::reason_stop );
+}
+
+bool async_tcp_client::write_pending( ) {
 	while ( true ) {
-		std::this_thread::sleep_for( std::chrono::milliseconds( 1 ) );
+		{
+			std::lock_guard guard( mtx_ );
 
-		std::lock_guard guard( process_mtx_ );
+			if ( sending_ || !send_queue_.gather( max_send_segments_ ) )
+				return true;
+		}
 
-		if ( !connected_ ) {
-			// Nothing left to process, exit
-			if ( process_buffer_.size( ) < sizeof( packets::header ) )
-				break;
+		// Senders may keep queueing packets while we're writing, the ones we gathered stay put
+		int sent = send_queue_.send_gathered( socket_ );
 
-			auto header = reinterpret_cast< packets::header* >( process_buffer_.data( ) );
+		if ( sent >= 0 ) {
+			std::lock_guard guard( mtx_ );
+			send_queue_.advance( sent );
+			bytes_sent_ += sent;
 
-			// Data partially received, exit
-			if ( process_buffer_.size( ) < header->length )
-				break;
+			complete_sends( );
 
-			// Keep processing data as we have packets left
+			continue;
 		}
 
-		if ( process_buffer_.size( ) < sizeof( packets::header ) )
+		if ( detail::interrupted( ) )
 			continue;
 
-		auto header = reinterpret_cast< packets::header* >( process_buffer_.data( ) );
+		if ( !detail::would_block( ) )
+			return false;
+
+		// The server's window is full. Instead of waiting for it, let
+		// the reactor tell us once we can write again.
+		{
+			std::lock_guard guard( mtx_ );
+			sending_ = true;
+		}
+
+		return context_->reactor.modify( socket_, token_, detail::reactor::ev_read | detail::reactor::ev_write );
+	}
+}
+
+void async_tcp_client::complete_sends( ) {
+	// Called with mtx_ held
+	while ( !senders_.empty( ) && senders_.front( )->bytes <= bytes_sent_ ) {
+		senders_.front( )->sent = true;
+		to_resume_.push_back( senders_.front( )->handle );
+
+		senders_.pop_front( );
+	}
+}
+
+void async_tcp_client::resume_waiters( ) {
+	// Resumed coroutines may queue sends and have others resumed in turn
+	while ( !to_resume_.empty( ) ) {
+		auto to_resume = std::move( to_resume_ );
+		to_resume_.clear( );
+
+		for ( auto h : to_resume )
+			h.resume( );
+
+		flush_sends( );
+	}
+}
+
+void async_tcp_client::receive_data( ) {
+	// The reactor is edge-triggered, so we have to read until the socket runs dry
+	int bytes_received = 0;
+
+	do {
+		bytes_received = process_buffer_.receive( socket_, buffer_size_ );
+
+		// Handle what we've got before the buffer grows past the limit. Callbacks run
+		// right here, so we don't read any further while they're busy.
+		if ( bytes_received > 0 && receive_limit_ && process_buffer_.size( ) >= receive_limit_ ) {
+			process_data( );
+
+			if ( state_ != state::handshaking && state_ != state::connected )
+				break;
+		}
+	} while ( bytes_received > 0 || ( bytes_received < 0 && detail::interrupted( ) ) );
+
+	// Our callbacks might clobber the error
+	bool failed = bytes_received < 0 && !detail::would_block( );
+
+	if ( socket_options_.quick_ack && !failed && bytes_received != 0 )
+		detail::quick_ack( socket_ );
+
+	// Everything that arrived before the server hung up still gets processed
+	process_data( );
+
+	if ( bytes_received == 0 ) // Server disconnected us
+		disconnect_internal( disconnect_reasons::reason_server_stop );
+	else if ( failed ) // An error occurred
+		disconnect_internal( disconnect_reasons::reason_error );
+}
+
+void async_tcp_client::process_data( ) {
+	// Anything from the server, heartbeats included, shows he's still there
+	last_receive_ = std::chrono::steady_clock::now( ).time_since_epoch( ).count( );
+
+	// Coroutines whose sends completed might be about to wait for
+	// what we just received, give them the chance to do so first
+	resume_waiters( );
 
-		// Disconnect if we receive some malformed packet
-		if ( header->magic != PACKET_MAGIC ) {
-			connected_ = false;
+	while ( state_ == state::handshaking || state_ == state::connected ) {
+		if ( process_buffer_.size( ) < sizeof( packets::header ) )
 			break;
+
+		// The first thing the server sends us has to be the handshake
+		if ( state_ == state::handshaking || server_hello_pending_ ) {
+			if ( !complete_handshake( ) ) {
+				disconnect_internal( disconnect_reasons::reason_handshake_fail );
+				return;
+			}
+
+			continue;
+		}
+
+		// The header might wrap around the end of the buffer
+		packets::header header = { };
+		process_buffer_.peek( &header, sizeof( packets::header ) );
+		header = packets::detail::from_wire( header );
+
+		// Disconnect if we receive some malformed packet or one we'd have to buffer past our limit
+		if ( header.magic != PACKET_MAGIC || header.length < sizeof( packets::header ) || ( receive_limit_ && header.length > receive_limit_ ) ) {
+			flush_batch( );
+			disconnect_internal( disconnect_reasons::reason_error );
+			return;
 		}
 
 		// We have received a full packet
-		if ( process_buffer_.size( ) < header->length )
+		if ( process_buffer_.size( ) < header.length )
+			break;
+
+		// Only packets wrapping around the end of the buffer get copied here
+		auto data_start = process_buffer_.contiguous( header.length ) + sizeof( packets::header );
+		std::uint32_t data_length = header.length - sizeof( packets::header );
+
+		// The reader points straight into our buffer, which stays put until we consume the packet
+		packets::detail::packet_reader reader( { data_start, data_length } );
+
+		bool is_plain = !( header.flags & ( packets::flags::fl_request | packets::flags::fl_response ) );
+
+		// Coroutines waiting for the packet get it ahead of everyone else
+		auto receiver = std::find_if( receivers_.begin( ), receivers_.end( ), [ & ]( auto waiter ) { return waiter->id == header.id; } );
+
+		// Collect whatever the callback would get one by one. Consumed packets stay where they
+		// are until we read from the socket again, only a single one per pass can wrap around
+		// the end of the buffer (and sit in its scratch space).
+		if ( batch_callback_ && is_plain && receiver == receivers_.end( ) && header.id > packets::ids::num_preset_ids && !handlers_.contains( header.id ) ) {
+			batch_.push_back( { { data_start, data_length }, header.id, header.flags } );
+			process_buffer_.consume( header.length );
 			continue;
+		}
 
-		auto data_start = process_buffer_.data( ) + sizeof( packets::header );
-		std::uint32_t data_length = header->length - sizeof( packets::header );
+		// Everything else has to wait for the packets that came before it
+		flush_batch( );
+
+		if ( state_ != state::connected )
+			break;
 
-		// Assign the data to our serializer
-		serializer.assign_buffer( data_start, data_length );
+		// Responses carry the ID of their call ahead of the packet
+		if ( header.flags & packets::flags::fl_response ) {
+			packets::call_id call = 0;
+			reader.deserialize( call );
 
-		// Call our callback (it cannot be null)
-		if ( header->id > packets::ids::num_preset_ids )
-			process_callback_( this, header->id, serializer );
+			if ( reader.is_good( ) )
+				complete_call( call, header.id, reader );
+
+			process_buffer_.consume( header.length );
+			continue;
+		}
 
-		// Erase the packet from our buffer
-		process_buffer_.erase( process_buffer_.begin( ), process_buffer_.begin( ) + data_length + sizeof( packets::header ) );
+		if ( receiver != receivers_.end( ) ) {
+			auto waiter = *receiver;
+
+			// Packets that don't match their type are dropped
+			if ( waiter->deliver( waiter, reader ) ) {
+				receivers_.erase( receiver );
+				waiter->handle.resume( );
+			}
+		} else if ( header.id > packets::ids::num_preset_ids && !( header.flags & packets::flags::fl_request ) ) {
+			// Typed handlers come first, everything else goes to our callback
+			if ( !handlers_.dispatch( header.id, reader, this ) && process_callback_ )
+				process_callback_( this, header.id, reader );
+		}
+
+		// Drop the packet from our buffer
+		process_buffer_.consume( header.length );
 	}
 
-	process_buffer_.clear( );
+	flush_batch( );
 }
 
-void async_tcp_client::receive_data( ) {
-	std::vector< std::uint8_t > buffer( buffer_size_ );
+void async_tcp_client::flush_batch( ) {
+	if ( batch_.empty( ) )
+		return;
 
-	while ( connected_ ) {
-		int bytes_received = recv( socket_, reinterpret_cast< char* >( buffer.data( ) ), buffer_size_, NULL );
+	// Packets that were still on their way when we disconnected are dropped
+	if ( state_ == state::connected )
+		batch_callback_( this, batch_ );
 
-		switch ( bytes_received ) {
-			case -1: // An error occurred
-				disconnect_internal( disconnect_reasons::reason_error );
-				break;
-			case 0: // Server disconnected us 
-				disconnect_internal( disconnect_reasons::reason_server_stop );
-				break;
-			default:
-				std::lock_guard guard( process_mtx_ );
+	batch_.clear( );
+}
+
+bool async_tcp_client::submit_uring_send( ) {
+	std::lock_guard guard( mtx_ );
+
+	if ( sending_ || !send_queue_.gather( max_send_segments_ ) )
+		return true;
+
+	sending_ = context_->uring.send_message( socket_, send_queue_.get_message( ), token_ );
+
+	return sending_;
+}
+
+void async_tcp_client::handle_uring_connect( const detail::uring::completion& c ) {
+	connect_pending_ = false;
+
+	// We gave up on it in the meantime
+	if ( state_ != state::connecting )
+		return;
+
+	if ( c.result < 0 )
+		disconnect_internal( disconnect_reasons::reason_handshake_fail );
+	else
+		begin_handshake( );
+}
 
-				process_buffer_.insert( process_buffer_.end( ), buffer.begin( ), buffer.begin( ) + bytes_received );
+void async_tcp_client::handle_uring_send( const detail::uring::completion& c ) {
+	{
+		std::lock_guard guard( mtx_ );
+
+		sending_ = false;
+
+		// Whatever we didn't get to send is dropped along with the connection
+		if ( state_ == state::disconnected ) {
+			send_queue_.clear( );
+			return;
 		}
 
-		std::this_thread::sleep_for( std::chrono::milliseconds( 1 ) );
+		if ( c.result >= 0 ) {
+			send_queue_.advance( c.result );
+			bytes_sent_ += c.result;
+
+			complete_sends( );
+
+			// Whatever got queued in the meantime goes out right away
+			if ( !send_queue_.gather( max_send_segments_ ) )
+				return;
+
+			sending_ = context_->uring.send_message( socket_, send_queue_.get_message( ), token_ );
+
+			if ( sending_ )
+				return;
+		}
+	}
+
+	disconnect_internal( disconnect_reasons::reason_error );
+}
+
+void async_tcp_client::handle_uring_recv( const detail::uring::completion& c ) {
+	// Whatever is still on its way once we're disconnected gets dropped
+	bool ours = state_ != state::disconnected;
+
+	if ( c.result > 0 && ours ) {
+		process_buffer_.append( context_->uring.buffer( c.buffer_id ), c.result );
+
+		if ( socket_options_.quick_ack )
+			detail::quick_ack( socket_ );
 	}
-}
\ No newline at end of file
+
+	if ( c.has_buffer )
+		context_->uring.recycle_buffer( c.buffer_id );
+
+	if ( !ours )
+		return;
+
+	bool rearm_failed = false;
+
+	// The multishot receive has terminated, rearm it unless we're done
+	if ( !c.more && ( c.result > 0 || c.result == -ENOBUFS ) )
+		rearm_failed = !context_->uring.recv_multishot( socket_, token_ );
+
+	if ( c.result > 0 )
+		process_data( );
+
+	if ( state_ == state::disconnected )
+		return;
+
+	// Nothing would tell us about what the server sends anymore
+	if ( rearm_failed ) {
+		disconnect_internal( disconnect_reasons::reason_error );
+		return;
+	}
+
+	if ( c.more )
+		return;
+
+	if ( c.result == 0 ) // Server disconnected us
+		disconnect_internal( disconnect_reasons::reason_server_stop );
+	else if ( c.result < 0 && c.result != -ENOBUFS ) // An error occurred
+		disconnect_internal( disconnect_reasons::reason_error );
+}
@@ -1,106 +1,388 @@
 #pragma once
 
-#pragma region os_dependent_includes
-
-#ifdef _WIN32	// Windows Machine
-
-#include <WinSock2.h>
-#include <WS2tcpip.h>
-
-#pragma comment(lib, "ws2_32.lib")
-
-#elif __linux__	// Linux machine
-
-// todo: add linux includes
-#error Linux support not yet implemented (missing includes, untested on Linux).
-
-#else
-#error OS unknown or not supported.
-#endif // _WIN32
-
-#pragma endregion os_dependent_includes
+#include "../../shared/reactor/io_engine.h"
+#include "../../shared/buffers/ring_buffer.h"
+#include "../../shared/buffers/send_queue.h"
+#include "../../shared/timer/timer_wheel.h"
+#include "../../shared/coro/awaiters.h"
+#include "client_loop.h"
 
 #include <mutex>
 #include <thread>
 #include <vector>
+#include <deque>
+#include <atomic>
+#include <chrono>
+#include <string>
 #include <functional>
 #include <unordered_map>
+#include <condition_variable>
 
 #include "../../shared/packets/packets.h"
-
-// TODO: 
-// -add handshake timeout so we don't wait infinitely
-// -check if connected_ needs a mutex
-// -fix the stupid lag on handshake (why tf does it happen???)
+#include "../../shared/packets/packet_handlers.h"
 
 namespace fi {
+	// See async_tcp_client::set_handshake_mode
+	enum class handshake_mode : std::uint8_t {
+		wait_for_server = 0,	// Nothing goes out before the server answered our hello
+		zero_rtt				// Packets go out right behind our hello
+	};
+
 	class async_tcp_client {
 	public:
+		// Runs on a loop thread of its own while connected
 		async_tcp_client( );
+
+		// Runs on one of the loop's threads instead, along with the loop's other clients
+		explicit async_tcp_client( client_loop& loop );
+
 		~async_tcp_client( );
 
-		bool connect( std::string_view ip, std::string_view port );
+		// Awaitable returned by async_connect, resumes with whether the handshake succeeded
+		class connect_operation {
+		public:
+			connect_operation( async_tcp_client* client, std::string_view ip, std::string_view port, io_engine engine )
+				: client_( client ), ip_( ip ), port_( port ), engine_( engine ) { }
+
+			bool await_ready( ) const noexcept {
+				return false;
+			}
+
+			// Throws the same exceptions as connect
+			void await_suspend( std::coroutine_handle< > h );
+
+			bool await_resume( ) const noexcept {
+				return client_->is_connected( );
+			}
+
+		private:
+			async_tcp_client* client_ = nullptr;
+
+			std::string ip_ = { }, port_ = { };
+			io_engine engine_ = io_engine::reactor;
+		};
+
+		// Blocks until the handshake is done. The io_uring engine needs Linux 6.0 or newer,
+		// connect throws if it isn't available. Clients on a client_loop use the loop's engine.
+		bool connect( std::string_view ip, std::string_view port, io_engine engine = io_engine::reactor );
+
+		// Same as connect, but suspends the calling coroutine rather than blocking. It
+		// continues on the client's loop thread once the handshake is done.
+		connect_operation async_connect( std::string_view ip, std::string_view port, io_engine engine = io_engine::reactor );
+
+		// Waits until we're disconnected, unless called from a loop thread
 		void disconnect( );
 
 		bool is_connected( );
 
-		void send_packet( packets::base_packet* const packet );
+		// How busy the connection is, cheap enough to ask before every send (see client_pool).
+		// Calls waiting for their response, and bytes queued that the socket didn't take yet.
+		std::uint32_t calls_in_flight( ) const;
+		std::uint64_t send_backlog( ) const;
+
+		// When we last heard from the server. Servers send heartbeats when they have
+		// nothing else to send, so a connection that stays silent for long is dead.
+		std::chrono::steady_clock::time_point last_receive( ) const;
+
+		// Only queues the packet, our loop thread sends it. Packets sent while we're
+		// still connecting go out once the handshake is done.
+		template < packets::packet_type packet_t >
+		void send_packet( packet_t* const packet ) {
+			if ( !packet )
+				throw exception( exception::reason_id::packet_nullptr, "async_tcp_client::send_packet: packet was nullptr" );
+
+			send_buffer( build_packet( *packet ) );
+		}
+
+		// Lets a coroutine wait for the next packet of the given type, ahead of handlers and
+		// the callback. Resumes on our loop thread, with nullopt once we're disconnected.
+		template < typename packet_t >
+		detail::receive_operation< async_tcp_client, packet_t > receive( ) {
+			return detail::receive_operation< async_tcp_client, packet_t >( this );
+		}
+
+		// Same as send_packet, but resumes the coroutine once the packet was written to the
+		// socket (on our loop thread). Resumes with false if we got disconnected first.
+		template < packets::packet_type packet_t >
+		detail::send_operation< async_tcp_client > send( packet_t* const packet ) {
+			if ( !packet )
+				throw exception( exception::reason_id::packet_nullptr, "async_tcp_client::send: packet was nullptr" );
+
+			return detail::send_operation< async_tcp_client >( this, build_packet( *packet ) );
+		}
+
+		// Sends the request and resumes the coroutine with the server's response (see on_call and
+		// reply on the server). Any number of calls can be in flight at once, they complete in
+		// whatever order the server answers them. Resumes with nullopt once the timeout passed
+		// (0 waits for as long as we're connected), we got disconnected or the response didn't
+		// match its type. Resumes on our loop thread.
+		template < packets::packet_type request_t, packets::packet_type response_t >
+		detail::call_operation< async_tcp_client, response_t > call( request_t* const request, std::chrono::milliseconds timeout = { } ) {
+			if ( !request )
+				throw exception( exception::reason_id::packet_nullptr, "async_tcp_client::call: packet was nullptr" );
+
+			auto id = next_call_id_++;
+			return detail::call_operation< async_tcp_client, response_t >( this, id, build_packet( *request, packets::flags::fl_request, id ), timeout );
+		}
 
 		// The callback will be called once a packet is received.
-		// You must register your callback before you connect to
-		// the server, as not doing so will result in an exception.
-		void register_callback( std::function< void( async_tcp_client* const, const packets::packet_id, packets::detail::binary_serializer& ) > callback_fn );
+		// You must register your callback (or a handler, see below) before
+		// you connect to the server, as not doing so will result in an exception.
+		// Callbacks and handlers run on the client's loop thread.
+		void register_callback( std::function< void( async_tcp_client* const, const packets::packet_id, packets::detail::packet_reader& ) > callback_fn );
+
+		// Takes the callback's place: packets that arrive back to back get handed over
+		// together, so handling them can share a lock, a transaction and so on. Packets
+		// with a handler (or a coroutine waiting for them) still go there, in order.
+		// The packets' data is only valid until the callback returns.
+		void register_batch_callback( std::function< void( async_tcp_client* const, std::span< const packets::received_packet > ) > callback_fn );
+
+		// Registers a handler for a single packet type, it gets the packet already deserialized:
+		// void( async_tcp_client* const, packet_t& ). Packets without a handler go to the callback.
+		template < typename packet_t, typename fn_t >
+		void on( fn_t&& fn ) {
+			handlers_.on< packet_t >( std::forward< fn_t >( fn ) );
+		}
 
 		// This function will be called as soon as the client disconnects or has been disconnected from the server.
 		void register_disconnect_callback( std::function< void( async_tcp_client* const ) > callback_fn );
 
+		// The most we buffer before handing packets to the callbacks, 16 MB unless set. Packets
+		// bigger than that get us disconnected. 0 disables it. Set it before you connect.
+		void set_receive_limit( std::uint32_t limit );
+
+		// With zero_rtt we count as connected as soon as the TCP connection is up and our hello
+		// is on its way. connect returns right away and packets go out along with the hello,
+		// so the first response arrives a round trip earlier. The server's hello gets checked
+		// once it arrives, if it's bad (or doesn't arrive in time) we disconnect, disconnect
+		// callback included. Set it before you connect.
+		void set_handshake_mode( handshake_mode mode );
+
+		// Applied to our socket on every connect, connect throws if the OS refuses any of it.
+		// cpu_affinity pins the loop thread we run on our own, a client_loop takes its own.
+		// Set it before you connect.
+		void set_socket_options( const socket_options& options );
+
 	private:
 	#ifdef _WIN32
 		WSADATA wsa_data_ = { };
 	#endif // _WIN32
-		
-		packets::header construct_packet_header( packets::packet_length length, packets::packet_id id, packets::packet_flags flags );
 
-		// We have a seperate function which will perform a handshake with the server
-		// to make sure we are talking to a server which will understand our packets.
-		bool perform_handshake( );
+		template < typename, typename > friend class detail::receive_operation;
+		template < typename > friend class detail::send_operation;
+		template < typename, typename > friend class detail::call_operation;
 
-		// Function for sending our packet
-		bool send_packet_internal( void* const data, const packets::packet_length length );
+		friend class client_loop;
+
+		enum class state : std::uint8_t {
+			disconnected = 0,
+			connecting,
+			handshaking,
+			connected,
+			disconnecting	// Flushing whatever is left before we close the socket
+		};
 
 		// Handles disconnecting
 		enum class disconnect_reasons : std::uint8_t {
 			reason_handshake_fail = 0,
-			reason_error, 
+			reason_error,
 			reason_stop,
 			reason_server_stop
 		};
 
+		packets::header construct_packet_header( packets::packet_length length, packets::packet_id id, packets::packet_flags flags );
+
+		// Builds the packet as it goes out on the wire
+		template < typename packet_t >
+		detail::shared_buffer build_packet( packet_t& packet, packets::packet_flags flags = packets::flags::fl_none, packets::call_id call = 0 ) {
+			auto data = packets::detail::encode_packet( packet, flags, call );
+
+			if ( !data )
+				throw exception( exception::reason_id::serialization_error, "async_tcp_client::build_packet: serialize wrote a different amount than serialized_size returned" );
+
+			return data;
+		}
+
+		detail::shared_buffer build_packet( packets::packet_id id, packets::packet_flags flags );
+
+		// Resolves the address and hands us to a loop thread, which takes it from there
+		void begin_connect( std::string_view ip, std::string_view port, io_engine engine );
+		void start_loop( );
+
+		// Whoever waits for our connection to be over (connect, disconnect, the destructor)
+		void wait_detached( );
+		void finish_detach( );
+
+		client_loop& loop( );
+		bool on_loop_thread( ) const;
+
+		// Once the TCP connection is up we perform a handshake with the server to
+		// make sure we are talking to a server which will understand our packets
+		void begin_handshake( );
+		bool complete_handshake( );
+		void finish_connect( bool success );
+
+		// For the few bytes we send ahead of everything queued up. Doesn't block.
+		bool send_packet_internal( void* const data, const packets::packet_length length );
+
+		// Queues a built packet, for any thread
+		void send_buffer( const detail::shared_buffer& data );
+
+		// The caller holds mtx_ and wakes the loop thread if we return true
+		bool enqueue( const detail::shared_buffer& data );
+
+		// Hands us to our loop thread, which calls handle_pending and flushes
+		void wake_loop( );
+
+		// Connecting or connected, as opposed to shutting down
+		bool is_open( ) const;
+
+		// Everything below only ever runs on the loop thread
+		void start_connect( );
 		void disconnect_internal( const disconnect_reasons reason );
+		void handle_pending( );
+		void handle_event( std::uint32_t events );
 
-		// These functions are running in a thread
-		void process_data( );
+		// Has the loop flush and resume our coroutines before it goes back to sleep
+		void mark_ready( );
+
+		// Disconnected, with the kernel done with everything of ours
+		bool is_finished( ) const;
+
+		// Connecting, the handshake and flushing on disconnect may take timeout_ each
+		void set_deadline( );
+		void check_deadline( );
+
+		void flush_sends( );
+		bool write_pending( );
+		void complete_sends( );
+		void resume_waiters( );
 		void receive_data( );
+		void process_data( );
+		void flush_batch( );
 
-		bool connected_ = false;
+		bool add_receiver( detail::receive_waiter& waiter );
+		bool add_sender( detail::send_waiter& waiter, const detail::shared_buffer& data );
+		bool add_call( detail::call_waiter& waiter, const detail::shared_buffer& data );
 
-		// This specifies the buffer size when receiving data. 
-		// It does not affect the size of the processing queue.
+		// Starts waiting for the call's response and its deadline
+		void track_call( detail::call_waiter* waiter );
+		void expire_call( packets::call_id call );
+		void complete_call( packets::call_id call, packets::packet_id id, packets::detail::packet_reader& reader );
+
+		// Everyone waiting on something from the server learns that it won't arrive
+		void drop_waiters( );
+
+		// False if the ring had no room for the send
+		bool submit_uring_send( );
+		void handle_uring_connect( const detail::uring::completion& c );
+		void handle_uring_send( const detail::uring::completion& c );
+		void handle_uring_recv( const detail::uring::completion& c );
+
+		std::atomic< state > state_ = state::disconnected;
+
+		io_engine engine_ = io_engine::reactor;
+
+		// This specifies the size of a single receive. The
+		// buffer grows as needed to fit whole packets.
 		const std::uint32_t buffer_size_ = PACKET_BUFFER_SIZE;
 
-		SOCKET socket_ = 0;
+		// See set_receive_limit
+		std::uint32_t receive_limit_ = 16 * 1024 * 1024;
 
-		std::mutex disconnect_mtx_ = { }, process_mtx_ = { }, send_mtx_ = { };
+		// See set_socket_options
+		socket_options socket_options_ = { };
 
-		std::vector< std::uint8_t > process_buffer_ = { };
+		handshake_mode handshake_mode_ = handshake_mode::wait_for_server;
 
-		std::function< void( async_tcp_client* const ) > on_disconnect_callback_ = { };
-		std::function< void( async_tcp_client* const, const packets::packet_id, packets::detail::binary_serializer& ) > process_callback_ = { };
+		// Connected with zero_rtt, but the server's hello didn't arrive yet. Only touched by the loop thread.
+		bool server_hello_pending_ = false;
+
+		SOCKET socket_ = INVALID_SOCKET;
+
+		// Where we're connecting to, io_uring reads it while connecting
+		sockaddr_storage address_ = { };
+		std::uint32_t address_length_ = 0;
+
+		// Connecting, the handshake and flushing on disconnect may take this long each
+		const std::chrono::seconds timeout_ = std::chrono::seconds( 5 );
+		detail::timer_wheel::timer_id deadline_timer_ = 0;
+
+		// The loop we were given, or the one we run on our own
+		client_loop* loop_ = nullptr;
+		std::unique_ptr< client_loop > own_loop_ = { };
 
-		std::thread processing_thread_ = { }, receiving_thread_ = { };
+		// The loop thread driving our connection. Our token tags our reactor events and
+		// io_uring requests, it changes with every connection, so whatever is still
+		// around for a previous one gets dropped. 0 until the loop thread picked us up.
+		client_loop::context* context_ = nullptr;
+		std::uint64_t token_ = 0;
 
-		// This will help us in serializing our packet data
-		packets::detail::binary_serializer serializer = { };
+		// Guarded by the context's mutex. attached: the loop thread takes work from us,
+		// queued: we're in its pending list.
+		bool attached_ = false, queued_ = false;
+
+		// Waiting in the context's ready list, only touched by the loop thread
+		bool ready_ = false;
+
+		// Maximum amount of packets written with a single syscall
+		const std::uint32_t max_send_segments_ = 64;
+
+		// Set while io_uring still has our connect in flight
+		bool connect_pending_ = false;
+
+		detail::ring_buffer process_buffer_ = { };
+
+		// Packets process_data collected for the batch callback
+		std::vector< packets::received_packet > batch_ = { };
+
+		// Guards everything below that other threads may hand to the loop thread
+		std::mutex mtx_ = { };
+
+		detail::send_queue send_queue_ = { };
+
+		// flush_pending: the loop thread flushes before it goes back to sleep.
+		// sending: io_uring has a send in flight, or the reactor waits for the
+		// socket to become writable. Only one write may be in flight at a time,
+		// otherwise the kernel is free to reorder them.
+		bool flush_pending_ = false, sending_ = false;
+
+		bool disconnect_requested_ = false;
+
+		// Bytes queued and written over the whole connection. Queued only changes under
+		// mtx_ and written only on the loop thread, they're atomic for send_backlog.
+		std::atomic_uint64_t bytes_queued_ = 0, bytes_sent_ = 0;
+
+		std::deque< detail::send_waiter* > senders_ = { };
+		std::vector< detail::receive_waiter* > receivers_to_add_ = { };
+		std::vector< detail::call_waiter* > calls_to_add_ = { };
+
+		// Blocking connect waits on this, async_connect has connect_waiter_ resumed
+		std::condition_variable connect_cv_ = { };
+		bool connect_done_ = false, connect_refused_ = false;
+		std::coroutine_handle< > connect_waiter_ = { };
+
+		// Set once the loop thread let go of us
+		std::condition_variable detached_cv_ = { };
+		bool detached_ = true;
+
+		// Only touched by the loop thread
+		std::vector< detail::receive_waiter* > receivers_ = { };
+		std::vector< std::coroutine_handle< > > to_resume_ = { };
+
+		// Calls waiting for their response, their deadlines run on the context's timers
+		std::unordered_map< packets::call_id, detail::call_waiter* > calls_ = { };
+
+		std::atomic< packets::call_id > next_call_id_ = 1;
+		std::atomic_uint32_t calls_in_flight_ = 0;
+
+		std::atomic< std::chrono::steady_clock::rep > last_receive_ = 0;
+
+		std::function< void( async_tcp_client* const ) > on_disconnect_callback_ = { };
+		std::function< void( async_tcp_client* const, const packets::packet_id, packets::detail::packet_reader& ) > process_callback_ = { };
+		std::function< void( async_tcp_client* const, std::span< const packets::received_packet > ) > batch_callback_ = { };
+
+		packets::detail::handler_table< async_tcp_client* > handlers_ = { };
 
 	public:
 		class exception : public std::exception {
@@ -114,17 +396,20 @@ namespace fi {
 				connection_error,
 				packet_nullptr,
 				null_callback,
-				no_callback
-
+				no_callback,
+				engine_unavailable,
+				reactor_failure,
+				affinity_failure,
+				serialization_error
 			};
 
-			exception( reason_id reason, std::string_view what ) : reason_( reason ), what_( what ) { };
+			exception( reason_id reason, std::string_view what ) : what_( what ), reason_( reason ) { };
 
 			virtual const char* what( ) const noexcept {
 				return what_.data( );
 			}
 
-			const reason_id get_reason( ) {
+			reason_id get_reason( ) const {
 				return reason_;
 			}
 
@@ -133,4 +418,4 @@ namespace fi {
 			reason_id reason_ = reason_id::none;
 		};
 	};
-} // namespace fi
\ No newline at end of file
+} // namespace fi
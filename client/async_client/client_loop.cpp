@@ -0,0 +1,243 @@
+#include "client_loop.h"
+#include "async_client.h"
+
+#include <algorithm>
+
+using namespace fi;
+
+client_loop::client_loop( std::uint32_t threads, io_engine engine, std::vector< std::uint32_t > cpu_affinity )
+	: client_loop( threads, engine, std::move( cpu_affinity ), 1024, 256 ) { }
+
+client_loop::client_loop( std::uint32_t threads, io_engine engine, std::vector< std::uint32_t > cpu_affinity, std::uint32_t uring_entries, std::uint16_t uring_buffer_count )
+	: engine_( engine ), cpu_affinity_( std::move( cpu_affinity ) ), uring_entries_( uring_entries ), uring_buffer_count_( uring_buffer_count ) {
+	if ( !threads )
+		threads = std::max( 1u, std::thread::hardware_concurrency( ) );
+
+	for ( std::uint32_t i = 0; i < threads; i++ ) {
+		auto& ctx = *contexts_.emplace_back( std::make_unique< context >( ) );
+
+		if ( engine_ == io_engine::uring && !ctx.uring.create( uring_entries_, uring_buffer_count_, PACKET_BUFFER_SIZE ) ) {
+			contexts_.clear( );
+			throw exception( exception::reason_id::engine_unavailable, "client_loop::client_loop: io_uring is not available" );
+		}
+
+		if ( engine_ == io_engine::reactor && !ctx.reactor.create( ) ) {
+			contexts_.clear( );
+			throw exception( exception::reason_id::reactor_failure, "client_loop::client_loop: failed to create reactor" );
+		}
+	}
+
+	running_ = true;
+
+	for ( auto& ctx : contexts_ ) {
+		ctx->thread = std::thread( engine_ == io_engine::uring ? &client_loop::run_uring : &client_loop::run_reactor, this, std::ref( *ctx ) );
+	}
+
+	for ( std::size_t i = 0; i < contexts_.size( ); i++ ) {
+		if ( !detail::pin_thread( contexts_[ i ]->thread, cpu_affinity_, i ) ) {
+			stop( );
+			throw exception( exception::reason_id::affinity_failure, "client_loop::client_loop: failed to pin loop thread" );
+		}
+	}
+}
+
+client_loop::~client_loop( ) {
+	stop( );
+}
+
+bool client_loop::is_loop_thread( ) const {
+	auto id = std::this_thread::get_id( );
+
+	return std::any_of( contexts_.begin( ), contexts_.end( ), [ & ]( auto& ctx ) { return ctx->loop_id == id; } );
+}
+
+void client_loop::stop( ) {
+	running_ = false;
+
+	for ( auto& ctx : contexts_ ) {
+		ctx->reactor.wake( );
+		ctx->uring.wake( );
+	}
+
+	for ( auto& ctx : contexts_ ) {
+		if ( ctx->thread.joinable( ) )
+			ctx->thread.join( );
+
+		// Closing the ring cancels whatever is still in flight
+		ctx->reactor.destroy( );
+		ctx->uring.destroy( );
+	}
+
+	contexts_.clear( );
+}
+
+client_loop::context& client_loop::next_context( ) {
+	return *contexts_[ next_context_++ % contexts_.size( ) ];
+}
+
+std::uint64_t client_loop::token_of( context& ctx, std::uint32_t index ) {
+	return std::uint64_t( ctx.clients.generation( index ) ) << 24 | index;
+}
+
+async_tcp_client* client_loop::find_client( context& ctx, std::uint64_t token ) {
+	auto client = ctx.clients.get( std::uint32_t( token & 0xFFFFFF ), std::uint32_t( token >> 24 ) );
+
+	return client ? *client : nullptr;
+}
+
+void client_loop::handle_pending( context& ctx ) {
+	std::vector< async_tcp_client* > pending = { };
+
+	{
+		std::lock_guard guard( ctx.mtx );
+
+		pending.swap( ctx.pending );
+
+		for ( auto client : pending )
+			client->queued_ = false;
+	}
+
+	for ( auto client : pending ) {
+		// The first we hear of a client is him wanting to connect
+		if ( !client->token_ )
+			attach( ctx, client );
+
+		client->handle_pending( );
+		client->mark_ready( );
+	}
+}
+
+void client_loop::attach( context& ctx, async_tcp_client* client ) {
+	// Not that a single thread would ever drive that many, he fails like a refused connect
+	if ( ctx.clients.full( ) ) {
+		client->disconnect_internal( async_tcp_client::disconnect_reasons::reason_handshake_fail );
+		return;
+	}
+
+	auto index = ctx.clients.emplace( client );
+
+	client->token_ = token_of( ctx, index );
+	client->start_connect( );
+}
+
+void client_loop::detach( context& ctx, async_tcp_client* client ) {
+	// He might never have gotten a slot
+	if ( client->token_ )
+		ctx.clients.release( std::uint32_t( client->token_ & 0xFFFFFF ) );
+
+	client->token_ = 0;
+
+	// Serving him might have marked him ready again on the way out
+	if ( client->ready_ ) {
+		client->ready_ = false;
+		std::erase( ctx.ready, client );
+	}
+
+	{
+		std::lock_guard guard( ctx.mtx );
+
+		// Nobody can hand him any more work from here on
+		client->attached_ = client->queued_ = false;
+		std::erase( ctx.pending, client );
+	}
+
+	// Whoever waits for him may destroy him right away, so this comes last
+	client->finish_detach( );
+}
+
+void client_loop::serve_ready( context& ctx ) {
+	// Serving a client may hand work to others of ours (a coroutine sending on
+	// another connection), keep going until everybody is done
+	while ( true ) {
+		handle_pending( ctx );
+
+		if ( ctx.ready.empty( ) )
+			break;
+
+		auto ready = std::move( ctx.ready );
+		ctx.ready.clear( );
+
+		for ( auto client : ready ) {
+			client->ready_ = false;
+
+			// Everything queued up since the last iteration goes out now
+			client->flush_sends( );
+			client->resume_waiters( );
+
+			if ( client->is_finished( ) )
+				detach( ctx, client );
+		}
+	}
+}
+
+void client_loop::run_reactor( context& ctx ) {
+	ctx.loop_id = std::this_thread::get_id( );
+
+	std::vector< detail::reactor::event > events( max_events_ );
+
+	while ( running_ ) {
+		// Sleep until one of our servers has something for us or someone queued a packet
+		auto num_events = ctx.reactor.wait( events, ctx.timers.next_timeout( std::chrono::steady_clock::now( ), -1 ) );
+
+		for ( std::size_t i = 0; i < num_events; i++ ) {
+			// The client might have been disconnected while we were waiting
+			auto client = find_client( ctx, events[ i ].token );
+
+			if ( !client )
+				continue;
+
+			client->handle_event( events[ i ].events );
+			client->mark_ready( );
+		}
+
+		ctx.timers.advance( std::chrono::steady_clock::now( ) );
+		serve_ready( ctx );
+	}
+}
+
+void client_loop::run_uring( context& ctx ) {
+	ctx.loop_id = std::this_thread::get_id( );
+
+	std::vector< detail::uring::completion > completions( max_events_ );
+
+	while ( running_ ) {
+		// Everything our clients queued up goes out in a single syscall
+		ctx.uring.submit_and_wait( ctx.timers.next_timeout( std::chrono::steady_clock::now( ), -1 ) );
+
+		auto num_completions = ctx.uring.completions( completions );
+
+		for ( std::size_t i = 0; i < num_completions; i++ ) {
+			auto& c = completions[ i ];
+
+			if ( c.type != detail::uring::op::connect && c.type != detail::uring::op::recv && c.type != detail::uring::op::send )
+				continue;
+
+			auto client = find_client( ctx, c.data );
+
+			// Completions for clients that are gone are dropped, their buffers go back to the kernel
+			if ( !client ) {
+				if ( c.has_buffer )
+					ctx.uring.recycle_buffer( c.buffer_id );
+
+				continue;
+			}
+
+			switch ( c.type ) {
+				case detail::uring::op::connect:
+					client->handle_uring_connect( c );
+					break;
+				case detail::uring::op::recv:
+					client->handle_uring_recv( c );
+					break;
+				default:
+					client->handle_uring_send( c );
+					break;
+			}
+
+			client->mark_ready( );
+		}
+
+		ctx.timers.advance( std::chrono::steady_clock::now( ) );
+		serve_ready( ctx );
+	}
+}
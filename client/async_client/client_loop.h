@@ -0,0 +1,129 @@
+#pragma once
+
+#include "../../shared/reactor/io_engine.h"
+#include "../../shared/platform/socket_options.h"
+#include "../../shared/slab/slab.h"
+#include "../../shared/timer/timer_wheel.h"
+
+#include <thread>
+#include <mutex>
+#include <vector>
+#include <memory>
+#include <atomic>
+#include <string>
+
+namespace fi {
+	class async_tcp_client;
+
+	// Drives any number of clients from a fixed set of threads, rather than every client
+	// running a thread of its own. Each thread has its own reactor (or io_uring ring) and
+	// timers, clients are spread over the threads as they connect and stay on theirs until
+	// they disconnect. Clients using a loop have to be destroyed before the loop is.
+	class client_loop {
+	public:
+		// 0 starts one thread per hardware thread. The io_uring engine needs Linux 6.0 or
+		// newer, the constructor throws if it isn't available. Thread i gets pinned to
+		// cpu_affinity[ i % size ], see socket_options.
+		explicit client_loop( std::uint32_t threads = 1, io_engine engine = io_engine::reactor, std::vector< std::uint32_t > cpu_affinity = { } );
+		~client_loop( );
+
+		client_loop( const client_loop& ) = delete;
+		client_loop& operator=( const client_loop& ) = delete;
+
+		io_engine engine( ) const {
+			return engine_;
+		}
+
+		// Whether the calling thread is one of ours
+		bool is_loop_thread( ) const;
+
+	private:
+		friend class async_tcp_client;
+
+		// A loop thread and the clients it drives
+		struct context {
+			detail::reactor reactor = { };
+			detail::uring uring = { };
+
+			std::thread thread = { };
+			std::atomic< std::thread::id > loop_id = { };
+
+			// Reactor events and io_uring requests are tagged with the client's slot and
+			// generation, so whatever is still around for a client that's gone gets dropped.
+			// Only touched by the loop thread.
+			detail::slab< async_tcp_client* > clients = { };
+
+			// Clients other threads handed work to (or that want to connect), guarded by mtx
+			std::mutex mtx = { };
+			std::vector< async_tcp_client* > pending = { };
+
+			// Clients we touched this iteration, they flush and resume their coroutines
+			// before we go back to sleep. Only touched by the loop thread.
+			std::vector< async_tcp_client* > ready = { };
+
+			// Connect, handshake and call deadlines of all our clients
+			detail::timer_wheel timers = { };
+		};
+
+		// Sizes the io_uring rings, a client running on his own gets by with smaller ones
+		client_loop( std::uint32_t threads, io_engine engine, std::vector< std::uint32_t > cpu_affinity, std::uint32_t uring_entries, std::uint16_t uring_buffer_count );
+
+		void stop( );
+
+		// Picks the thread a connecting client goes to
+		context& next_context( );
+
+		static std::uint64_t token_of( context& ctx, std::uint32_t index );
+		static async_tcp_client* find_client( context& ctx, std::uint64_t token );
+
+		// These only ever run on the context's loop thread
+		void handle_pending( context& ctx );
+		void attach( context& ctx, async_tcp_client* client );
+		void detach( context& ctx, async_tcp_client* client );
+		void serve_ready( context& ctx );
+
+		void run_reactor( context& ctx );
+		void run_uring( context& ctx );
+
+		io_engine engine_ = io_engine::reactor;
+		std::vector< std::uint32_t > cpu_affinity_ = { };
+
+		std::atomic_bool running_ = false;
+
+		std::vector< std::unique_ptr< context > > contexts_ = { };
+		std::atomic_uint32_t next_context_ = 0;
+
+		// Size of the io_uring submission queues and how many receive buffers each thread
+		// gives the kernel, shared by all of its clients
+		std::uint32_t uring_entries_ = 1024;
+		std::uint16_t uring_buffer_count_ = 256;
+
+		// Maximum amount of socket events handled per wakeup
+		const std::uint32_t max_events_ = 256;
+
+	public:
+		class exception : public std::exception {
+		public:
+			enum reason_id : std::uint8_t {
+				none = 0,
+				engine_unavailable,
+				reactor_failure,
+				affinity_failure
+			};
+
+			exception( reason_id reason, std::string_view what ) : what_( what ), reason_( reason ) { };
+
+			virtual const char* what( ) const noexcept {
+				return what_.data( );
+			}
+
+			reason_id get_reason( ) const {
+				return reason_;
+			}
+
+		private:
+			std::string what_ = { };
+			reason_id reason_ = reason_id::none;
+		};
+	};
+} // namespace fi
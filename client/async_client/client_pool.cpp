@@ -0,0 +1,342 @@
+#include "client_pool.h"
+
+#include <algorithm>
+
+using namespace fi;
+
+// FNV-1a, places the virtual nodes on the ring
+static std::uint64_t hash_string( std::string_view s ) {
+	std::uint64_t hash = 0xcbf29ce484222325ull;
+
+	for ( auto c : s ) {
+		hash ^= std::uint8_t( c );
+		hash *= 0x100000001b3ull;
+	}
+
+	return hash;
+}
+
+// Spreads keys over the ring, callers tend to use sequential ones
+static std::uint64_t mix_key( std::uint64_t key ) {
+	key = ( key ^ ( key >> 30 ) ) * 0xbf58476d1ce4e5b9ull;
+	key = ( key ^ ( key >> 27 ) ) * 0x94d049bb133111ebull;
+
+	return key ^ ( key >> 31 );
+}
+
+client_pool::client_pool( client_loop& loop, std::vector< pool_endpoint > endpoints, pool_options options ) : loop_( loop ), options_( options ) {
+	if ( endpoints.empty( ) )
+		throw exception( exception::reason_id::no_endpoints, "client_pool::client_pool: no endpoints given" );
+
+	options_.connections_per_endpoint = std::max( 1u, options_.connections_per_endpoint );
+	options_.virtual_nodes = std::max( 1u, options_.virtual_nodes );
+
+	for ( std::size_t i = 0; i < endpoints.size( ); i++ ) {
+		auto& e = *endpoints_.emplace_back( std::make_unique< endpoint_state >( ) );
+		e.address = std::move( endpoints[ i ] );
+
+		auto name = e.address.ip + ":" + e.address.port + "#";
+
+		for ( std::uint32_t node = 0; node < options_.virtual_nodes; node++ )
+			ring_.emplace_back( hash_string( name + std::to_string( node ) ), i );
+	}
+
+	std::sort( ring_.begin( ), ring_.end( ) );
+}
+
+client_pool::~client_pool( ) {
+	stop( );
+}
+
+void client_pool::register_setup_callback( std::function< void( async_tcp_client* const ) > callback_fn ) {
+	if ( !callback_fn )
+		throw exception( exception::reason_id::null_callback, "client_pool::register_setup_callback: callback_fn was nullptr" );
+
+	setup_callback_ = std::move( callback_fn );
+}
+
+void client_pool::register_endpoint_callback( std::function< void( client_pool* const, const pool_endpoint&, const endpoint_event ) > callback_fn ) {
+	if ( !callback_fn )
+		throw exception( exception::reason_id::null_callback, "client_pool::register_endpoint_callback: callback_fn was nullptr" );
+
+	endpoint_callback_ = std::move( callback_fn );
+}
+
+bool client_pool::start( ) {
+	if ( !setup_callback_ )
+		throw exception( exception::reason_id::no_callback, "client_pool::start: no setup callback registered" );
+
+	std::unique_lock lock( mtx_ );
+
+	if ( running_ || maintenance_thread_.joinable( ) )
+		throw exception( exception::reason_id::already_running, "client_pool::start: the pool is already running" );
+
+	// Our clients stay around across restarts, so do their callbacks
+	if ( connections_.empty( ) ) {
+		for ( std::size_t i = 0; i < endpoints_.size( ); i++ ) {
+			for ( std::uint32_t j = 0; j < options_.connections_per_endpoint; j++ ) {
+				endpoints_[ i ]->connections.push_back( connections_.size( ) );
+
+				auto& c = connections_.emplace_back( );
+				c.client = std::make_unique< async_tcp_client >( loop_ );
+				c.endpoint = i;
+
+				setup_callback_( c.client.get( ) );
+			}
+		}
+	}
+
+	// Everybody is due for a connect right away
+	for ( auto& e : endpoints_ ) {
+		e->failures = 0;
+		e->retry_at = { };
+		e->tried = false;
+	}
+
+	running_ = true;
+	maintenance_thread_ = std::thread( &client_pool::maintain, this );
+
+	cv_.wait( lock, [ & ]( ) {
+		return std::all_of( endpoints_.begin( ), endpoints_.end( ), [ ]( auto& e ) { return e->tried; } );
+	} );
+
+	return healthy_endpoints( ) > 0;
+}
+
+void client_pool::stop( ) {
+	{
+		std::lock_guard guard( mtx_ );
+		running_ = false;
+	}
+
+	cv_.notify_all( );
+
+	if ( maintenance_thread_.joinable( ) )
+		maintenance_thread_.join( );
+
+	for ( auto& e : endpoints_ )
+		e->up = false;
+
+	// Connects still in flight end right here, nothing gets retried anymore
+	for ( auto& c : connections_ )
+		c.client->disconnect( );
+}
+
+async_tcp_client* client_pool::pick( ) {
+	return pick_least_outstanding( nullptr );
+}
+
+async_tcp_client* client_pool::pick( std::uint64_t key ) {
+	return pick_hashed( key );
+}
+
+std::size_t client_pool::healthy_endpoints( ) const {
+	return std::count_if( endpoints_.begin( ), endpoints_.end( ), [ ]( auto& e ) { return e->up.load( ); } );
+}
+
+async_tcp_client* client_pool::pick_least_outstanding( const endpoint_state* only ) {
+	async_tcp_client* best = nullptr;
+	std::uint32_t best_calls = 0;
+	std::uint64_t best_backlog = 0;
+
+	// There's only a handful of connections per endpoint, going through all of them
+	// is cheaper than keeping them sorted while every sender changes their load.
+	// Packets without a response tie a lot, starting somewhere else every time
+	// spreads those round robin.
+	auto first = next_connection_++;
+
+	auto consider = [ & ]( connection& c ) {
+		if ( !endpoints_[ c.endpoint ]->up || !c.client->is_connected( ) )
+			return;
+
+		auto calls = c.client->calls_in_flight( );
+		auto backlog = c.client->send_backlog( );
+
+		if ( best && ( calls > best_calls || ( calls == best_calls && backlog >= best_backlog ) ) )
+			return;
+
+		best = c.client.get( );
+		best_calls = calls;
+		best_backlog = backlog;
+	};
+
+	if ( only ) {
+		for ( std::size_t i = 0; i < only->connections.size( ); i++ )
+			consider( connections_[ only->connections[ ( first + i ) % only->connections.size( ) ] ] );
+	} else {
+		for ( std::size_t i = 0; i < connections_.size( ); i++ )
+			consider( connections_[ ( first + i ) % connections_.size( ) ] );
+	}
+
+	return best;
+}
+
+async_tcp_client* client_pool::pick_hashed( std::uint64_t key ) {
+	auto hash = mix_key( key );
+	auto it = std::lower_bound( ring_.begin( ), ring_.end( ), std::make_pair( hash, std::size_t( 0 ) ) );
+	auto start = std::size_t( it - ring_.begin( ) );
+
+	// Walk the ring clockwise until we hit an endpoint that's up
+	for ( std::size_t i = 0; i < ring_.size( ); i++ ) {
+		auto& e = *endpoints_[ ring_[ ( start + i ) % ring_.size( ) ].second ];
+
+		if ( !e.up )
+			continue;
+
+		if ( auto client = pick_least_outstanding( &e ) )
+			return client;
+	}
+
+	return nullptr;
+}
+
+task< void > client_pool::connect( std::size_t index ) {
+	auto& c = connections_[ index ];
+	auto& e = *endpoints_[ c.endpoint ];
+
+	bool success = false;
+
+	try {
+		success = co_await c.client->async_connect( e.address.ip, e.address.port );
+	} catch ( async_tcp_client::exception& ) {
+		// Resolving the address failed, same as a refused connect to us
+	}
+
+	connect_done( index, success );
+}
+
+void client_pool::connect_done( std::size_t index, bool success ) {
+	auto& c = connections_[ index ];
+	auto& e = *endpoints_[ c.endpoint ];
+
+	auto now = std::chrono::steady_clock::now( );
+	bool came_up = false, ejected = false;
+
+	{
+		std::lock_guard guard( mtx_ );
+
+		c.connecting = false;
+
+		// Stopping resolves whatever was still connecting
+		if ( !running_ )
+			return;
+
+		if ( success ) {
+			// The endpoint only takes traffic once all of its connections are warm
+			bool all_up = std::all_of( e.connections.begin( ), e.connections.end( ), [ & ]( auto i ) {
+				return connections_[ i ].client->is_connected( );
+			} );
+
+			if ( all_up && !e.up ) {
+				e.failures = 0;
+				e.tried = true;
+				e.up = came_up = true;
+			}
+		} else {
+			e.failures++;
+			e.tried = true;
+			ejected = eject( e, now );
+		}
+	}
+
+	cv_.notify_all( );
+
+	if ( came_up )
+		notify( e, endpoint_event::up );
+	else if ( ejected )
+		notify( e, endpoint_event::ejected );
+}
+
+bool client_pool::eject( endpoint_state& e, std::chrono::steady_clock::time_point now ) {
+	// Back off further with every attempt that failed in a row
+	auto shift = std::min( e.failures ? e.failures - 1 : 0u, 16u );
+	e.retry_at = now + std::min( options_.retry_delay * ( 1 << shift ), options_.max_retry_delay );
+
+	return e.up.exchange( false );
+}
+
+void client_pool::maintain( ) {
+	std::unique_lock lock( mtx_ );
+
+	while ( running_ ) {
+		auto now = std::chrono::steady_clock::now( );
+
+		std::vector< std::size_t > to_close = { }, to_connect = { };
+		std::vector< endpoint_state* > ejected = { }, came_up = { };
+
+		for ( auto& e : endpoints_ ) {
+			if ( e->up ) {
+				// Dropped by the server, or we haven't heard from him in too long
+				bool failed = std::any_of( e->connections.begin( ), e->connections.end( ), [ & ]( auto i ) {
+					auto& client = *connections_[ i ].client;
+					return !client.is_connected( ) || now - client.last_receive( ) > options_.heartbeat_timeout;
+				} );
+
+				if ( !failed )
+					continue;
+
+				if ( eject( *e, now ) )
+					ejected.push_back( e.get( ) );
+
+				// Whatever is left of his connections can't be trusted either
+				for ( auto i : e->connections ) {
+					if ( !connections_[ i ].connecting )
+						to_close.push_back( i );
+				}
+
+				continue;
+			}
+
+			if ( now < e->retry_at )
+				continue;
+
+			bool connecting = std::any_of( e->connections.begin( ), e->connections.end( ), [ & ]( auto i ) { return connections_[ i ].connecting; } );
+
+			// Wait for the last attempt to finish either way
+			if ( connecting )
+				continue;
+
+			auto connects = to_connect.size( );
+
+			for ( auto i : e->connections ) {
+				if ( connections_[ i ].client->is_connected( ) )
+					continue;
+
+				connections_[ i ].connecting = true;
+				to_connect.push_back( i );
+			}
+
+			// All of his connections made it, the last one just didn't see the others
+			if ( connects == to_connect.size( ) ) {
+				e->failures = 0;
+				e->up = true;
+				came_up.push_back( e.get( ) );
+			}
+		}
+
+		// Disconnecting waits for the loop thread and a connect may finish right away,
+		// both end up in connect_done which needs the lock
+		lock.unlock( );
+
+		for ( auto e : ejected )
+			notify( *e, endpoint_event::ejected );
+
+		for ( auto e : came_up )
+			notify( *e, endpoint_event::up );
+
+		for ( auto i : to_close )
+			connections_[ i ].client->disconnect( );
+
+		for ( auto i : to_connect )
+			spawn( connect( i ) );
+
+		lock.lock( );
+
+		cv_.wait_for( lock, options_.check_interval, [ & ]( ) { return !running_; } );
+	}
+}
+
+void client_pool::notify( const endpoint_state& e, endpoint_event event ) {
+	if ( endpoint_callback_ )
+		endpoint_callback_( this, e.address, event );
+}
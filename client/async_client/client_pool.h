@@ -0,0 +1,192 @@
+#pragma once
+
+#include "async_client.h"
+
+#include <mutex>
+#include <thread>
+#include <vector>
+#include <memory>
+#include <atomic>
+#include <chrono>
+#include <string>
+#include <functional>
+#include <condition_variable>
+
+namespace fi {
+	struct pool_endpoint {
+		std::string ip = { }, port = { };
+	};
+
+	struct pool_options {
+		// Warm connections kept to every endpoint
+		std::uint32_t connections_per_endpoint = 2;
+
+		// Servers send a heartbeat every 5 seconds when they have nothing else to send.
+		// An endpoint with a connection that stays silent for this long gets ejected.
+		std::chrono::milliseconds heartbeat_timeout = std::chrono::seconds( 15 );
+
+		// Ejected endpoints get retried after this long, doubling with every failed attempt
+		std::chrono::milliseconds retry_delay = std::chrono::seconds( 1 );
+		std::chrono::milliseconds max_retry_delay = std::chrono::seconds( 30 );
+
+		// How often we look for dead connections and endpoints to retry
+		std::chrono::milliseconds check_interval = std::chrono::milliseconds( 500 );
+
+		// Points every endpoint gets on the hash ring, more spread keys more evenly
+		std::uint32_t virtual_nodes = 100;
+	};
+
+	enum class endpoint_event : std::uint8_t {
+		up = 0,		// All connections are up and take traffic
+		ejected		// A connection failed (or missed its heartbeats), no more traffic until it's back
+	};
+
+	// Keeps warm connections to a set of servers and spreads packets over them. Connecting,
+	// heartbeat checks and retries all happen in the background, sending never waits for a
+	// connection to come up. The pool's clients run on the loop it was given.
+	class client_pool {
+	public:
+		client_pool( client_loop& loop, std::vector< pool_endpoint > endpoints, pool_options options = { } );
+		~client_pool( );
+
+		client_pool( const client_pool& ) = delete;
+		client_pool& operator=( const client_pool& ) = delete;
+
+		// Called once for every client the pool creates, before it first connects. Register
+		// the callbacks and handlers of the client here, they stay across reconnects.
+		// You must register it before you start.
+		void register_setup_callback( std::function< void( async_tcp_client* const ) > callback_fn );
+
+		// Called whenever an endpoint comes up or gets ejected, on a loop thread or the
+		// thread looking after our connections
+		void register_endpoint_callback( std::function< void( client_pool* const, const pool_endpoint&, const endpoint_event ) > callback_fn );
+
+		// Connects to every endpoint and waits until each of them either came up or failed
+		// its first attempt. Returns whether any endpoint is up, the others keep being retried.
+		bool start( );
+
+		// Disconnects everything, waits until it's closed. Don't call it from a loop thread.
+		void stop( );
+
+		// Queues the packet on the connection with the fewest calls waiting for their response
+		// (then the least unsent data). Returns false if no endpoint is up.
+		template < packets::packet_type packet_t >
+		bool send_packet( packet_t* const packet ) {
+			auto client = pick( );
+
+			if ( !client )
+				return false;
+
+			client->send_packet( packet );
+			return true;
+		}
+
+		// Consistent hashing: the same key goes to the same endpoint for as long as it's up,
+		// only keys of an endpoint that gets ejected move elsewhere
+		template < packets::packet_type packet_t >
+		bool send_packet( std::uint64_t key, packet_t* const packet ) {
+			auto client = pick( key );
+
+			if ( !client )
+				return false;
+
+			client->send_packet( packet );
+			return true;
+		}
+
+		// The connection send_packet would use, for calls and coroutines. It stays valid for
+		// as long as the pool does, but may get disconnected any time. nullptr if no endpoint is up.
+		async_tcp_client* pick( );
+		async_tcp_client* pick( std::uint64_t key );
+
+		// Endpoints currently taking traffic
+		std::size_t healthy_endpoints( ) const;
+
+	private:
+		struct endpoint_state {
+			pool_endpoint address = { };
+
+			// Taking traffic, read by every sender
+			std::atomic_bool up = false;
+
+			// Everything below is guarded by mtx_
+			std::uint32_t failures = 0;
+			std::chrono::steady_clock::time_point retry_at = { };
+
+			// Whether the first attempt after start finished either way
+			bool tried = false;
+
+			// Our connections, indices into connections_
+			std::vector< std::size_t > connections = { };
+		};
+
+		struct connection {
+			std::unique_ptr< async_tcp_client > client = { };
+			std::size_t endpoint = 0;
+
+			// Has a connect in flight, guarded by mtx_
+			bool connecting = false;
+		};
+
+		// Runs on the loop thread once the connect is done, either way
+		task< void > connect( std::size_t index );
+		void connect_done( std::size_t index, bool success );
+
+		// The caller holds mtx_. Returns whether the endpoint was up before.
+		bool eject( endpoint_state& e, std::chrono::steady_clock::time_point now );
+
+		// Heartbeat checks and retries
+		void maintain( );
+
+		async_tcp_client* pick_least_outstanding( const endpoint_state* only );
+		async_tcp_client* pick_hashed( std::uint64_t key );
+
+		void notify( const endpoint_state& e, endpoint_event event );
+
+		client_loop& loop_;
+
+		pool_options options_ = { };
+
+		std::vector< std::unique_ptr< endpoint_state > > endpoints_ = { };
+		std::vector< connection > connections_ = { };
+		std::atomic_uint32_t next_connection_ = 0;
+
+		// Virtual nodes of all endpoints sorted by their hash, endpoints that are down get skipped
+		std::vector< std::pair< std::uint64_t, std::size_t > > ring_ = { };
+
+		std::mutex mtx_ = { };
+		std::condition_variable cv_ = { };
+
+		std::thread maintenance_thread_ = { };
+		bool running_ = false;
+
+		std::function< void( async_tcp_client* const ) > setup_callback_ = { };
+		std::function< void( client_pool* const, const pool_endpoint&, const endpoint_event ) > endpoint_callback_ = { };
+
+	public:
+		class exception : public std::exception {
+		public:
+			enum reason_id : std::uint8_t {
+				none = 0,
+				no_endpoints,
+				null_callback,
+				no_callback,
+				already_running
+			};
+
+			exception( reason_id reason, std::string_view what ) : what_( what ), reason_( reason ) { };
+
+			virtual const char* what( ) const noexcept {
+				return what_.data( );
+			}
+
+			reason_id get_reason( ) const {
+				return reason_;
+			}
+
+		private:
+			std::string what_ = { };
+			reason_id reason_ = reason_id::none;
+		};
+	};
+} // namespace fi
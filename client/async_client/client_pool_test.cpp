@@ -0,0 +1,386 @@
+#include "client_pool.h"
+#include "../../server/async_server/async_server.h"
+#include "../../shared/testing/check.h"
+
+#include <map>
+#include <set>
+
+using namespace fi;
+using namespace std::chrono_literals;
+
+using clock_type = std::chrono::steady_clock;
+
+// Polls until done( ) or the timeout runs out, returns done( )
+template < typename fn_t >
+static bool wait_for( fn_t&& done, std::chrono::milliseconds timeout = 5s ) {
+	auto until = clock_type::now( ) + timeout;
+
+	while ( !done( ) ) {
+		if ( clock_type::now( ) > until )
+			return false;
+
+		std::this_thread::sleep_for( 5ms );
+	}
+
+	return true;
+}
+
+// Records which server every key ended up on, a round at a time
+struct key_log {
+	static constexpr std::uint16_t num_keys = 300;
+
+	std::mutex mtx = { };
+	std::map< std::uint8_t, std::vector< int > > rounds = { };
+
+	void record( std::uint8_t round, std::uint16_t key, int server ) {
+		std::lock_guard guard( mtx );
+
+		auto& where = rounds[ round ];
+		where.resize( num_keys, -1 );
+		where[ key ] = server;
+	}
+
+	// Sends every key through the pool, waits until all of them arrived somewhere
+	std::vector< int > send_round( client_pool& pool, std::uint8_t round ) {
+		for ( std::uint16_t key = 0; key < num_keys; key++ ) {
+			packets::example_packet packet = { };
+			packet.some_short = key;
+			packet.some_array = { round };
+
+			FI_CHECK( pool.send_packet( key, &packet ) );
+		}
+
+		wait_for( [ & ]( ) {
+			std::lock_guard guard( mtx );
+			auto& where = rounds[ round ];
+
+			return where.size( ) == num_keys && std::find( where.begin( ), where.end( ), -1 ) == where.end( );
+		} );
+
+		std::lock_guard guard( mtx );
+		return rounds[ round ];
+	}
+};
+
+static std::string port_of( std::uint16_t port ) {
+	return std::to_string( port );
+}
+
+static std::unique_ptr< async_tcp_server > start_server( std::uint16_t port, int index, key_log* keys = nullptr ) {
+	auto server = std::make_unique< async_tcp_server >( );
+
+	server->on< packets::example_packet >( [ index, keys ]( async_tcp_server*, connection_handle, packets::example_packet& packet ) {
+		if ( keys && packet.some_array.size( ) == 1 )
+			keys->record( packet.some_array[ 0 ], packet.some_short, index );
+	} );
+
+	// Requests never get an answer, their calls stay in flight until they time out
+	server->on_call< packets::example_packet >( [ ]( async_tcp_server*, const call_context&, packets::example_packet& ) { } );
+
+	server->start( port_of( port ) );
+	return server;
+}
+
+// Endpoint events as they come in
+struct event_log {
+	std::mutex mtx = { };
+	std::vector< std::pair< std::string, endpoint_event > > events = { };
+
+	void attach( client_pool& pool ) {
+		pool.register_endpoint_callback( [ this ]( client_pool*, const pool_endpoint& endpoint, const endpoint_event event ) {
+			std::lock_guard guard( mtx );
+			events.emplace_back( endpoint.port, event );
+		} );
+	}
+
+	std::size_t count( std::uint16_t port, endpoint_event event ) {
+		std::lock_guard guard( mtx );
+		return std::count( events.begin( ), events.end( ), std::make_pair( port_of( port ), event ) );
+	}
+};
+
+static void setup_client( client_pool& pool ) {
+	pool.register_setup_callback( [ ]( async_tcp_client* const client ) {
+		client->register_callback( [ ]( async_tcp_client*, packets::packet_id, packets::detail::packet_reader& ) { } );
+	} );
+}
+
+// Accepts connections and hangs up on them after hold without a handshake, so every
+// connect to it fails. Remembers when each attempt came in.
+class failing_listener {
+public:
+	failing_listener( std::uint16_t port, std::chrono::milliseconds hold ) : port_( port ) {
+		listener_ = socket( AF_INET, SOCK_STREAM, IPPROTO_TCP );
+
+		int yes = 1;
+		setsockopt( listener_, SOL_SOCKET, SO_REUSEADDR, reinterpret_cast< const char* >( &yes ), sizeof( yes ) );
+
+		auto address = loopback( );
+		FI_CHECK( bind( listener_, reinterpret_cast< sockaddr* >( &address ), sizeof( address ) ) == 0 );
+		FI_CHECK( listen( listener_, 16 ) == 0 );
+
+		thread_ = std::thread( [ this, hold ]( ) {
+			while ( true ) {
+				auto s = accept( listener_, nullptr, nullptr );
+
+				if ( s == INVALID_SOCKET || stopping_ ) {
+					if ( s != INVALID_SOCKET )
+						closesocket( s );
+
+					return;
+				}
+
+				{
+					std::lock_guard guard( mtx_ );
+					attempts_.push_back( clock_type::now( ) );
+				}
+
+				std::this_thread::sleep_for( hold );
+				closesocket( s );
+			}
+		} );
+	}
+
+	~failing_listener( ) {
+		stopping_ = true;
+
+		// Wakes up the accept
+		auto s = socket( AF_INET, SOCK_STREAM, IPPROTO_TCP );
+		auto address = loopback( );
+
+		connect( s, reinterpret_cast< sockaddr* >( &address ), sizeof( address ) );
+
+		thread_.join( );
+
+		closesocket( s );
+		closesocket( listener_ );
+	}
+
+	std::vector< clock_type::time_point > attempts( ) {
+		std::lock_guard guard( mtx_ );
+		return attempts_;
+	}
+
+private:
+	sockaddr_in loopback( ) const {
+		sockaddr_in address = { };
+		address.sin_family = AF_INET;
+		address.sin_port = htons( port_ );
+		address.sin_addr.s_addr = htonl( INADDR_LOOPBACK );
+
+		return address;
+	}
+
+	std::uint16_t port_ = 0;
+	SOCKET listener_ = INVALID_SOCKET;
+
+	std::thread thread_ = { };
+	std::atomic_bool stopping_ = false;
+
+	std::mutex mtx_ = { };
+	std::vector< clock_type::time_point > attempts_ = { };
+};
+
+static pool_options quick_options( ) {
+	pool_options options = { };
+	options.check_interval = 10ms;
+	options.retry_delay = 50ms;
+
+	return options;
+}
+
+// Keys stick to their endpoint, only an ejected endpoint's keys move, and he gets
+// them back once he's up again
+static void consistent_keys( ) {
+	constexpr std::uint16_t base_port = 15410;
+	key_log keys = { };
+
+	std::unique_ptr< async_tcp_server > servers[ 3 ] = { };
+
+	for ( int i = 0; i < 3; i++ )
+		servers[ i ] = start_server( base_port + i, i, &keys );
+
+	client_loop loop( 2 );
+	client_pool pool( loop, { { "127.0.0.1", port_of( base_port ) }, { "127.0.0.1", port_of( base_port + 1 ) }, { "127.0.0.1", port_of( base_port + 2 ) } }, quick_options( ) );
+
+	event_log events = { };
+	events.attach( pool );
+	setup_client( pool );
+
+	FI_CHECK( pool.start( ) );
+	FI_CHECK( pool.healthy_endpoints( ) == 3 );
+
+	auto home = keys.send_round( pool, 0 );
+	FI_CHECK( keys.send_round( pool, 1 ) == home );
+
+	// Every endpoint gets his share
+	for ( int i = 0; i < 3; i++ )
+		FI_CHECK( std::count( home.begin( ), home.end( ), i ) > 30 );
+
+	// Stopped mid-run, his connections drop
+	servers[ 1 ]->stop( );
+
+	FI_CHECK( wait_for( [ & ]( ) { return events.count( base_port + 1, endpoint_event::ejected ) == 1; } ) );
+	FI_CHECK( pool.healthy_endpoints( ) == 2 );
+
+	auto moved = keys.send_round( pool, 2 );
+	bool only_his_moved = true;
+
+	for ( std::size_t key = 0; key < home.size( ); key++ ) {
+		if ( home[ key ] == 1 )
+			only_his_moved &= moved[ key ] == 0 || moved[ key ] == 2;
+		else
+			only_his_moved &= moved[ key ] == home[ key ];
+	}
+
+	FI_CHECK( only_his_moved );
+
+	// Retried until he's back, then his keys return to him
+	servers[ 1 ] = start_server( base_port + 1, 1, &keys );
+
+	FI_CHECK( wait_for( [ & ]( ) { return events.count( base_port + 1, endpoint_event::up ) == 2; } ) );
+	FI_CHECK( pool.healthy_endpoints( ) == 3 );
+	FI_CHECK( keys.send_round( pool, 3 ) == home );
+
+	pool.stop( );
+	FI_CHECK( pool.healthy_endpoints( ) == 0 && !pool.pick( ) && !pool.pick( 1 ) );
+}
+
+static task< void > call_without_answer( async_tcp_client* client ) {
+	packets::example_packet request = { };
+	co_await client->call< packets::example_packet, packets::example_packet >( &request, 2s );
+}
+
+// Calls waiting for their response steer picks away, ties rotate
+static void least_outstanding( ) {
+	constexpr std::uint16_t port = 15420;
+	auto server = start_server( port, 0 );
+
+	auto options = quick_options( );
+	options.connections_per_endpoint = 3;
+
+	client_loop loop( 1 );
+	client_pool pool( loop, { { "127.0.0.1", port_of( port ) } }, options );
+
+	setup_client( pool );
+
+	if ( !FI_CHECK( pool.start( ) ) )
+		return;
+
+	// All idle, picks go round robin
+	std::set< async_tcp_client* > idle = { };
+
+	for ( int i = 0; i < 3; i++ )
+		idle.insert( pool.pick( ) );
+
+	FI_CHECK( idle.size( ) == 3 && !idle.count( nullptr ) );
+
+	auto busy = pool.pick( );
+	spawn( call_without_answer( busy ) );
+
+	FI_CHECK( wait_for( [ & ]( ) { return busy->calls_in_flight( ) == 1; } ) );
+
+	std::set< async_tcp_client* > picked = { };
+
+	for ( int i = 0; i < 10; i++ )
+		picked.insert( pool.pick( ) );
+
+	// Never the busy one, and both of the others take turns
+	FI_CHECK( picked.size( ) == 2 && !picked.count( busy ) );
+
+	// Keys only pick among the connections of their endpoint, same rules
+	FI_CHECK( pool.pick( 7 ) != busy );
+
+	pool.stop( );
+}
+
+// Connections that stay silent get their endpoint ejected, even if they're still
+// connected. Once they're back up they're taking traffic again.
+static void missed_heartbeats( ) {
+	constexpr std::uint16_t port = 15430;
+	auto server = start_server( port, 0 );
+
+	// Servers only send heartbeats every 5 seconds
+	auto options = quick_options( );
+	options.heartbeat_timeout = 300ms;
+
+	client_loop loop( 1 );
+	client_pool pool( loop, { { "127.0.0.1", port_of( port ) } }, options );
+
+	event_log events = { };
+	events.attach( pool );
+	setup_client( pool );
+
+	auto started = clock_type::now( );
+	FI_CHECK( pool.start( ) );
+
+	FI_CHECK( wait_for( [ & ]( ) { return events.count( port, endpoint_event::ejected ) == 1; } ) );
+	FI_CHECK( clock_type::now( ) - started >= 300ms );
+
+	FI_CHECK( wait_for( [ & ]( ) { return events.count( port, endpoint_event::up ) >= 2; } ) );
+
+	pool.stop( );
+}
+
+// An endpoint that keeps failing gets retried less and less often
+static void backs_off( ) {
+	constexpr std::uint16_t port = 15440;
+	failing_listener listener( port, 0ms );
+
+	auto options = quick_options( );
+	options.connections_per_endpoint = 1;
+	options.retry_delay = 100ms;
+	options.max_retry_delay = 400ms;
+
+	client_loop loop( 1 );
+	client_pool pool( loop, { { "127.0.0.1", port_of( port ) } }, options );
+
+	setup_client( pool );
+	FI_CHECK( !pool.start( ) );
+
+	FI_CHECK( wait_for( [ & ]( ) { return listener.attempts( ).size( ) >= 6; } ) );
+	pool.stop( );
+
+	auto attempts = listener.attempts( );
+
+	if ( !FI_CHECK( attempts.size( ) >= 6 ) )
+		return;
+
+	// 100, 200, 400 and then it stays at the maximum
+	const std::chrono::milliseconds delays[ ] = { 100ms, 200ms, 400ms, 400ms, 400ms };
+
+	for ( std::size_t i = 0; i < 5; i++ ) {
+		auto gap = attempts[ i + 1 ] - attempts[ i ];
+		FI_CHECK( gap >= delays[ i ] && gap < delays[ i ] + 300ms );
+	}
+}
+
+// start( ) waits for every endpoint's first attempt, even when another one is up already
+static void start_waits_for_all( ) {
+	constexpr std::uint16_t port = 15450;
+	auto server = start_server( port, 0 );
+	failing_listener slow( port + 1, 300ms );
+
+	client_loop loop( 1 );
+	client_pool pool( loop, { { "127.0.0.1", port_of( port ) }, { "127.0.0.1", port_of( port + 1 ) } }, quick_options( ) );
+
+	setup_client( pool );
+
+	auto started = clock_type::now( );
+
+	FI_CHECK( pool.start( ) );
+	FI_CHECK( clock_type::now( ) - started >= 300ms );
+	FI_CHECK( pool.healthy_endpoints( ) == 1 );
+
+	pool.stop( );
+}
+
+int main( ) {
+	consistent_keys( );
+	least_outstanding( );
+	missed_heartbeats( );
+	backs_off( );
+	start_waits_for_all( );
+
+	return fi::testing::result( );
+}
@@ -1,57 +1,62 @@
 #include "async_client/async_client.h"
 #include <iostream>
 
-#define PROCESS_PACKET_FN(ID, name) void name( fi::async_tcp_client* const cl, const fi::packets::packet_id id, fi::packets::detail::binary_serializer& s)
-
-PROCESS_PACKET_FN( fi::packets::id_example, on_example_packet ) {
-	fi::packets::example_packet example( s );
-
-	// Now we can access our data
+void on_example_packet( fi::async_tcp_client* const cl, fi::packets::example_packet& example ) {
+	// The packet arrives already deserialized, we can access our data right away
 	for ( std::size_t i = 0; i < example.some_string_array.size( ); i++ )
-		printf( "[ %i ] %s\n", i, example.some_string_array[ i ].data( ) );
+		printf( "[ %zu ] %s\n", i, example.some_string_array[ i ].data( ) );
 
 	// Disconnect from our server, as we're done communicating.
 	cl->disconnect( );
 }
 
-int main( ) {
+fi::task< bool > session( fi::async_tcp_client& client, fi::io_engine engine ) {
+	// Suspends until the handshake is done, nobody blocks waiting for it
+	if ( !co_await client.async_connect( "localhost", "1337", engine ) )
+		co_return false;
+
+	// From here on we're running on the client's loop thread
+	printf( "Connected to server!\n" );
+
+	// Craft a packet once we're connected
+	fi::packets::example_packet example = { };
+
+	example.some_short = 128;
+	example.some_array = { 1, 2, 3, 4, 5 };
+	example.some_string_array = { "Hello", "from", "client!" };
+
+	// Send the packet, we continue once it was handed to the OS
+	co_await client.send( &example );
+
+	// Wait for the server to answer, the answer comes to us instead of the handler
+	if ( auto answer = co_await client.receive< fi::packets::example_packet >( ) )
+		on_example_packet( &client, *answer );
+
+	co_return true;
+}
+
+int main( int argc, char** argv ) {
+	// Pass --uring to run on the io_uring engine instead of the reactor
+	auto engine = argc > 1 && std::string_view( argv[ 1 ] ) == "--uring" ? fi::io_engine::uring : fi::io_engine::reactor;
+
 	try {
 		fi::async_tcp_client client = { };
 
-		client.register_disconnect_callback( [ ]( fi::async_tcp_client* const cl ) {
+		client.register_disconnect_callback( [ ]( fi::async_tcp_client* const ) {
 			printf( "Disconnected from server.\n" );
 		} );
 
-		client.register_callback( [ ]( fi::async_tcp_client* const cl, const fi::packets::packet_id id, fi::packets::detail::binary_serializer& s ) {
-			// You can use a switch case, an unordered map, an array.. whichever suits you best
-			switch ( id ) {
-				case fi::packets::id_example:
-					on_example_packet( cl, id, s );
-					break;
-				default:
-					printf( "Unknown packet ID %i received\n", id );
-			}
-		} );
-
-		if ( client.connect( "localhost", "1337" ) ) {
-			printf( "Connected to server!\n" );
-
-			// Craft a packet once we're connected
-			fi::packets::example_packet example = { };
+		// Every packet type gets its own handler
+		client.on< fi::packets::example_packet >( on_example_packet );
 
-			example.some_short = 128;
-			example.some_array = { 1, 2, 3, 4, 5 };
-			example.some_string_array = { "Hello", "from", "client!" };
-
-			// Send the packet
-			client.send_packet( &example );
+		// Anything we don't have a handler for ends up here
+		client.register_callback( [ ]( fi::async_tcp_client* const, const fi::packets::packet_id id, fi::packets::detail::packet_reader& ) {
+			printf( "Unknown packet ID %i received\n", id );
+		} );
 
-			// Wait for the server to answer
-			while ( client.is_connected( ) ) {
-				std::this_thread::sleep_for( std::chrono::milliseconds( 1 ) );
-			}
-		} else
-			printf( "Handshake has failed.\n" );
+		// Run our session and wait for it to finish
+		if ( !fi::sync_wait( session( client, engine ) ) )
+			printf( "Connecting to the server has failed.\n" );
 
 		std::cin.get( );
 		return 0;
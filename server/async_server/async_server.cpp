@@ -2,9 +2,9 @@
 
 using namespace fi;
 
-// TODO:
-// -add handshake timeout
-// -finish processing all packets before we exit thread( cba rn, but its ez.look @ client )
+// Reactor token of our listening socket, no client socket will ever get near it
+constexpr std::uint64_t listener_token = ~0ull - 1;
+
 async_tcp_server::async_tcp_server( ) {
 #ifdef _WIN32
 	if ( WSAStartup( MAKEWORD( 2, 2 ), &wsa_data_ ) != 0 )
@@ -14,31 +14,38 @@ async_tcp_server::async_tcp_server( ) {
 
 async_tcp_server::~async_tcp_server( ) {
 	stop( );
-
-	if ( accepting_thread_.joinable( ) )
-		accepting_thread_.join( );
-
-	if ( processing_thread_.joinable( ) )
-		processing_thread_.join( );
-
-	if ( receiving_thread_.joinable( ) )
-		receiving_thread_.join( );
-
-	if ( heartbeat_thread_.joinable( ) )
-		heartbeat_thread_.join( );
+	join_shards( );
 
 #ifdef _WIN32
 	WSACleanup( );
 #endif // _WIN32
 }
 
-void async_tcp_server::start( std::string_view port ) {
+void async_tcp_server::start( std::string_view port, io_engine engine ) {
+	server_options options = { };
+	options.engine = engine;
+
+	start( port, options );
+}
+
+void async_tcp_server::start( std::string_view port, const server_options& options ) {
 	if ( running_ )
 		throw exception( exception::reason_id::already_running, "async_tcp_server::start: attempted to start server while it was running" );
 
-	if ( !process_callback_ )
+	if ( !process_callback_ && !batch_callback_ && handlers_.empty( ) && call_handlers_.empty( ) )
 		throw exception( exception::reason_id::no_callback, "async_tcp_server::start: no processing callback set" );
 
+	// Clean up after a previous run
+	join_shards( );
+
+	options_ = options;
+
+	if ( !options_.reactors )
+		options_.reactors = std::max( 1u, std::thread::hardware_concurrency( ) );
+
+	// Handles only have room for this many
+	options_.reactors = std::min( options_.reactors, server_options::max_reactors );
+
 	addrinfo hints = { }, * result = nullptr;
 
 	hints.ai_family = AF_INET;
@@ -49,128 +56,407 @@ void async_tcp_server::start( std::string_view port ) {
 	if ( getaddrinfo( nullptr, port.data( ), &hints, &result ) != 0 )
 		throw exception( exception::reason_id::getaddrinfo_failure, "async_tcp_server::start: getaddrinfo error" );
 
-	server_socket_ = ::socket( result->ai_family, result->ai_socktype, result->ai_protocol );
-
-	if ( server_socket_ == INVALID_SOCKET ) {
+	// Undoes everything we did so far if we fail halfway through
+	auto fail = [ & ]( exception::reason_id reason, std::string_view what ) {
 		freeaddrinfo( result );
-		throw exception( exception::reason_id::socket_failure, "async_tcp_server::start: failed to create socket" );
-	}
 
-	if ( bind( server_socket_, result->ai_addr, result->ai_addrlen ) == SOCKET_ERROR ) {
-		freeaddrinfo( result );
-		throw exception( exception::reason_id::bind_error, "async_tcp_server::start: failed to bind socket" );
+		for ( auto& s : shards_ ) {
+			if ( s->owns_listener && s->listener != INVALID_SOCKET )
+				closesocket( s->listener );
+		}
+
+		join_shards( );
+		throw exception( reason, what );
+	};
+
+	for ( std::uint32_t i = 0; i < options_.reactors; i++ ) {
+		auto& s = *shards_.emplace_back( std::make_unique< shard >( ) );
+		s.index = std::uint8_t( i );
+
+		if ( options_.engine == io_engine::uring && !s.uring.create( uring_entries_, uring_buffer_count_, buffer_size_ ) )
+			fail( exception::reason_id::engine_unavailable, "async_tcp_server::start: io_uring is not available" );
+
+		if ( options_.engine == io_engine::reactor && !s.reactor.create( ) )
+			fail( exception::reason_id::reactor_failure, "async_tcp_server::start: failed to create reactor" );
+
+	#ifndef SO_REUSEPORT
+		// Nothing balances connections across listeners for us, share the first one
+		if ( i > 0 ) {
+			s.listener = shards_.front( )->listener;
+			s.owns_listener = false;
+			continue;
+		}
+	#endif // SO_REUSEPORT
+
+		s.listener = ::socket( result->ai_family, result->ai_socktype, result->ai_protocol );
+
+		if ( s.listener == INVALID_SOCKET )
+			fail( exception::reason_id::socket_failure, "async_tcp_server::start: failed to create socket" );
+
+	#ifdef __linux__
+		int enable = 1;
+
+		// Don't let connections lingering in TIME_WAIT keep us from restarting
+		setsockopt( s.listener, SOL_SOCKET, SO_REUSEADDR, &enable, sizeof( enable ) );
+
+		// Every reactor listens on the same port, the kernel balances new connections across them
+		if ( options_.reactors > 1 && setsockopt( s.listener, SOL_SOCKET, SO_REUSEPORT, &enable, sizeof( enable ) ) == SOCKET_ERROR )
+			fail( exception::reason_id::socket_failure, "async_tcp_server::start: failed to enable SO_REUSEPORT" );
+	#endif // __linux__
+
+		// Accepted clients get them as well, we'd rather find out about options the OS refuses right here
+		if ( !detail::apply_socket_options( s.listener, options_.sockets ) )
+			fail( exception::reason_id::socket_failure, "async_tcp_server::start: failed to apply socket options" );
+
+		if ( bind( s.listener, result->ai_addr, int( result->ai_addrlen ) ) == SOCKET_ERROR )
+			fail( exception::reason_id::bind_error, "async_tcp_server::start: failed to bind socket" );
+
+		if ( listen( s.listener, SOMAXCONN ) == SOCKET_ERROR )
+			fail( exception::reason_id::listen_error, "async_tcp_server::start: failed to listen on socket" );
+
+		// The loop thread accepts clients itself and must never block doing so
+		if ( !detail::set_non_blocking( s.listener ) )
+			fail( exception::reason_id::socket_failure, "async_tcp_server::start: failed to make socket non-blocking" );
 	}
 
-	if ( listen( server_socket_, SOMAXCONN ) == SOCKET_ERROR ) {
-		freeaddrinfo( result );
-		throw exception( exception::reason_id::listen_error, "async_tcp_server::start: failed to listen on socket" );
+	if ( options_.engine == io_engine::reactor ) {
+		for ( auto& s : shards_ ) {
+			if ( !s->reactor.add( s->listener, listener_token, detail::reactor::ev_read ) )
+				fail( exception::reason_id::reactor_failure, "async_tcp_server::start: failed to watch listening socket" );
+		}
 	}
 
 	freeaddrinfo( result );
 
+	heartbeat_ = build_packet( packets::ids::id_heartbeat, packets::flags::fl_heartbeat );
+
+	if ( options_.workers )
+		workers_ = std::make_unique< detail::thread_pool >( options_.workers );
+
 	running_ = true;
 
-	accepting_thread_ = std::thread( &async_tcp_server::accept_clients, this );
-	processing_thread_ = std::thread( &async_tcp_server::process_data, this );
-	receiving_thread_ = std::thread( &async_tcp_server::receive_data, this );
-	heartbeat_thread_ = std::thread( &async_tcp_server::run_heartbeat, this );
+	for ( auto& s : shards_ ) {
+		s->loop_thread = std::thread( options_.engine == io_engine::uring ? &async_tcp_server::run_uring : &async_tcp_server::run_reactor, this, std::ref( *s ) );
+
+		// Set before start returns, so nobody calling us from then on can miss it
+		s->loop_id = s->loop_thread.get_id( );
+	}
+
+	for ( std::size_t i = 0; i < shards_.size( ); i++ ) {
+		if ( detail::pin_thread( shards_[ i ]->loop_thread, options_.sockets.cpu_affinity, i ) )
+			continue;
+
+		// Shut down again like stop does, nobody got to connect yet
+		running_ = false;
+
+		for ( auto& s : shards_ ) {
+			if ( s->owns_listener )
+				closesocket( s->listener );
+
+			s->reactor.wake( );
+			s->uring.wake( );
+		}
+
+		join_shards( );
+		throw exception( exception::reason_id::affinity_failure, "async_tcp_server::start: failed to pin reactor thread" );
+	}
 }
 
 void async_tcp_server::stop( ) {
-	if ( running_ ) {
-		running_ = false;
+	if ( !running_.exchange( false ) )
+		return;
 
-		shutdown( server_socket_, SD_BOTH );
-		closesocket( server_socket_ );
+	for ( auto& s : shards_ ) {
+		if ( s->owns_listener ) {
+			shutdown( s->listener, SD_BOTH );
+			closesocket( s->listener );
+		}
 
-		if ( on_stop_callback_ )
-			on_stop_callback_( this );
+		// Wake our threads up so they notice we stopped. The loop
+		// threads take care of disconnecting all remaining clients.
+		s->reactor.wake( );
+		s->uring.wake( );
 	}
 
-	connected_clients_.clear( );
-	process_buffers_.clear( );
-	clients_to_disconnect_.clear( );
+	if ( on_stop_callback_ )
+		on_stop_callback_( this );
 }
 
-void async_tcp_server::disconnect_client( SOCKET who ) {
-	std::lock_guard guard1( client_mtx_ );
-	std::lock_guard guard2( process_mtx_ );
-
-	auto it = std::find_if( connected_clients_.begin( ), connected_clients_.end( ), [ &who ]( const SOCKET& s ) {
-		return s == who;
-	} );
+void async_tcp_server::disconnect_client( connection_handle who ) {
+	auto owner = find_shard( who );
 
-	if ( it == connected_clients_.end( ) )
+	if ( !owner )
 		return;
 
-	shutdown( who, SD_SEND );
-	closesocket( who );
+	// The owning loop thread does the actual work
+	if ( std::this_thread::get_id( ) == owner->loop_id ) {
+		auto client = find_client( *owner, who );
+
+		if ( client && !client->handshaking )
+			remove_client( *owner, *client );
+
+		return;
+	}
 
-	process_buffers_.erase( who );
-	connected_clients_.erase( it );
+	{
+		std::lock_guard guard( owner->mtx );
+		owner->to_disconnect.push_back( who );
+	}
 
-	if ( on_disconnect_callback_ )
-		on_disconnect_callback_( this, who );
+	owner->reactor.wake( );
+	owner->uring.wake( );
 }
 
 bool async_tcp_server::is_running( ) {
 	return running_;
 }
 
-void async_tcp_server::send_packet( SOCKET to, packets::base_packet* packet ) {
-	if ( !packet )
-		throw exception( exception::reason_id::packet_nullptr, "async_tcp_server::send_packet: packet was nullptr" );
+bool async_tcp_server::is_connected( connection_handle who ) {
+	auto owner = find_shard( who );
+
+	if ( !owner )
+		return false;
+
+	std::lock_guard guard( owner->mtx );
 
-	std::lock_guard guard( send_mtx_ );
+	auto client = find_client( *owner, who );
+	return client && !client->handshaking;
+}
+
+void async_tcp_server::send_buffer( connection_handle to, const detail::shared_buffer& data ) {
+	auto owner = find_shard( to );
 
-	serializer.reset( );
+	if ( !owner )
+		return;
 
-	// Serialize our data
-	packet->serialize( serializer );
+	bool needs_wake = false;
 
-	// Allocate a buffer for our packet
-	std::vector< std::uint8_t > packet_data( sizeof( packets::header ) + serializer.get_serialized_data_length( ) );
+	{
+		std::lock_guard guard( owner->mtx );
 
-	// Construct our packet header
-	packets::header packet_header = construct_packet_header(
-		serializer.get_serialized_data_length( ),
-		packet->get_id( ),
-		packets::flags::fl_none
-	);
+		auto client = find_client( *owner, to );
 
-	// Write our packet into the buffer
-	memcpy( packet_data.data( ), &packet_header, sizeof( packets::header ) );
+		if ( client && !client->handshaking )
+			needs_wake = enqueue( *owner, *client, data );
+	}
+
+	if ( needs_wake )
+		wake_loop( *owner );
+}
+
+void async_tcp_server::send_buffer( std::span< const connection_handle > to, const detail::shared_buffer& data ) {
+	// Every shard only gets locked once, no matter how many of its clients we send to
+	for ( auto& s : shards_ ) {
+		bool needs_wake = false;
+
+		{
+			std::lock_guard guard( s->mtx );
+
+			for ( auto who : to ) {
+				if ( who.shard != s->index )
+					continue;
+
+				auto client = find_client( *s, who );
+
+				if ( client && !client->handshaking )
+					needs_wake |= enqueue( *s, *client, data );
+			}
+		}
+
+		if ( needs_wake )
+			wake_loop( *s );
+	}
+}
+
+void async_tcp_server::broadcast_buffer( const detail::shared_buffer& data ) {
+	for ( auto& s : shards_ ) {
+		bool needs_wake = false;
+
+		{
+			std::lock_guard guard( s->mtx );
+
+			s->clients.for_each( [ & ]( std::uint32_t, client_state& client ) {
+				if ( !client.closed && !client.handshaking )
+					needs_wake |= enqueue( *s, client, data );
+			} );
+		}
+
+		if ( needs_wake )
+			wake_loop( *s );
+	}
+}
+
+void async_tcp_server::set_user_data( connection_handle who, void* data ) {
+	auto owner = find_shard( who );
+
+	if ( !owner )
+		return;
+
+	std::lock_guard guard( owner->mtx );
+
+	if ( auto client = find_client( *owner, who ) )
+		client->user_data = data;
+}
+
+void* async_tcp_server::get_user_data( connection_handle who ) {
+	auto owner = find_shard( who );
+
+	if ( !owner )
+		return nullptr;
+
+	std::lock_guard guard( owner->mtx );
+
+	auto client = find_client( *owner, who );
+	return client ? client->user_data : nullptr;
+}
+
+timer_handle async_tcp_server::set_timer( std::chrono::milliseconds delay, std::function< void( async_tcp_server* const ) > callback_fn, connection_handle owner ) {
+	if ( !callback_fn )
+		throw exception( exception::reason_id::null_callback, "async_tcp_server::set_timer: no callback given" );
+
+	auto s = find_shard( owner );
+
+	if ( !s && !shards_.empty( ) )
+		s = shards_.front( ).get( );
+
+	if ( !s )
+		return { };
+
+	shard::pending_timer timer = { next_timer_id_++, std::chrono::steady_clock::now( ) + delay, std::move( callback_fn ) };
+	timer_handle handle = { timer.id, s->index };
+
+	// The wheel belongs to the loop thread, everyone else hands their timers over
+	if ( std::this_thread::get_id( ) == s->loop_id ) {
+		add_user_timer( *s, timer );
+		return handle;
+	}
+
+	{
+		std::lock_guard guard( s->mtx );
+		s->timers_to_set.push_back( std::move( timer ) );
+	}
+
+	s->reactor.wake( );
+	s->uring.wake( );
+
+	return handle;
+}
+
+void async_tcp_server::cancel_timer( timer_handle timer ) {
+	if ( !timer.is_valid( ) || timer.shard >= shards_.size( ) )
+		return;
+
+	auto& s = *shards_[ timer.shard ];
+
+	if ( std::this_thread::get_id( ) == s.loop_id ) {
+		remove_user_timer( s, timer.id );
+		return;
+	}
+
+	{
+		std::lock_guard guard( s.mtx );
+		s.timers_to_cancel.push_back( timer.id );
+	}
+
+	s.reactor.wake( );
+	s.uring.wake( );
+}
+
+bool async_tcp_server::connection::add_receiver( detail::receive_waiter& waiter ) {
+	auto s = server_->find_shard( handle_ );
+
+	if ( !s )
+		return false;
+
+	// Only the loop thread touches the receivers, everyone else hands theirs over
+	if ( std::this_thread::get_id( ) == s->loop_id ) {
+		auto client = server_->find_client( *s, handle_ );
+
+		if ( !client || client->handshaking )
+			return false;
+
+		client->receivers.push_back( &waiter );
+		return true;
+	}
+
+	{
+		std::lock_guard guard( s->mtx );
+
+		auto client = server_->find_client( *s, handle_ );
 
-	memcpy(
-		packet_data.data( ) + sizeof( packets::header ),
-		serializer.get_serialized_data( ),
-		serializer.get_serialized_data_length( )
-	);
+		if ( !client || client->handshaking )
+			return false;
+
+		s->receivers_to_add.push_back( { handle_, &waiter } );
+	}
+
+	s->reactor.wake( );
+	s->uring.wake( );
+
+	return true;
+}
+
+bool async_tcp_server::connection::add_sender( detail::send_waiter& waiter, const detail::shared_buffer& data ) {
+	// Once the waiter is queued the coroutine may finish and take us with it, don't touch this after that
+	auto server = server_;
+	auto s = server->find_shard( handle_ );
+
+	if ( !s )
+		return false;
+
+	bool needs_wake = false;
+
+	{
+		std::lock_guard guard( s->mtx );
+
+		auto client = server->find_client( *s, handle_ );
+
+		if ( !client || client->handshaking )
+			return false;
+
+		needs_wake = server->enqueue( *s, *client, data );
 
-	// Attempt to send the packet
-	if ( !send_packet_internal( to, packet_data.data( ), packet_data.size( ) ) )
-		disconnect_client( to );
+		// The loop thread resumes us once everything up to our packet was written
+		waiter.bytes = client->bytes_queued;
+		client->senders.push_back( &waiter );
+	}
+
+	if ( needs_wake )
+		server->wake_loop( *s );
+
+	return true;
 }
 
-void async_tcp_server::register_callback( std::function< void( async_tcp_server* const, const SOCKET, const packets::packet_id, packets::detail::binary_serializer& ) > callback_fn ) {
+void async_tcp_server::register_callback( std::function< void( async_tcp_server* const, const connection_handle, const packets::packet_id, packets::detail::packet_reader& ) > callback_fn ) {
 	if ( !callback_fn )
 		throw exception( exception::reason_id::null_callback, "async_tcp_server::register_callback: no callback given" );
 
 	process_callback_ = callback_fn;
 }
 
+void async_tcp_server::register_batch_callback( std::function< void( async_tcp_server* const, const connection_handle, std::span< const packets::received_packet > ) > callback_fn ) {
+	if ( !callback_fn )
+		throw exception( exception::reason_id::null_callback, "async_tcp_server::register_batch_callback: no callback given" );
+
+	batch_callback_ = callback_fn;
+}
+
 void async_tcp_server::register_stop_callback( std::function< void( async_tcp_server* const ) > callback_fn ) {
 	on_stop_callback_ = callback_fn;
 }
 
-void async_tcp_server::register_connect_callback( std::function< void( async_tcp_server* const, const SOCKET ) > callback_fn ) {
+void async_tcp_server::register_connect_callback( std::function< void( async_tcp_server* const, const connection_handle ) > callback_fn ) {
 	on_connect_callback = callback_fn;
 }
 
-void async_tcp_server::register_disconnect_callback( std::function< void( async_tcp_server* const, const SOCKET ) > callback_fn ) {
+void async_tcp_server::register_disconnect_callback( std::function< void( async_tcp_server* const, const connection_handle ) > callback_fn ) {
 	on_disconnect_callback_ = callback_fn;
 }
 
+void async_tcp_server::register_backpressure_callback( std::function< void( async_tcp_server* const, const connection_handle, const backpressure_event ) > callback_fn ) {
+	on_backpressure_callback_ = callback_fn;
+}
+
 packets::header async_tcp_server::construct_packet_header( packets::packet_length length, packets::packet_id id, packets::packet_flags flags ) {
 	packets::header packet_header = { };
 
@@ -179,28 +465,37 @@ packets::header async_tcp_server::construct_packet_header( packets::packet_lengt
 	packet_header.length = sizeof( packets::header ) + length;
 	packet_header.magic = PACKET_MAGIC;
 
-	return packet_header;
+	// Ready to go out as is
+	return packets::detail::to_wire( packet_header );
 }
 
-bool async_tcp_server::perform_handshake( SOCKET with ) {
-	packets::header packet_header = construct_packet_header( 0, packets::ids::id_handshake, packets::flags::fl_handshake_sv );
+detail::shared_buffer async_tcp_server::build_packet( packets::packet_id id, packets::packet_flags flags ) {
+	packets::header packet_header = construct_packet_header( 0, id, flags );
 
-	auto buffer = reinterpret_cast< char* >( &packet_header );
+	auto packet_data = detail::shared_buffer::allocate( sizeof( packets::header ) );
+	memcpy( packet_data.data( ), &packet_header, sizeof( packets::header ) );
 
-	// Send our header with no body and the handshake_sv flag
-	if ( !send_packet_internal( with, &packet_header, sizeof( packets::header ) ) )
-		return false;
+	return packet_data;
+}
 
-	// Receive a response back. Should be the header with handshake_cl flag
-	int bytes_received = 0;
-	do {
-		int received = recv( with, buffer + bytes_received, sizeof( packets::header ) - bytes_received, 0 );
+void async_tcp_server::begin_handshake( shard& s, client_state& client ) {
+	client.timeout_timer = s.timers.schedule( s.now + handshake_timeout_, [ this, &s, who = client.handle ]( ) {
+		auto client = find_client( s, who );
 
-		if ( received <= 0 )
-			return false;
+		if ( client && client->handshaking )
+			remove_client( s, *client );
+	} );
+
+	// Send our header with no body and the handshake_sv flag, the
+	// response shows up in our receive buffer like any other packet
+	queue_send( s, client, build_packet( packets::ids::id_handshake, packets::flags::fl_handshake_sv ) );
+}
 
-		bytes_received += received;
-	} while ( bytes_received < sizeof( packets::header ) );
+bool async_tcp_server::complete_handshake( shard& s, client_state& client ) {
+	// Should be the header with handshake_cl flag
+	packets::header packet_header = { };
+	client.process_buffer.peek( &packet_header, sizeof( packets::header ) );
+	packet_header = packets::detail::from_wire( packet_header );
 
 	// Check the header information for the information we are expecting
 	if ( packet_header.flags != packets::flags::fl_handshake_cl )
@@ -215,169 +510,1098 @@ bool async_tcp_server::perform_handshake( SOCKET with ) {
 	if ( packet_header.magic != PACKET_MAGIC )
 		return false;
 
+	client.process_buffer.consume( sizeof( packets::header ) );
+
+	// From now on other threads may find the client
+	{
+		std::lock_guard guard( s.mtx );
+
+		client.handshaking = false;
+		client.sent_recently = false;
+	}
+
+	s.timers.cancel( client.timeout_timer );
+	client.timeout_timer = 0;
+
+	// Clients that connect at the same time get their heartbeats at different times
+	auto half_interval = std::chrono::duration_cast< std::chrono::milliseconds >( heartbeat_interval_ ) / 2;
+	schedule_heartbeat( s, client, half_interval + std::chrono::milliseconds( client.handle.index * 7919ull % half_interval.count( ) ) );
+
+	if ( options_.idle_timeout.count( ) > 0 )
+		schedule_idle_timeout( s, client );
+
+	if ( workers_ ) {
+		client.strand = std::make_shared< detail::strand >( *workers_ );
+		client.backlog = std::make_shared< std::atomic_uint64_t >( 0 );
+	}
+
+	if ( on_connect_callback ) {
+		if ( client.strand )
+			client.strand->post( [ this, who = client.handle ]( ) { on_connect_callback( this, who ); } );
+		else
+			on_connect_callback( this, client.handle );
+	}
+
 	return true;
 }
 
-bool async_tcp_server::send_packet_internal( SOCKET to, void* const data, const packets::packet_length length ) {
-	std::uint32_t bytes_sent = 0;
-	do {
-		int sent = send(
-			to,
-			reinterpret_cast< char* >( data ) + bytes_sent,
-			length - bytes_sent,
-			0
-		);
+void async_tcp_server::schedule_heartbeat( shard& s, client_state& client, std::chrono::milliseconds delay ) {
+	client.heartbeat_timer = s.timers.schedule( s.now + delay, [ this, &s, who = client.handle ]( ) {
+		auto client = find_client( s, who );
 
-		if ( sent <= 0 )
-			return false;
+		if ( !client )
+			return;
 
-		bytes_sent += sent;
-	} while ( bytes_sent < length );
+		{
+			std::lock_guard guard( s.mtx );
 
-	return true;
+			// Any packet tells us just as well whether the client is still there. If he's
+			// gone, sending fails and gets him disconnected.
+			if ( !client->sent_recently )
+				enqueue( s, *client, heartbeat_ );
+
+			client->sent_recently = false;
+		}
+
+		// We're on the loop thread, the heartbeat gets flushed before it goes back to sleep
+		schedule_heartbeat( s, *client, std::chrono::duration_cast< std::chrono::milliseconds >( heartbeat_interval_ ) );
+	} );
 }
 
-void async_tcp_server::accept_clients( ) {
-	while ( running_ ) {
-		std::this_thread::sleep_for( std::chrono::milliseconds( 1 ) );
+void async_tcp_server::schedule_idle_timeout( shard& s, client_state& client ) {
+	client.timeout_timer = s.timers.schedule( client.last_receive + options_.idle_timeout, [ this, &s, who = client.handle ]( ) {
+		auto client = find_client( s, who );
 
-		auto client = accept( server_socket_, nullptr, nullptr );
+		if ( !client )
+			return;
 
-		if ( client == INVALID_SOCKET )
-			continue;
+		// We're the ones not listening to paused clients, they aren't idle
+		if ( client->receive_paused )
+			client->last_receive = s.now;
 
-		// Attempt to handshake with the client,
-		// disconnect from it upon failure.
-		if ( !perform_handshake( client ) ) {
-			shutdown( client, SD_BOTH );
-			closesocket( client );
-			continue;
+		// Receiving doesn't touch the timer, we only look at how long it's been once it fires
+		if ( s.now - client->last_receive >= options_.idle_timeout )
+			remove_client( s, *client );
+		else
+			schedule_idle_timeout( s, *client );
+	} );
+}
+
+void async_tcp_server::schedule_packet_timeout( shard& s, client_state& client ) {
+	client.packet_timer = s.timers.schedule( s.now + options_.receive_packet_timeout, [ this, &s, who = client.handle, processed = client.processed ]( ) {
+		auto client = find_client( s, who );
+
+		if ( !client )
+			return;
+
+		client->packet_timer = 0;
+
+		// Nothing half-received anymore, his next packet arms us again
+		if ( !client->process_buffer.size( ) )
+			return;
+
+		// He finished a packet since, so the one he's on gets the full timeout. Clients paused
+		// for their own backlog can't finish theirs either, that's on the workers rather than
+		// him. The global limit only lets up once someone's partial packet goes away though.
+		if ( client->processed != processed || ( client->receive_paused && !above_global_resume( ) ) ) {
+			schedule_packet_timeout( s, *client );
+			return;
 		}
 
-		std::lock_guard guard( client_mtx_ );
-		connected_clients_.push_back( client );
+		remove_client( s, *client );
+	} );
+}
 
-		if ( !on_connect_callback )
-			continue;
+void async_tcp_server::add_user_timer( shard& s, shard::pending_timer& timer ) {
+	s.user_timers[ timer.id ] = s.timers.schedule( timer.when, [ this, &s, id = timer.id, fn = std::move( timer.fn ) ]( ) {
+		s.user_timers.erase( id );
+		fn( this );
+	} );
+}
+
+void async_tcp_server::remove_user_timer( shard& s, std::uint64_t id ) {
+	auto it = s.user_timers.find( id );
+
+	if ( it == s.user_timers.end( ) )
+		return;
+
+	s.timers.cancel( it->second );
+	s.user_timers.erase( it );
+}
+
+void async_tcp_server::queue_send( shard& s, client_state& client, const detail::shared_buffer& data ) {
+	bool needs_wake = false;
 
-		on_connect_callback( this, client );
+	{
+		std::lock_guard guard( s.mtx );
+		needs_wake = enqueue( s, client, data );
 	}
+
+	if ( needs_wake )
+		wake_loop( s );
 }
 
-void async_tcp_server::process_data( ) {
-	while ( running_ ) { // The server will only process data for as long as it's running (fixme)
-		std::this_thread::sleep_for( std::chrono::milliseconds( 1 ) );
+bool async_tcp_server::enqueue( shard& s, client_state& client, const detail::shared_buffer& data ) {
+	// Don't queue anything for a client that was closed
+	if ( client.closed )
+		return false;
 
-		std::lock_guard guard1( client_mtx_ );
-		std::lock_guard guard2( process_mtx_ );
+	client.send_queue.push( data );
+	client.sent_recently = true;
+	client.bytes_queued += data.size( );
 
-		for ( std::size_t i = 0; i < connected_clients_.size( ); i++ ) {
-			auto client = connected_clients_[ i ];
-			auto& process_buffer = process_buffers_[ client ];
+	// Clients waiting on the kernel get flushed once it's done with them
+	if ( client.queued || client.sending )
+		return false;
 
-			if ( process_buffer.size( ) < sizeof( packets::header ) )
-				continue;
+	// Only wake the loop thread up if it doesn't already have sends to flush
+	bool needs_wake = s.to_send.empty( );
 
-			auto header = reinterpret_cast< packets::header* >( process_buffer.data( ) );
+	client.queued = true;
+	s.to_send.push_back( client.handle );
 
-			bool is_disconnect_packet = header->id == packets::ids::id_disconnect && header->flags & packets::flags::fl_disconnect;
+	return needs_wake;
+}
 
-			// Disconnect if we receive some malformed packet or
-			// when the client wants to disconnect
-			if ( header->magic != PACKET_MAGIC || is_disconnect_packet ) {
-				disconnect_client( client );
-				continue;
-			}
+void async_tcp_server::wake_loop( shard& s ) {
+	// The loop thread flushes before it goes back to sleep anyway
+	if ( std::this_thread::get_id( ) == s.loop_id )
+		return;
 
-			// We have received a full packet
-			if ( process_buffer.size( ) < header->length )
-				continue;
+	s.reactor.wake( );
+	s.uring.wake( );
+}
 
-			auto data_start = process_buffer.data( ) + sizeof( packets::header );
-			std::uint32_t data_length = header->length - sizeof( packets::header );
+async_tcp_server::shard* async_tcp_server::find_shard( connection_handle who ) {
+	if ( !who.is_valid( ) || who.shard >= shards_.size( ) )
+		return nullptr;
 
-			// Assign the data to our serializer
-			serializer.assign_buffer( data_start, data_length );
+	return shards_[ who.shard ].get( );
+}
 
-			// Call the processing callback (it cannot be null)
-			if ( header->id > packets::ids::num_preset_ids )
-				process_callback_( this, client, header->id, serializer );
+async_tcp_server::client_state* async_tcp_server::find_client( shard& s, connection_handle who ) {
+	auto client = s.clients.get( who.index, who.generation );
 
-			// Erase the packet from our buffer (client might've disconnected during callback,
-			// therefore we need to check if the buffer still exists.
-			if ( process_buffers_.find( client ) != process_buffers_.end( ) )
-				process_buffer.erase( process_buffer.begin( ), process_buffer.begin( ) + data_length + sizeof( packets::header ) );
-		}
+	return client && !client->closed ? client : nullptr;
+}
+
+std::uint64_t async_tcp_server::token_of( connection_handle who ) {
+	return std::uint64_t( who.generation ) << 24 | who.index;
+}
+
+connection_handle async_tcp_server::handle_of( shard& s, std::uint64_t token ) {
+	connection_handle handle = { };
+
+	handle.index = std::uint32_t( token & 0xFFFFFF );
+	handle.generation = std::uint32_t( token >> 24 );
+	handle.shard = s.index;
+
+	return handle;
+}
+
+void async_tcp_server::join_shards( ) {
+	for ( auto& s : shards_ ) {
+		if ( s->loop_thread.joinable( ) )
+			s->loop_thread.join( );
 	}
+
+	// Let the workers finish up, their callbacks may still use the shards
+	workers_.reset( );
+
+	for ( auto& s : shards_ ) {
+		// Closing the ring cancels whatever is still in flight
+		s->reactor.destroy( );
+		s->uring.destroy( );
+	}
+
+	shards_.clear( );
 }
 
-void async_tcp_server::receive_data( ) {
-	std::vector< std::uint8_t > buffer( buffer_size_ );
+void async_tcp_server::handle_pending( shard& s ) {
+	std::vector< connection_handle > to_disconnect = { };
+	std::vector< shard::pending_timer > timers_to_set = { };
+	std::vector< std::uint64_t > timers_to_cancel = { };
+	std::vector< shard::pending_receiver > receivers_to_add = { };
 
-	while ( running_ ) {
-		std::this_thread::sleep_for( std::chrono::milliseconds( 1 ) );
+	{
+		std::lock_guard guard( s.mtx );
 
-		std::lock_guard guard( client_mtx_ );
-		for ( std::size_t i = 0; i < connected_clients_.size( ); i++ ) {
-			auto& client = connected_clients_[ i ];
+		receivers_to_add.swap( s.receivers_to_add );
 
-			// Check if we received any data from our client
-			// so we don't block the thread with recv
-			unsigned long available_to_read = 0;
-			ioctlsocket( client, FIONREAD, &available_to_read );
+		to_disconnect.swap( s.to_disconnect );
+		timers_to_set.swap( s.timers_to_set );
+		timers_to_cancel.swap( s.timers_to_cancel );
+	}
 
-			if ( !available_to_read )
-				continue;
+	for ( auto& receiver : receivers_to_add ) {
+		auto client = find_client( s, receiver.client );
 
-			int bytes_received = recv( client, reinterpret_cast< char* >( buffer.data( ) ), buffer_size_, 0 );
+		if ( client && !client->handshaking )
+			client->receivers.push_back( receiver.waiter );
+		else
+			s.to_resume.push_back( receiver.waiter->handle );
+	}
 
-			switch ( bytes_received ) {
-				case -1:
-					// Disconnect the client on error
-					// We don't disconnect him on code 0 as that
-					// implies the client closed the connection by
-					// himself, which means it should've sent a 
-					// disconnect packet.
-					disconnect_client( client );
-					break;
-				case 0:
-					break;
-				default: // Received bytes, process them
-					std::lock_guard guard( process_mtx_ );
+	for ( auto& timer : timers_to_set )
+		add_user_timer( s, timer );
 
-					auto& process_buffer = process_buffers_[ client ];
-					process_buffer.insert( process_buffer.end( ), buffer.begin( ), buffer.begin( ) + bytes_received );
-			}
-		}
+	// A timer may be cancelled before we got to set it, so this comes second
+	for ( auto id : timers_to_cancel )
+		remove_user_timer( s, id );
+
+	for ( auto who : to_disconnect ) {
+		auto client = find_client( s, who );
+
+		if ( client && !client->handshaking )
+			remove_client( s, *client );
 	}
 
-	// Disconnect all clients on shutdown
-	for ( auto& client : connected_clients_ )
-		disconnect_client( client );
+	resume_receiving( s );
 }
 
-void async_tcp_server::run_heartbeat( ) {
-
-	auto next = std::chrono::high_resolution_clock::now( ) + heartbeat_interval_;
+void async_tcp_server::accept_clients( shard& s ) {
+	// The listener is edge-triggered as well, take everything that queued up
 	while ( running_ ) {
-		std::this_thread::sleep_for( std::chrono::milliseconds( 1 ) );
+		SOCKET client = detail::accept_non_blocking( s.listener );
 
-		if ( std::chrono::high_resolution_clock::now( ) < next )
+		if ( client != INVALID_SOCKET ) {
+			add_client( s, client );
 			continue;
+		}
+
+		if ( detail::interrupted( ) || detail::connection_aborted( ) )
+			continue;
+
+		// The backlog won't trigger the listener again while it still holds connections,
+		// so come back for them ourselves once some descriptors had a chance to free up
+		if ( detail::out_of_descriptors( ) && !s.accept_retry ) {
+			s.accept_retry = s.timers.schedule( s.now + accept_retry_delay_, [ this, &s ]( ) {
+				s.accept_retry = 0;
+				accept_clients( s );
+			} );
+		}
+
+		break;
+	}
+}
 
-		std::lock_guard client_guard( client_mtx_ );
-		for ( auto it = connected_clients_.begin( ); it != connected_clients_.end( ); ) {
-			auto& client = *it;
+void async_tcp_server::add_client( shard& s, SOCKET socket ) {
+	// The listener took them without complaint, so whatever fails here is a lost cause anyway
+	detail::apply_socket_options( socket, options_.sockets );
 
-			auto header = construct_packet_header( 0, packets::ids::id_heartbeat, packets::flags::fl_heartbeat );
+	client_state* client = nullptr;
 
-			// If we failed to send the packet, something is wrong. Disconnect the client
-			if ( !send_packet_internal( client, &header, sizeof( header ) ) )
-				disconnect_client( client );
-			else
-				it++;
+	{
+		std::lock_guard guard( s.mtx );
+
+		// Not that we'd ever get this far before running out of descriptors
+		if ( s.clients.full( ) ) {
+			closesocket( socket );
+			return;
 		}
 
-		auto next = std::chrono::high_resolution_clock::now( ) + heartbeat_interval_;
+		auto index = s.clients.emplace( );
+
+		client = s.clients.get( index, s.clients.generation( index ) );
+		client->socket = socket;
+		client->handle = handle_of( s, std::uint64_t( s.clients.generation( index ) ) << 24 | index );
+	}
+
+	if ( options_.engine == io_engine::uring ) {
+		if ( s.uring.recv_multishot( socket, token_of( client->handle ) ) )
+			client->receiving = true;
+		else
+			s.uring_retry.push_back( client->handle );
+	} else if ( !s.reactor.add( socket, token_of( client->handle ), detail::reactor::ev_read ) ) {
+		// From now on the reactor tells us when the client has data for us
+		remove_client( s, *client );
+		return;
 	}
-}
\ No newline at end of file
+
+	begin_handshake( s, *client );
+}
+
+void async_tcp_server::remove_client( shard& s, client_state& client ) {
+	if ( client.closed )
+		return;
+
+	// Get out whatever the client still has coming, as long as that doesn't mean waiting
+	if ( options_.engine == io_engine::reactor )
+		write_to( s, client );
+
+	{
+		std::lock_guard guard( s.mtx );
+
+		// Invalidates the client's handle right away, his slot is released later on
+		client.closed = true;
+		s.closing.push_back( client.handle.index );
+
+		// Coroutines still waiting on him learn that he's gone
+		for ( auto waiter : client.senders )
+			s.to_resume.push_back( waiter->handle );
+
+		client.senders.clear( );
+	}
+
+	for ( auto waiter : client.receivers )
+		s.to_resume.push_back( waiter->handle );
+
+	client.receivers.clear( );
+
+	s.timers.cancel( client.heartbeat_timer );
+	s.timers.cancel( client.timeout_timer );
+	s.timers.cancel( client.packet_timer );
+
+	// Whatever he left in his buffer is never going to be processed
+	release_buffered( std::exchange( client.buffered, 0 ) );
+
+	if ( options_.engine == io_engine::uring ) {
+		// Our multishot receive keeps the socket alive until it completes,
+		// shutting down the receiving side as well makes sure it does.
+		shutdown( client.socket, SD_BOTH );
+	} else {
+		s.reactor.remove( client.socket );
+		shutdown( client.socket, SD_SEND );
+	}
+
+	closesocket( client.socket );
+
+	// The user never heard of clients that didn't finish their handshake
+	if ( on_disconnect_callback_ && !client.handshaking ) {
+		// Comes after whatever packets of his the workers are still handling
+		if ( client.strand )
+			client.strand->post( [ this, who = client.handle ]( ) { on_disconnect_callback_( this, who ); } );
+		else
+			on_disconnect_callback_( this, client.handle );
+	}
+}
+
+void async_tcp_server::release_closed( shard& s ) {
+	if ( s.closing.empty( ) )
+		return;
+
+	std::lock_guard guard( s.mtx );
+
+	// Clients the kernel is still sending for have to wait for their send to complete
+	std::erase_if( s.closing, [ & ]( std::uint32_t index ) {
+		auto client = s.clients.get( index, s.clients.generation( index ) );
+
+		if ( client && client->sending && options_.engine == io_engine::uring )
+			return false;
+
+		s.clients.release( index );
+		return true;
+	} );
+}
+
+void async_tcp_server::complete_sends( shard& s, client_state& client ) {
+	while ( !client.senders.empty( ) && client.senders.front( )->bytes <= client.bytes_sent ) {
+		client.senders.front( )->sent = true;
+		s.to_resume.push_back( client.senders.front( )->handle );
+
+		client.senders.pop_front( );
+	}
+}
+
+void async_tcp_server::resume_waiters( shard& s ) {
+	// Resumed coroutines may queue sends and have others resumed in turn
+	while ( !s.to_resume.empty( ) ) {
+		auto to_resume = std::move( s.to_resume );
+		s.to_resume.clear( );
+
+		for ( auto h : to_resume )
+			h.resume( );
+
+		flush_sends( s );
+	}
+}
+
+void async_tcp_server::flush_sends( shard& s ) {
+	{
+		std::lock_guard guard( s.mtx );
+
+		s.flushing.swap( s.to_send );
+
+		for ( auto who : s.flushing ) {
+			if ( auto client = find_client( s, who ) )
+				client->queued = false;
+		}
+	}
+
+	for ( auto who : s.flushing ) {
+		auto client = find_client( s, who );
+
+		if ( !client )
+			continue;
+
+		if ( options_.engine == io_engine::uring ) {
+			if ( !submit_uring_send( s, *client ) )
+				s.uring_retry.push_back( who );
+		} else if ( !write_to( s, *client ) )
+			remove_client( s, *client );
+	}
+
+	s.flushing.clear( );
+}
+
+bool async_tcp_server::write_to( shard& s, client_state& client ) {
+	while ( true ) {
+		{
+			std::lock_guard guard( s.mtx );
+
+			if ( client.closed || client.sending || !client.send_queue.gather( max_send_segments_ ) )
+				return true;
+		}
+
+		// Senders may keep queueing packets while we're writing, the ones we gathered stay put
+		int sent = client.send_queue.send_gathered( client.socket );
+
+		if ( sent >= 0 ) {
+			std::lock_guard guard( s.mtx );
+			client.send_queue.advance( sent );
+			client.bytes_sent += sent;
+
+			complete_sends( s, client );
+
+			continue;
+		}
+
+		if ( detail::interrupted( ) )
+			continue;
+
+		if ( !detail::would_block( ) )
+			return false;
+
+		// The client's window is full. Instead of waiting for it, let
+		// the reactor tell us once we can write again.
+		{
+			std::lock_guard guard( s.mtx );
+			client.sending = true;
+		}
+
+		return s.reactor.modify( client.socket, token_of( client.handle ), detail::reactor::ev_read | detail::reactor::ev_write );
+	}
+}
+
+void async_tcp_server::receive_from( shard& s, client_state& client ) {
+	bool peer_closed = false;
+
+	// The reactor is edge-triggered, so we have to read until the socket runs dry (or
+	// we paused him, in which case resume_receiving picks up where we left off)
+	while ( !client.closed && !client.receive_paused ) {
+		int bytes_received = client.process_buffer.receive( client.socket, buffer_size_ );
+
+		if ( bytes_received > 0 ) {
+			client.last_receive = s.now;
+
+			// Hand off what we've got before his buffer grows past the watermark
+			if ( options_.receive_high_watermark && client.process_buffer.size( ) >= options_.receive_high_watermark )
+				process_client( s, client );
+
+			// Also counts what we just received against the global limit
+			check_receive_limit( s, client );
+			continue;
+		}
+
+		// He closed the connection (usually right after his disconnect packet). What he
+		// sent before is still handled, then he's removed like on any other disconnect.
+		if ( bytes_received == 0 ) {
+			peer_closed = true;
+			break;
+		}
+
+		if ( detail::interrupted( ) )
+			continue;
+
+		// Disconnect the client on error
+		if ( !detail::would_block( ) )
+			remove_client( s, client );
+
+		break;
+	}
+
+	if ( options_.sockets.quick_ack && !client.closed && !peer_closed )
+		detail::quick_ack( client.socket );
+
+	process_client( s, client );
+	check_receive_limit( s, client );
+
+	if ( peer_closed )
+		remove_client( s, client );
+}
+
+void async_tcp_server::process_client( shard& s, client_state& client ) {
+	auto& process_buffer = client.process_buffer;
+
+	// Coroutines whose sends completed might be about to wait for
+	// what we just received, give them the chance to do so first
+	resume_waiters( s );
+
+	while ( !client.closed ) {
+		if ( process_buffer.size( ) < sizeof( packets::header ) )
+			break;
+
+		// The first thing a client sends us has to be the handshake
+		if ( client.handshaking ) {
+			if ( !complete_handshake( s, client ) ) {
+				remove_client( s, client );
+				return;
+			}
+
+			continue;
+		}
+
+		// The header might wrap around the end of the buffer
+		packets::header header = { };
+		process_buffer.peek( &header, sizeof( packets::header ) );
+		header = packets::detail::from_wire( header );
+
+		bool is_disconnect_packet = header.id == packets::ids::id_disconnect && header.flags & packets::flags::fl_disconnect;
+
+		// Disconnect if we receive some malformed packet or
+		// when the client wants to disconnect
+		if ( header.magic != PACKET_MAGIC || header.length < sizeof( packets::header ) || is_disconnect_packet ) {
+			flush_batch( s, client );
+			remove_client( s, client );
+			return;
+		}
+
+		// We'd have to buffer all of it before we could hand it off, don't even start
+		if ( options_.receive_high_watermark && header.length > options_.receive_high_watermark ) {
+			flush_batch( s, client );
+
+			if ( on_backpressure_callback_ )
+				on_backpressure_callback_( this, client.handle, backpressure_event::packet_too_large );
+
+			remove_client( s, client );
+			return;
+		}
+
+		// We have received a full packet
+		if ( process_buffer.size( ) < header.length )
+			break;
+
+		// Only packets wrapping around the end of the buffer get copied here
+		auto data_start = process_buffer.contiguous( header.length ) + sizeof( packets::header );
+		std::uint32_t data_length = header.length - sizeof( packets::header );
+
+		// The reader points straight into our buffer, which stays put until we consume the packet
+		packets::detail::packet_reader reader( { data_start, data_length } );
+
+		// Coroutines waiting for the packet get it ahead of everyone else, requests go to their handler
+		auto receiver = std::find_if( client.receivers.begin( ), client.receivers.end( ), [ & ]( auto waiter ) { return waiter->id == header.id; } );
+
+		bool is_request = header.flags & packets::flags::fl_request;
+
+		// Collect whatever the callback would get one by one. Consumed packets stay where they
+		// are until we read from the socket again, only a single one per pass can wrap around
+		// the end of the buffer (and sit in its scratch space).
+		if ( batch_callback_ && receiver == client.receivers.end( ) && !is_request && header.id > packets::ids::num_preset_ids && !handlers_.contains( header.id ) ) {
+			s.batch.push_back( { { data_start, data_length }, header.id, header.flags } );
+			process_buffer.consume( header.length );
+			client.processed += header.length;
+			continue;
+		}
+
+		// Everything else has to wait for the packets that came before it
+		flush_batch( s, client );
+
+		if ( client.closed )
+			break;
+
+		if ( receiver != client.receivers.end( ) && !is_request ) {
+			auto waiter = *receiver;
+
+			// Packets that don't match their type are dropped
+			if ( waiter->deliver( waiter, reader ) ) {
+				client.receivers.erase( receiver );
+				waiter->handle.resume( );
+			}
+		} else if ( header.id > packets::ids::num_preset_ids ) {
+			if ( client.strand ) {
+				// Counts against his receive limit until a worker is done with it
+				*client.backlog += header.length;
+				backlog_ += header.length;
+
+				// Our buffer moves on once we return, the worker gets its own copy of the packet
+				auto data = detail::shared_buffer::allocate( data_length );
+				memcpy( data.data( ), data_start, data_length );
+
+				client.strand->post( [ this, who = client.handle, header, backlog = client.backlog, data = std::move( data ) ]( ) {
+					packets::detail::packet_reader reader( { data.data( ), data.size( ) } );
+					dispatch_packet( who, header, reader );
+
+					release_backlog( who, *backlog, header.length );
+				} );
+			} else
+				dispatch_packet( client.handle, header, reader );
+		}
+
+		// Drop the packet from our buffer (client might've disconnected during callback,
+		// in which case we don't care about the rest)
+		if ( !client.closed ) {
+			process_buffer.consume( header.length );
+			client.processed += header.length;
+		}
+	}
+
+	flush_batch( s, client );
+}
+
+void async_tcp_server::flush_batch( shard& s, client_state& client ) {
+	if ( s.batch.empty( ) )
+		return;
+
+	// Packets of a client that's gone are dropped, same as with the callback
+	if ( client.closed ) {
+		s.batch.clear( );
+		return;
+	}
+
+	if ( client.strand ) {
+		std::size_t length = 0;
+
+		for ( auto& packet : s.batch )
+			length += packet.data.size( );
+
+		// The worker gets its own copy, all packets in a single buffer. Their
+		// descriptors go in front, pointing at the copies behind them.
+		static_assert( sizeof( detail::buffer_block ) % alignof( packets::received_packet ) == 0 );
+
+		auto count = s.batch.size( );
+		auto data = detail::shared_buffer::allocate( count * sizeof( packets::received_packet ) + length );
+		auto copies = reinterpret_cast< packets::received_packet* >( data.data( ) );
+		auto offset = count * sizeof( packets::received_packet );
+
+		for ( std::size_t i = 0; i < count; i++ ) {
+			auto& packet = s.batch[ i ];
+			memcpy( data.data( ) + offset, packet.data.data( ), packet.data.size( ) );
+
+			new ( &copies[ i ] ) packets::received_packet{ { data.data( ) + offset, packet.data.size( ) }, packet.id, packet.flags };
+			offset += packet.data.size( );
+		}
+
+		auto backlog_length = std::uint32_t( length + count * sizeof( packets::header ) );
+
+		*client.backlog += backlog_length;
+		backlog_ += backlog_length;
+
+		client.strand->post( [ this, who = client.handle, backlog_length, count, backlog = client.backlog, data = std::move( data ) ]( ) {
+			batch_callback_( this, who, { reinterpret_cast< const packets::received_packet* >( data.data( ) ), count } );
+			release_backlog( who, *backlog, backlog_length );
+		} );
+	} else
+		batch_callback_( this, client.handle, s.batch );
+
+	s.batch.clear( );
+}
+
+bool async_tcp_server::over_receive_limit( const client_state& client ) const {
+	if ( over_global_limit( ) )
+		return true;
+
+	// Without workers his packets are handled as they come in, nothing to wait for
+	return client.backlog && options_.receive_high_watermark && *client.backlog >= options_.receive_high_watermark;
+}
+
+bool async_tcp_server::over_global_limit( ) const {
+	return options_.receive_global_limit && backlog_ + buffered_ >= options_.receive_global_limit;
+}
+
+bool async_tcp_server::above_global_resume( ) const {
+	return options_.receive_global_limit && backlog_ + buffered_ > options_.receive_global_limit / 2;
+}
+
+bool async_tcp_server::below_resume_limit( const client_state& client ) const {
+	if ( above_global_resume( ) )
+		return false;
+
+	return !client.backlog || !options_.receive_high_watermark || *client.backlog <= options_.receive_low_watermark;
+}
+
+void async_tcp_server::check_receive_limit( shard& s, client_state& client ) {
+	if ( client.closed )
+		return;
+
+	track_buffered( s, client );
+
+	if ( client.receive_paused || !over_receive_limit( client ) )
+		return;
+
+	client.receive_paused = true;
+	s.paused.push_back( client.handle );
+
+	// The reactor simply stops reading, io_uring has to take back the multishot receive.
+	// Whatever it still delivers until the cancellation goes through is processed as usual.
+	if ( options_.engine == io_engine::uring && client.receiving && !s.uring.cancel( detail::uring::op::recv, token_of( client.handle ) ) )
+		s.uring_retry.push_back( client.handle );
+
+	if ( on_backpressure_callback_ )
+		on_backpressure_callback_( this, client.handle, backpressure_event::receive_paused );
+}
+
+void async_tcp_server::resume_receiving( shard& s ) {
+	if ( s.paused.empty( ) )
+		return;
+
+	std::vector< connection_handle > to_resume = { };
+
+	std::erase_if( s.paused, [ & ]( connection_handle who ) {
+		auto client = find_client( s, who );
+
+		if ( !client )
+			return true;
+
+		if ( !below_resume_limit( *client ) )
+			return false;
+
+		to_resume.push_back( who );
+		return true;
+	} );
+
+	// Resumed clients may get paused again right away, so they're only handled now
+	for ( auto who : to_resume ) {
+		auto client = find_client( s, who );
+
+		if ( !client )
+			continue;
+
+		client->receive_paused = false;
+
+		if ( on_backpressure_callback_ )
+			on_backpressure_callback_( this, who, backpressure_event::receive_resumed );
+
+		if ( options_.engine == io_engine::uring ) {
+			// The cancelled receive might not even have completed yet, it's rearmed once it does
+			if ( !client->receiving ) {
+				if ( s.uring.recv_multishot( client->socket, token_of( who ) ) )
+					client->receiving = true;
+				else
+					s.uring_retry.push_back( who );
+			}
+		} else {
+			// The reactor won't tell us about data that was already there when we stopped
+			receive_from( s, *client );
+		}
+	}
+}
+
+void async_tcp_server::release_backlog( connection_handle from, std::atomic_uint64_t& backlog, std::uint32_t length ) {
+	auto left = backlog -= length;
+
+	check_global_resume( ( backlog_ -= length ) + buffered_, length );
+
+	// Only wake his reactor when crossing his limit, anything else wouldn't resume him
+	if ( options_.receive_high_watermark && left <= options_.receive_low_watermark && left + length > options_.receive_low_watermark ) {
+		if ( auto s = find_shard( from ) )
+			wake_loop( *s );
+	}
+}
+
+void async_tcp_server::track_buffered( shard& s, client_state& client ) {
+	auto size = client.process_buffer.size( );
+
+	if ( size > client.buffered )
+		buffered_ += size - client.buffered;
+	else if ( size < client.buffered )
+		release_buffered( client.buffered - size );
+
+	client.buffered = size;
+
+	if ( size && !client.packet_timer && options_.receive_packet_timeout.count( ) )
+		schedule_packet_timeout( s, client );
+}
+
+void async_tcp_server::release_buffered( std::uint64_t length ) {
+	if ( length )
+		check_global_resume( ( buffered_ -= length ) + backlog_, length );
+}
+
+void async_tcp_server::check_global_resume( std::uint64_t total_left, std::uint64_t released ) {
+	auto resume_at = options_.receive_global_limit / 2;
+
+	// Only wake reactors when crossing the limit, anything else wouldn't resume anybody
+	if ( options_.receive_global_limit && total_left <= resume_at && total_left + released > resume_at ) {
+		for ( auto& s : shards_ )
+			wake_loop( *s );
+	}
+}
+
+void async_tcp_server::dispatch_packet( connection_handle from, const packets::header& header, packets::detail::packet_reader& reader ) {
+	// Requests carry their call ID ahead of the packet
+	if ( header.flags & packets::flags::fl_request ) {
+		call_context call = { from };
+		reader.deserialize( call.id );
+
+		if ( reader.is_good( ) )
+			call_handlers_.dispatch( header.id, reader, this, call );
+
+		return;
+	}
+
+	// Typed handlers come first, everything else goes to the processing callback
+	if ( !handlers_.dispatch( header.id, reader, this, from ) && process_callback_ )
+		process_callback_( this, from, header.id, reader );
+}
+
+int async_tcp_server::wait_timeout( shard& s ) {
+	// Without any timers we sleep until something happens
+	return s.timers.next_timeout( std::chrono::steady_clock::now( ), -1 );
+}
+
+bool async_tcp_server::submit_uring_send( shard& s, client_state& client ) {
+	std::lock_guard guard( s.mtx );
+
+	if ( client.closed || client.sending || !client.send_queue.gather( max_send_segments_ ) )
+		return true;
+
+	client.sending = s.uring.send_message( client.socket, client.send_queue.get_message( ), token_of( client.handle ) );
+
+	return client.sending;
+}
+
+void async_tcp_server::handle_uring_recv( shard& s, const detail::uring::completion& c ) {
+	// Completions for clients that are gone are just dropped
+	auto client = find_client( s, handle_of( s, c.data ) );
+
+	if ( c.result > 0 && client ) {
+		client->process_buffer.append( s.uring.buffer( c.buffer_id ), c.result );
+		client->last_receive = s.now;
+
+		if ( options_.sockets.quick_ack )
+			detail::quick_ack( client->socket );
+	}
+
+	if ( c.has_buffer )
+		s.uring.recycle_buffer( c.buffer_id );
+
+	if ( !client )
+		return;
+
+	// The multishot receive has terminated. Rearm it unless the client is gone, same
+	// rules as the reactor: on 0 (he closed the connection) and on errors we disconnect.
+	// We cancel it ourselves when pausing him, resume_receiving rearms it then.
+	if ( !c.more ) {
+		client->receiving = false;
+
+		if ( c.result > 0 || c.result == -ENOBUFS || c.result == -ECANCELED ) {
+			if ( !client->receive_paused ) {
+				if ( s.uring.recv_multishot( client->socket, c.data ) )
+					client->receiving = true;
+				else
+					s.uring_retry.push_back( client->handle );
+			}
+		} else {
+			remove_client( s, *client );
+			return;
+		}
+	}
+
+	if ( c.result > 0 ) {
+		process_client( s, *client );
+		check_receive_limit( s, *client );
+	}
+}
+
+void async_tcp_server::handle_uring_send( shard& s, const detail::uring::completion& c ) {
+	client_state* failed = nullptr;
+
+	{
+		std::lock_guard guard( s.mtx );
+
+		// Closed clients keep their slot until their send completes
+		auto handle = handle_of( s, c.data );
+		auto client = s.clients.get( handle.index, handle.generation );
+
+		if ( !client )
+			return;
+
+		client->sending = false;
+
+		if ( client->closed )
+			return;
+
+		if ( c.result < 0 )
+			failed = client;
+		else {
+			client->send_queue.advance( c.result );
+			client->bytes_sent += c.result;
+
+			complete_sends( s, *client );
+
+			// Whatever got queued in the meantime goes out right away
+			if ( client->send_queue.gather( max_send_segments_ ) ) {
+				client->sending = s.uring.send_message( client->socket, client->send_queue.get_message( ), c.data );
+
+				if ( !client->sending )
+					s.uring_retry.push_back( client->handle );
+			}
+		}
+	}
+
+	if ( failed )
+		remove_client( s, *failed );
+}
+
+void async_tcp_server::retry_uring( shard& s ) {
+	if ( !s.accepting && running_ )
+		s.accepting = s.uring.accept_multishot( s.listener, 0 );
+
+	if ( s.uring_retry.empty( ) )
+		return;
+
+	auto retry = std::move( s.uring_retry );
+	s.uring_retry.clear( );
+
+	// Whatever doesn't fit this time around stays on the list
+	for ( auto who : retry ) {
+		auto client = find_client( s, who );
+
+		if ( !client )
+			continue;
+
+		bool queued = true;
+
+		if ( client->receive_paused && client->receiving )
+			queued = s.uring.cancel( detail::uring::op::recv, token_of( who ) );
+		else if ( !client->receive_paused && !client->receiving )
+			queued = client->receiving = s.uring.recv_multishot( client->socket, token_of( who ) );
+
+		if ( !queued || !submit_uring_send( s, *client ) )
+			s.uring_retry.push_back( who );
+	}
+}
+
+void async_tcp_server::run_reactor( shard& s ) {
+	s.loop_id = std::this_thread::get_id( );
+
+	std::vector< detail::reactor::event > events( max_events_ );
+
+	while ( running_ ) {
+		// Sleep until one of our clients has something for us, idle clients cost us nothing
+		auto num_events = s.reactor.wait( events, wait_timeout( s ) );
+
+		s.now = std::chrono::steady_clock::now( );
+
+		handle_pending( s );
+
+		for ( std::size_t i = 0; i < num_events; i++ ) {
+			if ( events[ i ].token == listener_token ) {
+				accept_clients( s );
+				continue;
+			}
+
+			// The client might have been disconnected while we were waiting
+			auto client = find_client( s, handle_of( s, events[ i ].token ) );
+
+			if ( !client )
+				continue;
+
+			if ( events[ i ].events & detail::reactor::ev_write && client->sending ) {
+				{
+					std::lock_guard guard( s.mtx );
+					client->sending = false;
+				}
+
+				// Back to only caring about reads until the client's window fills up again
+				if ( !s.reactor.modify( client->socket, events[ i ].token, detail::reactor::ev_read ) || !write_to( s, *client ) ) {
+					remove_client( s, *client );
+					continue;
+				}
+			}
+
+			if ( events[ i ].events & ( detail::reactor::ev_read | detail::reactor::ev_close ) )
+				receive_from( s, *client );
+		}
+
+		s.timers.advance( s.now );
+
+		// Everything queued up since the last iteration goes out now, batched per client
+		flush_sends( s );
+		resume_waiters( s );
+		release_closed( s );
+	}
+
+	// Disconnect all clients on shutdown
+	handle_pending( s );
+
+	s.clients.for_each( [ & ]( std::uint32_t, client_state& client ) {
+		remove_client( s, client );
+	} );
+
+	resume_waiters( s );
+	release_closed( s );
+}
+
+void async_tcp_server::run_uring( shard& s ) {
+	s.loop_id = std::this_thread::get_id( );
+
+	std::vector< detail::uring::completion > completions( max_events_ );
+
+	s.accepting = s.uring.accept_multishot( s.listener, 0 );
+
+	while ( running_ ) {
+		// Everything queued up since the last iteration goes out in one syscall
+		flush_sends( s );
+		s.uring.submit_and_wait( wait_timeout( s ) );
+
+		s.now = std::chrono::steady_clock::now( );
+
+		handle_pending( s );
+
+		auto num_completions = s.uring.completions( completions );
+
+		for ( std::size_t i = 0; i < num_completions; i++ ) {
+			auto& c = completions[ i ];
+
+			switch ( c.type ) {
+				case detail::uring::op::accept:
+					if ( c.result >= 0 )
+						add_client( s, SOCKET( c.result ) );
+
+					if ( c.more || !running_ )
+						break;
+
+					// Rearming right away would just fail again until some descriptors free up
+					if ( c.result < 0 && detail::out_of_descriptors( -c.result ) ) {
+						if ( !s.accept_retry ) {
+							s.accept_retry = s.timers.schedule( s.now + accept_retry_delay_, [ this, &s ]( ) {
+								s.accept_retry = 0;
+								s.accepting = s.uring.accept_multishot( s.listener, 0 );
+							} );
+						}
+
+						s.accepting = true;
+						break;
+					}
+
+					s.accepting = s.uring.accept_multishot( s.listener, 0 );
+					break;
+				case detail::uring::op::recv:
+					handle_uring_recv( s, c );
+					break;
+				case detail::uring::op::send:
+					handle_uring_send( s, c );
+					break;
+				default:
+					break;
+			}
+		}
+
+		// With the completions reaped the ring takes requests again
+		retry_uring( s );
+
+		s.timers.advance( s.now );
+		resume_waiters( s );
+		release_closed( s );
+	}
+
+	// Disconnect all clients on shutdown
+	handle_pending( s );
+
+	s.clients.for_each( [ & ]( std::uint32_t, client_state& client ) {
+		remove_client( s, client );
+	} );
+
+	resume_waiters( s );
+}
@@ -1,111 +1,570 @@
 #pragma once
 
-#pragma region os_dependent_includes
+#include "../../shared/reactor/io_engine.h"
+#include "../../shared/platform/socket_options.h"
+#include "../../shared/buffers/ring_buffer.h"
+#include "../../shared/buffers/send_queue.h"
+#include "../../shared/slab/slab.h"
+#include "../../shared/timer/timer_wheel.h"
+#include "../../shared/executor/strand.h"
+#include "../../shared/coro/awaiters.h"
 
-#ifdef _WIN32	// Windows Machine
+#include <thread>
+#include <deque>
+#include <memory>
+#include <atomic>
+#include <mutex>
+#include <functional>
+#include <algorithm>
+#include <chrono>
+#include <span>
+#include <unordered_map>
 
-#include <WinSock2.h>
-#include <WS2tcpip.h>
+#include "../../shared/packets/packets.h"
+#include "../../shared/packets/packet_handlers.h"
 
-#pragma comment(lib, "ws2_32.lib")
+namespace fi {
+	// Identifies a client for as long as he's connected. Handles of a client that
+	// disconnected stay invalid, even once his slot (or socket) gets reused.
+	struct connection_handle {
+		std::uint32_t index = 0;
 
-#elif __linux__	// Linux machine
+		// 0 never refers to a client
+		std::uint32_t generation = 0;
 
-// todo: add linux includes
-#error Linux support not yet implemented (missing includes, untested on Linux).
+		// Which reactor owns the client
+		std::uint8_t shard = 0;
 
-#else
-#error OS unknown or not supported.
-#endif // _WIN32
+		bool operator==( const connection_handle& ) const = default;
 
-#pragma endregion os_dependent_includes
+		bool is_valid( ) const {
+			return generation != 0;
+		}
 
-#include <thread>
-#include <unordered_map>
-#include <mutex>
-#include <functional>
+		// Unique for every client, handy as a key
+		std::uint64_t value( ) const {
+			return std::uint64_t( generation ) << 32 | std::uint64_t( shard ) << 24 | index;
+		}
+	};
 
-#include "../../shared/packets/packets.h"
+	// Returned by set_timer, only needed to cancel the timer
+	struct timer_handle {
+		std::uint64_t id = 0;
+
+		// Which reactor runs the timer
+		std::uint16_t shard = 0;
+
+		bool is_valid( ) const {
+			return id != 0;
+		}
+	};
+
+	// Handed to call handlers along with the request, reply with it. It may be kept around
+	// to answer later on (from any thread), calls don't have to be answered in order.
+	struct call_context {
+		connection_handle from = { };
+		packets::call_id id = 0;
+	};
+
+	// Passed to the backpressure callback, see server_options
+	enum class backpressure_event : std::uint8_t {
+		receive_paused = 0,	// We stopped reading from the client
+		receive_resumed,
+		packet_too_large	// The client sent a packet above the high watermark and gets disconnected
+	};
+
+	struct server_options {
+		io_engine engine = io_engine::reactor;
+
+		// Amount of reactor threads. Each one listens on its own socket (SO_REUSEPORT) and
+		// owns the clients it accepted, so reactors never contend on shared locks.
+		// 0 starts one reactor per hardware thread, there are at most max_reactors.
+		std::uint32_t reactors = 1;
+		static constexpr std::uint32_t max_reactors = 256;
+
+		// Clients we haven't received anything from for this long get disconnected, 0 disables it
+		std::chrono::milliseconds idle_timeout = { };
+
+		// Runs the callbacks on a pool of this many worker threads rather than on the reactors,
+		// so slow callbacks don't hold up any other clients. Every client's callbacks still run
+		// one at a time, in order. 0 runs them on the reactors.
+		std::uint32_t workers = 0;
+
+		// Once this many bytes of a client's packets are waiting for a worker, we stop reading
+		// from him until the workers got him down to the low watermark. His TCP window fills up
+		// and he has to slow down rather than us buffering whatever he sends. Without workers
+		// packets are handled as they come in, so this only bounds his receive buffer. Packets
+		// bigger than the high watermark get him disconnected. 0 disables all of it.
+		std::uint32_t receive_high_watermark = 16 * 1024 * 1024;
+		std::uint32_t receive_low_watermark = 4 * 1024 * 1024;
+
+		// Same for all clients together, counting what sits in their receive buffers as well as
+		// what waits for the workers. Whoever we receive from while we hold this much gets
+		// paused, with or without workers, everyone resumes once we're back down to half.
+		// 0 disables it.
+		std::uint64_t receive_global_limit = 0;
+
+		// Clients that started a packet but didn't finish it within this long get disconnected,
+		// otherwise a header with a huge length pins his buffer for as long as he likes. Paused
+		// clients get more time, unless the global limit keeps them paused. 0 disables it.
+		std::chrono::milliseconds receive_packet_timeout = std::chrono::seconds( 30 );
+
+		// Applied to the listeners and every client we accept, cpu_affinity pins the
+		// reactor threads. socket_options::latency( ) for latency-sensitive setups.
+		socket_options sockets = { };
+	};
 
-namespace fi {
 	class async_tcp_server {
 	public:
 		async_tcp_server( );
 		~async_tcp_server( );
 
-		void start( std::string_view port );
+		// The io_uring engine needs Linux 6.0 or newer, start throws if it isn't available
+		void start( std::string_view port, io_engine engine = io_engine::reactor );
+		void start( std::string_view port, const server_options& options );
 		void stop( );
 
-		void disconnect_client( SOCKET who );
+		void disconnect_client( connection_handle who );
 
 		bool is_running( );
 
-		void send_packet( SOCKET to, packets::base_packet* packet );
+		// Whether the handle still refers to a connected client
+		bool is_connected( connection_handle who );
+
+		template < packets::packet_type packet_t >
+		void send_packet( connection_handle to, packet_t* packet ) {
+			if ( !packet )
+				throw exception( exception::reason_id::packet_nullptr, "async_tcp_server::send_packet: packet was nullptr" );
+
+			send_buffer( to, build_packet( *packet ) );
+		}
+
+		// These serialize the packet once and queue the very same buffer for every
+		// recipient. Clients we don't know (anymore) are skipped.
+		template < packets::packet_type packet_t >
+		void send_to( std::span< const connection_handle > to, packet_t* packet ) {
+			if ( !packet )
+				throw exception( exception::reason_id::packet_nullptr, "async_tcp_server::send_to: packet was nullptr" );
+
+			send_buffer( to, build_packet( *packet ) );
+		}
+
+		template < packets::packet_type packet_t >
+		void broadcast( packet_t* packet ) {
+			if ( !packet )
+				throw exception( exception::reason_id::packet_nullptr, "async_tcp_server::broadcast: packet was nullptr" );
+
+			broadcast_buffer( build_packet( *packet ) );
+		}
 
 		// The callback will be called once a packet is received. You must register
-		// your callback before you start the server, as not doing so will result
-		// in an exception.
-		void register_callback( std::function< void( async_tcp_server* const, const SOCKET, const packets::packet_id, packets::detail::binary_serializer& ) > callback_fn );
+		// your callback (or a handler, see below) before you start the server, as
+		// not doing so will result in an exception. Callbacks run on the reactor thread owning the client
+		// (or a worker, see server_options), with more than one reactor they may
+		// run concurrently.
+		void register_callback( std::function< void( async_tcp_server* const, const connection_handle, const packets::packet_id, packets::detail::packet_reader& ) > callback_fn );
+
+		// Takes the callback's place: packets that arrive back to back get handed over
+		// together, so handling them can share a lock, a transaction and so on. Packets
+		// with a handler (or a coroutine waiting for them) still go there, in order.
+		// The packets' data is only valid until the callback returns.
+		void register_batch_callback( std::function< void( async_tcp_server* const, const connection_handle, std::span< const packets::received_packet > ) > callback_fn );
+
+		// Registers a handler for a single packet type, it gets the packet already deserialized:
+		// void( async_tcp_server* const, const connection_handle, packet_t& ). Packets without
+		// a handler go to the callback. Register handlers before starting the server.
+		template < typename packet_t, typename fn_t >
+		void on( fn_t&& fn ) {
+			handlers_.on< packet_t >( std::forward< fn_t >( fn ) );
+		}
+
+		// Registers a handler for requests made with the client's call< request_t, response_t >:
+		// void( async_tcp_server* const, const call_context&, request_t& ). Answer them with
+		// reply. Requests without a handler are dropped, the client's call runs into its deadline.
+		template < typename request_t, typename fn_t >
+		void on_call( fn_t&& fn ) {
+			call_handlers_.on< request_t >( std::forward< fn_t >( fn ) );
+		}
+
+		// Sends the response to a call, the client matches it to its request by the call ID
+		template < packets::packet_type packet_t >
+		void reply( const call_context& call, packet_t* response ) {
+			if ( !response )
+				throw exception( exception::reason_id::packet_nullptr, "async_tcp_server::reply: packet was nullptr" );
+
+			send_buffer( call.from, build_packet( *response, packets::flags::fl_response, call.id ) );
+		}
+
+		// Attaches a pointer of your choosing to a client, it's
+		// dropped (not deleted) once the client disconnects
+		void set_user_data( connection_handle who, void* data );
+		void* get_user_data( connection_handle who );
+
+		// Calls the function once, after the delay has passed. It runs on the reactor owning the
+		// given client (the first one if there is none), so it never races his callbacks.
+		timer_handle set_timer( std::chrono::milliseconds delay, std::function< void( async_tcp_server* const ) > callback_fn, connection_handle owner = { } );
+		void cancel_timer( timer_handle timer );
+
+		// Lets a coroutine talk to a single client:
+		//   auto packet = co_await conn.receive< packets::example_packet >( );
+		//   co_await conn.send( &*packet );
+		// Coroutines are resumed by the reactor owning the client and carry on on its thread.
+		// receive gets the next packet of that type ahead of handlers and the callback,
+		// nullopt once the client is gone. send resumes once the packet was written to
+		// the socket, false if the client went away first.
+		class connection {
+		public:
+			connection( async_tcp_server* server, connection_handle handle ) : server_( server ), handle_( handle ) { }
+
+			template < typename packet_t >
+			detail::receive_operation< connection, packet_t > receive( ) {
+				return detail::receive_operation< connection, packet_t >( this );
+			}
+
+			template < packets::packet_type packet_t >
+			detail::send_operation< connection > send( packet_t* packet ) {
+				if ( !packet )
+					throw exception( exception::reason_id::packet_nullptr, "async_tcp_server::connection::send: packet was nullptr" );
+
+				return detail::send_operation< connection >( this, server_->build_packet( *packet ) );
+			}
+
+			connection_handle handle( ) const {
+				return handle_;
+			}
+
+			async_tcp_server* server( ) const {
+				return server_;
+			}
+
+		private:
+			template < typename, typename > friend class detail::receive_operation;
+			template < typename > friend class detail::send_operation;
+
+			bool add_receiver( detail::receive_waiter& waiter );
+			bool add_sender( detail::send_waiter& waiter, const detail::shared_buffer& data );
+
+			async_tcp_server* server_ = nullptr;
+			connection_handle handle_ = { };
+		};
 
 		// This function will be called as soon as the server stops.
 		void register_stop_callback( std::function< void( async_tcp_server* const ) > callback_fn );
 
 		// This function will be called as soon as a client dis/connects from/to the server.
-		void register_connect_callback( std::function< void( async_tcp_server* const, const SOCKET ) > callback_fn );
-		void register_disconnect_callback( std::function< void( async_tcp_server* const, const SOCKET ) > callback_fn );
+		void register_connect_callback( std::function< void( async_tcp_server* const, const connection_handle ) > callback_fn );
+		void register_disconnect_callback( std::function< void( async_tcp_server* const, const connection_handle ) > callback_fn );
+
+		// Called whenever a client hits one of the receive limits (see server_options) and once
+		// he's resumed. Runs on the reactor thread owning the client, even when using workers.
+		void register_backpressure_callback( std::function< void( async_tcp_server* const, const connection_handle, const backpressure_event ) > callback_fn );
 
 	private:
 	#ifdef _WIN32
 		WSADATA wsa_data_ = { };
 	#endif // _WIN32
 
-		packets::header construct_packet_header( packets::packet_length length, packets::packet_id id, packets::packet_flags flags );
+		// Everything we know about a connected client
+		struct client_state {
+			SOCKET socket = INVALID_SOCKET;
+
+			// Reactor events and io_uring requests are tagged with this rather than the
+			// socket, so events for a closed (and possibly reused) socket can't be
+			// mistaken for a new client's
+			connection_handle handle = { };
+
+			// Set once the client got disconnected, his slot is released a little later
+			bool closed = false;
+
+			// Until the client answers our handshake it's invisible to the user
+			bool handshaking = true;
+
+			detail::ring_buffer process_buffer = { };
+
+			// Outbound packets, guarded by the shard's mutex. Senders only queue packets up,
+			// the loop thread writes them out. Only one write may be in flight at a time,
+			// otherwise the kernel is free to reorder them.
+			detail::send_queue send_queue = { };
 
-		// We have a seperate function which will perform a handshake with the client
-		// to make sure we are talking to a client which will understand our packets.
-		bool perform_handshake( SOCKET with );
+			// Waiting in the shard's to_send list
+			bool queued = false;
 
-		// Function for sending our packet
-		bool send_packet_internal( SOCKET to, void* const data, const packets::packet_length length );
+			// io_uring: a send is in flight. Reactor: waiting for the socket to become writable.
+			bool sending = false;
+
+			// Guarded by the shard's mutex
+			void* user_data = nullptr;
+
+			// Something got queued since his last heartbeat, guarded by the shard's mutex
+			bool sent_recently = false;
+
+			// The handshake timeout at first, the idle timeout afterwards
+			detail::timer_wheel::timer_id heartbeat_timer = 0, timeout_timer = 0;
+
+			// Armed while his buffer holds part of a packet
+			detail::timer_wheel::timer_id packet_timer = 0;
+
+			// Bytes of his buffer counted in buffered_, and bytes of his packets we're done
+			// with (tells the packet timeout whether he's making progress)
+			std::uint32_t buffered = 0;
+			std::uint64_t processed = 0;
+
+			std::chrono::steady_clock::time_point last_receive = { };
+
+			// Hands his callbacks to the workers, if we have any
+			std::shared_ptr< detail::strand > strand = { };
+
+			// Bytes of his packets the workers haven't handled yet. Shared with the
+			// workers, as they may still be handling some once he's gone.
+			std::shared_ptr< std::atomic_uint64_t > backlog = { };
+
+			// We stopped reading from him until the workers catch up
+			bool receive_paused = false;
+
+			// io_uring: his multishot receive is armed
+			bool receiving = false;
+
+			// Coroutines waiting on the client. Receivers are only touched by the loop
+			// thread, senders are guarded by the shard's mutex.
+			std::vector< detail::receive_waiter* > receivers = { };
+			std::deque< detail::send_waiter* > senders = { };
+
+			// Bytes queued and written over the whole connection, guarded by the shard's mutex
+			std::uint64_t bytes_queued = 0, bytes_sent = 0;
+		};
+
+		// A reactor thread and everything it owns. Shards never touch each other's state.
+		struct shard {
+			std::uint8_t index = 0;
+
+			SOCKET listener = INVALID_SOCKET;
+
+			// Without SO_REUSEPORT all shards share the first shard's listener
+			bool owns_listener = true;
+
+			detail::reactor reactor = { };
+			detail::uring uring = { };
+
+			// Other threads check it to see whether they may take a shortcut
+			std::atomic< std::thread::id > loop_id = { };
+
+			// Only the loop thread adds or releases clients, but it holds mtx while
+			// doing so, which lets other threads look clients up
+			detail::slab< client_state > clients = { };
+
+			// Disconnected clients are only released at the end of a loop iteration, as
+			// callbacks further up the stack might still be using them. With io_uring they
+			// also wait for the kernel to be done with their send buffers.
+			std::vector< std::uint32_t > closing = { };
+
+			// Clients we stopped reading from, checked every loop iteration
+			std::vector< connection_handle > paused = { };
+
+			// Work other threads hand to the loop thread, guarded by mtx
+			std::mutex mtx = { };
+			std::vector< connection_handle > to_disconnect = { }, to_send = { }, flushing = { };
+
+			// Clients whose io_uring requests didn't fit into the ring, see retry_uring.
+			// Only touched by the loop thread, like accepting.
+			std::vector< connection_handle > uring_retry = { };
+			bool accepting = false;
+
+			// Set while we're out of descriptors, accepting picks up again once it fires
+			detail::timer_wheel::timer_id accept_retry = 0;
+
+			// User timers set or cancelled from other threads, guarded by mtx
+			struct pending_timer {
+				std::uint64_t id = 0;
+				std::chrono::steady_clock::time_point when = { };
+				std::function< void( async_tcp_server* const ) > fn = { };
+			};
+
+			std::vector< pending_timer > timers_to_set = { };
+			std::vector< std::uint64_t > timers_to_cancel = { };
+
+			// Heartbeats, handshake and idle timeouts as well as user timers
+			detail::timer_wheel timers = { };
+
+			// Coroutines from other threads that want to receive, guarded by mtx
+			struct pending_receiver {
+				connection_handle client = { };
+				detail::receive_waiter* waiter = nullptr;
+			};
+
+			std::vector< pending_receiver > receivers_to_add = { };
+
+			// Packets process_client collected for the batch callback
+			std::vector< packets::received_packet > batch = { };
+
+			// Coroutines to resume once we're done with this loop iteration
+			std::vector< std::coroutine_handle< > > to_resume = { };
+
+			// Maps the ids we gave out in set_timer to the wheel's
+			std::unordered_map< std::uint64_t, detail::timer_wheel::timer_id > user_timers = { };
+
+			// Taken once every loop iteration, saves us from asking the clock for every event
+			std::chrono::steady_clock::time_point now = { };
+
+			std::thread loop_thread = { };
+		};
+
+		packets::header construct_packet_header( packets::packet_length length, packets::packet_id id, packets::packet_flags flags );
+
+		// Builds the packet as it goes out on the wire
+		template < typename packet_t >
+		detail::shared_buffer build_packet( packet_t& packet, packets::packet_flags flags = packets::flags::fl_none, packets::call_id call = 0 ) {
+			auto data = packets::detail::encode_packet( packet, flags, call );
+
+			if ( !data )
+				throw exception( exception::reason_id::serialization_error, "async_tcp_server::build_packet: serialize wrote a different amount than serialized_size returned" );
+
+			return data;
+		}
+
+		detail::shared_buffer build_packet( packets::packet_id id, packets::packet_flags flags );
+
+		// We perform a handshake with every client to make sure we are talking to a client
+		// which will understand our packets. It runs on the loop thread like everything else,
+		// a client that doesn't answer in time gets dropped without holding anyone else up.
+		void begin_handshake( shard& s, client_state& client );
+		bool complete_handshake( shard& s, client_state& client );
+
+		// Every client runs on his own heartbeat and idle timers, so they're
+		// spread out instead of all firing at once
+		void schedule_heartbeat( shard& s, client_state& client, std::chrono::milliseconds delay );
+		void schedule_idle_timeout( shard& s, client_state& client );
+		void schedule_packet_timeout( shard& s, client_state& client );
+
+		void add_user_timer( shard& s, shard::pending_timer& timer );
+		void remove_user_timer( shard& s, std::uint64_t id );
+
+		// Queues a fully built packet, the loop thread sends it the next time around.
+		// Never blocks, no matter how far behind the client is.
+		void queue_send( shard& s, client_state& client, const detail::shared_buffer& data );
+
+		// Queues a built packet for the client, if we still know him
+		void send_buffer( connection_handle to, const detail::shared_buffer& data );
+		void send_buffer( std::span< const connection_handle > to, const detail::shared_buffer& data );
+		void broadcast_buffer( const detail::shared_buffer& data );
+
+		// Same as above, but the caller holds the shard's mutex and wakes the loop
+		// thread up (using wake_loop) if we return true
+		bool enqueue( shard& s, client_state& client, const detail::shared_buffer& data );
+		void wake_loop( shard& s );
+
+		// Handles carry their shard, so looking a client up is just indexing. Returns
+		// nullptr for clients that are gone. Needs the shard's mutex unless called
+		// from its loop thread.
+		shard* find_shard( connection_handle who );
+		client_state* find_client( shard& s, connection_handle who );
+
+		// Reactor events and io_uring requests carry the client's index (lower 24 bits)
+		// and generation, io_uring keeps the upper byte for itself
+		static std::uint64_t token_of( connection_handle who );
+		static connection_handle handle_of( shard& s, std::uint64_t token );
+
+		void join_shards( );
+
+		// These only ever run on the shard's loop thread
+		void handle_pending( shard& s );
+		void accept_clients( shard& s );
+		void add_client( shard& s, SOCKET socket );
+		void remove_client( shard& s, client_state& client );
+		void release_closed( shard& s );
+		void flush_sends( shard& s );
+
+		// Caller holds the shard's mutex
+		void complete_sends( shard& s, client_state& client );
+
+		// Resumes everyone in to_resume, flushing whatever they queued up
+		void resume_waiters( shard& s );
+		bool write_to( shard& s, client_state& client );
+		void receive_from( shard& s, client_state& client );
+		void process_client( shard& s, client_state& client );
+
+		// Receive side backpressure. Paused clients are resumed by handle_pending, workers
+		// release their backlog and wake the shard once there's a chance to resume him.
+		bool over_receive_limit( const client_state& client ) const;
+		bool over_global_limit( ) const;
+		bool above_global_resume( ) const;
+		bool below_resume_limit( const client_state& client ) const;
+		void check_receive_limit( shard& s, client_state& client );
+		void resume_receiving( shard& s );
+		void release_backlog( connection_handle from, std::atomic_uint64_t& backlog, std::uint32_t length );
+
+		// Brings buffered_ up to date with the client's buffer, arms his packet timeout
+		void track_buffered( shard& s, client_state& client );
+		void release_buffered( std::uint64_t length );
+
+		// Wakes every reactor once we dropped back below half the global limit
+		void check_global_resume( std::uint64_t total_left, std::uint64_t released );
+		void dispatch_packet( connection_handle from, const packets::header& header, packets::detail::packet_reader& reader );
+
+		// Hands the packets collected so far to the batch callback, or the client's worker
+		void flush_batch( shard& s, client_state& client );
+		int wait_timeout( shard& s );
+
+		// io_uring helpers, only used when running on that engine. Requests the ring had
+		// no room for are retried by retry_uring once we reaped completions.
+		bool submit_uring_send( shard& s, client_state& client );
+		void handle_uring_recv( shard& s, const detail::uring::completion& c );
+		void handle_uring_send( shard& s, const detail::uring::completion& c );
+		void retry_uring( shard& s );
 
 		// These functions are running in a thread
-		void accept_clients( );
-		void process_data( );
-		void receive_data( );
-		void run_heartbeat( ); 
+		void run_reactor( shard& s );
+		void run_uring( shard& s );
+
+		std::atomic_bool running_ = false;
+
+		std::atomic_uint64_t next_timer_id_ = 1;
+
+		// Bytes of all clients' packets the workers haven't handled yet, and bytes sitting
+		// in their receive buffers. Both count against the global receive limit.
+		std::atomic_uint64_t backlog_ = 0, buffered_ = 0;
+
+		// Every client gets the very same heartbeat
+		detail::shared_buffer heartbeat_ = { };
 
-		bool running_ = false;
+		server_options options_ = { };
 
-		// This specifies the buffer size when receiving data. 
-		// It does not affect the size of the processing queue.
+		// This specifies the size of a single receive. Each client's
+		// buffer grows as needed to fit whole packets.
 		const std::uint32_t buffer_size_ = PACKET_BUFFER_SIZE;
 
+		// Maximum amount of socket events handled per reactor wakeup
+		const std::uint32_t max_events_ = 256;
+
+		// Maximum amount of packets written with a single syscall
+		const std::uint32_t max_send_segments_ = 64;
+
+		// How long we wait for descriptors to free up before accepting again
+		const std::chrono::milliseconds accept_retry_delay_ = std::chrono::milliseconds( 100 );
+
+		// Size of the io_uring submission queue and how many receive buffers we give the kernel
+		const std::uint32_t uring_entries_ = 1024;
+		const std::uint16_t uring_buffer_count_ = 256;
+
 		// The amount of time to wait between heartbeat packets
 		const std::chrono::duration< long long > heartbeat_interval_ = std::chrono::seconds( 5 );
 
-		SOCKET server_socket_ = 0;
-	
-		std::mutex send_mtx_ = { }, disconnect_mtx_ = { };
-
-		// These CAN be accessed in the same thread multiple times, therefore we 
-		// need to make these recursive.
-		std::recursive_mutex client_mtx_ = { }, process_mtx_ = { };
+		// How long a client may take to answer our handshake
+		const std::chrono::duration< long long > handshake_timeout_ = std::chrono::seconds( 5 );
 
-		std::vector< SOCKET > clients_to_disconnect_ = { };
+		std::vector< std::unique_ptr< shard > > shards_ = { };
 
-		std::vector< SOCKET > connected_clients_ = { };
-		std::unordered_map< SOCKET, std::vector< std::uint8_t > > process_buffers_ = { };
+		std::unique_ptr< detail::thread_pool > workers_ = { };
 
-		std::function< void( async_tcp_server* const, const SOCKET ) > on_connect_callback = { }, on_disconnect_callback_ = { };
+		std::function< void( async_tcp_server* const, const connection_handle ) > on_connect_callback = { }, on_disconnect_callback_ = { };
 		std::function< void( async_tcp_server* const ) > on_stop_callback_ = { };
+		std::function< void( async_tcp_server* const, const connection_handle, const backpressure_event ) > on_backpressure_callback_ = { };
 
 		// Our main processing callback
-		std::function< void( async_tcp_server* const, const SOCKET, const packets::packet_id, packets::detail::binary_serializer& ) > process_callback_ = { };
-
-		std::thread accepting_thread_ = { }, processing_thread_ = { }, receiving_thread_ = { }, heartbeat_thread_ { };
+		std::function< void( async_tcp_server* const, const connection_handle, const packets::packet_id, packets::detail::packet_reader& ) > process_callback_ = { };
+		std::function< void( async_tcp_server* const, const connection_handle, std::span< const packets::received_packet > ) > batch_callback_ = { };
 
-		// This will help us in serializing our packet data
-		packets::detail::binary_serializer serializer = { };
+		packets::detail::handler_table< async_tcp_server*, connection_handle > handlers_ = { };
+		packets::detail::handler_table< async_tcp_server*, const call_context& > call_handlers_ = { };
 
 	public:
 		class exception : public std::exception {
@@ -120,16 +579,20 @@ namespace fi {
 				null_callback,
 				no_callback,
 				bind_error,
-				listen_error
+				listen_error,
+				reactor_failure,
+				engine_unavailable,
+				affinity_failure,
+				serialization_error
 			};
 
-			exception( reason_id reason, std::string_view what ) : reason_( reason ), what_( what ) { };
+			exception( reason_id reason, std::string_view what ) : what_( what ), reason_( reason ) { };
 
 			virtual const char* what( ) const noexcept {
 				return what_.data( );
 			}
 
-			const reason_id get_reason( ) {
+			reason_id get_reason( ) const {
 				return reason_;
 			}
 
@@ -138,4 +601,4 @@ namespace fi {
 			reason_id reason_ = reason_id::none;
 		};
 	};
-} // namespace fi
\ No newline at end of file
+} // namespace fi
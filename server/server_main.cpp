@@ -1,14 +1,9 @@
 #include "async_server/async_server.h"
 
-#define PROCESS_PACKET_FN(ID, name) void name( fi::async_tcp_server* const sv, const SOCKET from, const fi::packets::packet_id id, fi::packets::detail::binary_serializer& s)
-
-PROCESS_PACKET_FN( fi::packets::id_example, on_example_packet ) {
-	// Read our packet
-	fi::packets::example_packet example( s );
-
-	// Now we can access our data
+void on_example_packet( fi::async_tcp_server* const sv, const fi::connection_handle from, fi::packets::example_packet& example ) {
+	// The packet arrives already deserialized, we can access our data right away
 	for ( std::size_t i = 0; i < example.some_string_array.size( ); i++ )
-		printf( "[ %i ] %s\n", i, example.some_string_array[ i ].data( ) );
+		printf( "[ %zu ] %s\n", i, example.some_string_array[ i ].data( ) );
 
 	// Answer the client
 	example.some_string_array = { "Hello", "from", "server!" };
@@ -16,39 +11,47 @@ PROCESS_PACKET_FN( fi::packets::id_example, on_example_packet ) {
 	sv->send_packet( from, &example );
 }
 
-int main( ) {
+int main( int argc, char** argv ) {
+	// Pass --uring to run on the io_uring engine instead of the reactor
+	auto engine = argc > 1 && std::string_view( argv[ 1 ] ) == "--uring" ? fi::io_engine::uring : fi::io_engine::reactor;
+
 	try {
 		fi::async_tcp_server server = { };
 
 		// Setup all our callbacks before starting the server
-		server.register_connect_callback( [ ]( fi::async_tcp_server* const sv, SOCKET who ) {
-			printf( "Client with socket ID %i has connected.\n", who );
+		server.register_connect_callback( [ ]( fi::async_tcp_server* const, const fi::connection_handle who ) {
+			printf( "Client %u has connected.\n", who.index );
 		} );
 
-		server.register_disconnect_callback( [ ]( fi::async_tcp_server* const sv, SOCKET who ) {
-			printf( "Client with socket ID %i has disconnected.\n", who );
+		server.register_disconnect_callback( [ ]( fi::async_tcp_server* const sv, const fi::connection_handle who ) {
+			printf( "Client %u has disconnected.\n", who.index );
 			
 			// Stop the server as we're done communicating
 			sv->stop( );
 		} );
 
-		server.register_stop_callback( [ ]( fi::async_tcp_server* const sv ) {
+		server.register_stop_callback( [ ]( fi::async_tcp_server* const ) {
 			printf( "Server has been stopped.\n" );
 		} );
 
-		server.register_callback( [ ]( fi::async_tcp_server* const sv, SOCKET from, const fi::packets::packet_id id, fi::packets::detail::binary_serializer& s ) {
-			// You can use a switch case, an unordered map, an array.. whichever suits you best
-			switch ( id ) {
-				case fi::packets::id_example:
-					on_example_packet( sv, from, id, s );
-					break;
-				default:
-					printf( "Unknown packet ID %i received\n", id );
-			}
+		// Every packet type gets its own handler
+		server.on< fi::packets::example_packet >( on_example_packet );
+
+		// Anything we don't have a handler for ends up here
+		server.register_callback( [ ]( fi::async_tcp_server* const, const fi::connection_handle, const fi::packets::packet_id id, fi::packets::detail::packet_reader& ) {
+			printf( "Unknown packet ID %i received\n", id );
 		} );
 
-		// Attempt to start the server
-		server.start( "1337" );
+		// Attempt to start the server. io_uring needs Linux 6.0, the reactor runs anywhere.
+		try {
+			server.start( "1337", engine );
+		} catch ( const fi::async_tcp_server::exception& e ) {
+			if ( e.get_reason( ) != fi::async_tcp_server::exception::reason_id::engine_unavailable )
+				throw;
+
+			printf( "io_uring is not available, falling back to the reactor.\n" );
+			server.start( "1337", fi::io_engine::reactor );
+		}
 
 		printf( "Server running on port 1337.\n" );
 
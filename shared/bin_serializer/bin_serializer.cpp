@@ -2,53 +2,174 @@
 
 using namespace fi::packets::detail;
 
-void binary_serializer::serialize( const std::string& item ) {
-	write_to_buffer< std::uint32_t >( item.length( ) );
-	serialized_buffer_.insert( serialized_buffer_.end( ), item.begin( ), item.end( ) );
+void binary_serializer::serialize( std::string_view item ) {
+	serialize< std::uint32_t >( item.length( ) );
+	write_to_buffer( item.data( ), item.length( ) );
 }
 
 void binary_serializer::serialize( const std::vector< std::string >& item ) {
-	write_to_buffer< std::uint32_t >( item.size( ) );
+	serialize< std::uint32_t >( item.size( ) );
 
 	for ( auto& s : item )
 		serialize( s );
 }
 
-void binary_serializer::deserialize( std::string& out_item ) {
-	auto length = read_from_buffer< std::uint32_t >( );
-	
-	out_item.resize( length );
-	memcpy( out_item.data( ), serialized_buffer_.data( ) + deserialized_bytes_, length );
-	
-	deserialized_bytes_ += length;
+void binary_serializer::serialize( const bytes_view& item ) {
+	serialize< std::uint32_t >( item.size( ) );
+	write_to_buffer( item.data( ), item.size( ) );
 }
 
-void binary_serializer::deserialize( std::vector< std::string >& out_item ) {
-	auto num_strings = read_from_buffer< std::uint32_t >( );
+void binary_serializer::serialize( const string_view_list& item ) {
+	serialize< std::uint32_t >( item.size( ) );
 
-	out_item.resize( num_strings );
-	for ( std::uint32_t i = 0; i < num_strings; i++ ) {
-		std::string deserialized = "";
-		deserialize( deserialized );
+	// Still prefixed with their lengths, exactly as they came in, unless they came in the other encoding
+	if ( item.is_compact( ) != compact_ ) {
+		for ( auto s : item )
+			serialize( s );
 
-		out_item[ i ] = std::move( deserialized );
+		return;
 	}
+
+	write_to_buffer( item.bytes( ).data( ), item.bytes( ).size( ) );
 }
 
 std::uint8_t* binary_serializer::get_serialized_data( ) {
-	return serialized_buffer_.data( );
+	return measuring_ ? nullptr : out_.data( );
 }
 
 std::uint32_t binary_serializer::get_serialized_data_length( ) {
-	return serialized_buffer_.size( );
+	return std::uint32_t( length_ );
+}
+
+bool binary_serializer::is_good( ) const {
+	return good_;
 }
 
 void binary_serializer::reset( ) {
-	deserialized_bytes_ = 0;
-	serialized_buffer_.clear( );
+	length_ = 0;
+	good_ = true;
+}
+
+void binary_serializer::set_compact( bool compact ) {
+	compact_ = compact;
+}
+
+bool binary_serializer::is_compact( ) const {
+	return compact_;
+}
+
+void packet_reader::deserialize( std::string& out_item ) {
+	auto length = read_from_buffer< std::uint32_t >( );
+
+	if ( !can_read( length ) ) {
+		out_item.clear( );
+		return;
+	}
+
+	out_item.assign( reinterpret_cast< const char* >( data_.data( ) + read_bytes_ ), length );
+
+	read_bytes_ += length;
+}
+
+void packet_reader::deserialize( std::vector< std::string >& out_item ) {
+	auto num_strings = read_from_buffer< std::uint32_t >( );
+
+	// Every string takes up at least its length prefix, don't let a bogus count make us allocate
+	if ( !can_read( std::size_t( num_strings ) * ( compact_ ? 1 : sizeof( std::uint32_t ) ) ) ) {
+		out_item.clear( );
+		return;
+	}
+
+	out_item.resize( num_strings );
+	for ( std::uint32_t i = 0; i < num_strings; i++ )
+		deserialize( out_item[ i ] );
+}
+
+void packet_reader::deserialize( std::string_view& out_item ) {
+	auto length = read_from_buffer< std::uint32_t >( );
+
+	if ( !can_read( length ) ) {
+		out_item = { };
+		return;
+	}
+
+	out_item = std::string_view( reinterpret_cast< const char* >( data_.data( ) + read_bytes_ ), length );
+
+	read_bytes_ += length;
+}
+
+void packet_reader::deserialize( bytes_view& out_item ) {
+	auto length = read_from_buffer< std::uint32_t >( );
+
+	if ( !can_read( length ) ) {
+		out_item = { };
+		return;
+	}
+
+	out_item = bytes_view( data_.subspan( read_bytes_, length ) );
+
+	read_bytes_ += length;
+}
+
+void packet_reader::deserialize( string_view_list& out_item ) {
+	auto num_strings = read_from_buffer< std::uint32_t >( );
+	auto first = read_bytes_;
+
+	// Walk the strings once, so iterating the list later can't run past the packet
+	for ( std::uint32_t i = 0; i < num_strings && good_; i++ ) {
+		auto length = read_from_buffer< std::uint32_t >( );
+
+		if ( can_read( length ) )
+			read_bytes_ += length;
+	}
+
+	if ( !good_ ) {
+		out_item = { };
+		return;
+	}
+
+	out_item = string_view_list( data_.subspan( first, read_bytes_ - first ), num_strings, compact_ );
+}
+
+std::span< const std::uint8_t > packet_reader::get_data( ) const {
+	return data_;
+}
+
+std::size_t packet_reader::get_remaining( ) const {
+	return data_.size( ) - read_bytes_;
+}
+
+bool packet_reader::is_good( ) const {
+	return good_;
+}
+
+void packet_reader::set_compact( bool compact ) {
+	compact_ = compact;
+}
+
+bool packet_reader::is_compact( ) const {
+	return compact_;
+}
+
+bool packet_reader::can_read( std::size_t length ) {
+	if ( good_ && length <= data_.size( ) - read_bytes_ )
+		return true;
+
+	good_ = false;
+	return false;
 }
 
-void binary_serializer::assign_buffer( std::uint8_t* const data, std::uint32_t length ) {
-	reset( );
-	serialized_buffer_.insert( serialized_buffer_.begin( ), data, data + length );
+bool packet_reader::read_varint( std::uint64_t& value ) {
+	if ( !good_ )
+		return false;
+
+	auto length = decode_varint( data_.data( ) + read_bytes_, get_remaining( ), value );
+
+	if ( !length ) {
+		good_ = false;
+		return false;
+	}
+
+	read_bytes_ += length;
+	return true;
 }
\ No newline at end of file
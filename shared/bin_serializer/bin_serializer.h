@@ -2,35 +2,158 @@
 #include <cstdint>
 #include <vector>
 #include <string>
+#include <cstring>
+#include <span>
+#include <string_view>
 
-#define ARITHMETIC_TYPE_ONLY typename std::enable_if< std::is_arithmetic< T >::value >::type* = nullptr
+#include "byte_order.h"
+#include "varint.h"
+#include "packet_views.h"
 
-// TODO: add endianness
+#define ARITHMETIC_TYPE_ONLY typename std::enable_if< std::is_arithmetic< T >::value >::type* = nullptr
 
 namespace fi::packets::detail {
+	// Runs in two passes: a serializer without a buffer only adds up how many bytes the
+	// items take, that decides the size of the send buffer. One writing into the buffer
+	// then copies every item straight to where it gets sent from. Items that don't fit
+	// are dropped and mark the serializer as failed.
+	//
+	// In compact mode integers wider than a byte (length prefixes included) are written
+	// as varints, see varint.h. Floats and bytes are written the same either way.
 	class binary_serializer {
 	public:
+		// Measures only
+		binary_serializer( ) { }
+
+		binary_serializer( std::span< std::uint8_t > out ) : out_( out ), measuring_( false ) { }
+
 		// Methods for serializiation
 		template < typename T, ARITHMETIC_TYPE_ONLY >
 		void serialize( T item ) {
-			write_to_buffer( item );
+			if constexpr ( is_varint< T > ) {
+				if ( compact_ ) {
+					write_varint( to_varint( item ) );
+					return;
+				}
+			}
+
+			item = to_wire( item );
+			write_to_buffer( &item, sizeof( T ) );
 		}
 
 		template < typename T, ARITHMETIC_TYPE_ONLY >
-		void serialize( std::vector< T >& item ) {
-			write_to_buffer< std::uint32_t >( item.size( ) );
-			
-			serialized_buffer_.insert( 
-				serialized_buffer_.end( ), 
-				reinterpret_cast< std::uint8_t* >( item.data( ) ),
-				reinterpret_cast< std::uint8_t* >( item.data( ) ) + item.size( ) * sizeof( T )
-			);
+		void serialize( const std::vector< T >& item ) {
+			serialize< std::uint32_t >( item.size( ) );
+
+			if constexpr ( is_varint< T > ) {
+				if ( compact_ ) {
+					write_varints( item.begin( ), item.end( ) );
+					return;
+				}
+			}
+
+			// Converted all at once rather than element by element
+			if ( auto out = reserve( item.size( ) * sizeof( T ) ) )
+				copy_to_wire( out, item.data( ), item.size( ) );
+		}
+
+		// Still in wire order, exactly as it came in
+		template < typename T >
+		void serialize( const array_view< T >& item ) {
+			serialize< std::uint32_t >( item.size( ) );
+
+			if constexpr ( is_varint< T > ) {
+				if ( compact_ ) {
+					write_varints( item.begin( ), item.end( ) );
+					return;
+				}
+			}
+
+			write_to_buffer( item.bytes( ).data( ), item.bytes( ).size( ) );
 		}
 
-		void serialize( const std::string& item );
+		void serialize( std::string_view item );
 		void serialize( const std::vector< std::string >& item );
 
-		// Methods for deserialization
+		void serialize( const bytes_view& item );
+		void serialize( const string_view_list& item );
+
+		// The buffer we write into, nullptr when measuring
+		std::uint8_t* get_serialized_data( );
+
+		// Bytes written (or measured) so far
+		std::uint32_t get_serialized_data_length( );
+
+		// False once an item didn't fit into the buffer
+		bool is_good( ) const;
+
+		void reset( );
+
+		// Compact packets switch this on before writing their members
+		void set_compact( bool compact );
+		bool is_compact( ) const;
+
+	private:
+		// Where to write the next length bytes, nullptr when measuring or out of room
+		std::uint8_t* reserve( std::size_t length ) {
+			if ( measuring_ ) {
+				length_ += length;
+				return nullptr;
+			}
+
+			if ( !good_ || length > out_.size( ) - length_ ) {
+				good_ = false;
+				return nullptr;
+			}
+
+			auto out = out_.data( ) + length_;
+			length_ += length;
+
+			return out;
+		}
+
+		void write_to_buffer( const void* data, std::size_t length ) {
+			// Empty views don't have to point anywhere
+			if ( auto out = reserve( length ); out && length )
+				memcpy( out, data, length );
+		}
+
+		void write_varint( std::uint64_t value ) {
+			if ( auto out = reserve( varint_size( value ) ) )
+				encode_varint( out, value );
+		}
+
+		// Sized up front, so the elements go out with a single reserve
+		template < typename iterator_t >
+		void write_varints( iterator_t first, iterator_t last ) {
+			std::size_t length = 0;
+
+			for ( auto it = first; it != last; ++it )
+				length += varint_size( to_varint( *it ) );
+
+			if ( auto out = reserve( length ) ) {
+				for ( auto it = first; it != last; ++it )
+					out += encode_varint( out, to_varint( *it ) );
+			}
+		}
+
+		std::span< std::uint8_t > out_ = { };
+		std::size_t length_ = 0;
+
+		bool measuring_ = true;
+		bool good_ = true;
+		bool compact_ = false;
+	};
+
+	// Read-only counterpart of binary_serializer. It reads straight out of the
+	// receive buffer, which is only valid for the duration of the packet callback.
+	// Reading past the end of the packet yields zeroes/empty items and marks
+	// the reader as failed instead of touching memory we don't own. So does a
+	// varint that's malformed or too big for the member it's read into.
+	class packet_reader {
+	public:
+		packet_reader( std::span< const std::uint8_t > data ) : data_( data ) { }
+
 		template < typename T, ARITHMETIC_TYPE_ONLY >
 		void deserialize( T& item ) {
 			item = read_from_buffer< T >( );
@@ -40,40 +163,136 @@ namespace fi::packets::detail {
 		void deserialize( std::vector< T >& out_item ) {
 			auto num_items = read_from_buffer< std::uint32_t >( );
 
+			if constexpr ( is_varint< T > ) {
+				if ( compact_ ) {
+					read_varints( out_item, num_items );
+					return;
+				}
+			}
+
+			if ( !can_read( std::size_t( num_items ) * sizeof( T ) ) ) {
+				out_item.clear( );
+				return;
+			}
+
 			out_item.resize( num_items );
-			memcpy( out_item.data( ), serialized_buffer_.data( ) + deserialized_bytes_, num_items * sizeof( T ) );
+			copy_from_wire( out_item.data( ), data_.data( ) + read_bytes_, num_items );
 
-			deserialized_bytes_ += num_items * sizeof( T );
+			read_bytes_ += num_items * sizeof( T );
 		}
 
 		void deserialize( std::string& out_item );
 		void deserialize( std::vector< std::string >& out_item );
 
-		std::uint8_t* get_serialized_data( );
-		std::uint32_t get_serialized_data_length( );
+		// These point into the packet instead of copying out of it, see packet_views.h
+		template < typename T >
+		void deserialize( array_view< T >& out_item ) {
+			auto num_items = read_from_buffer< std::uint32_t >( );
 
-		void reset( );
-		void assign_buffer( std::uint8_t* const data, std::uint32_t length );
+			// Packed integers have nothing to point at
+			if constexpr ( is_varint< T > ) {
+				if ( compact_ )
+					good_ = false;
+			}
+
+			if ( !can_read( std::size_t( num_items ) * sizeof( T ) ) ) {
+				out_item = { };
+				return;
+			}
+
+			out_item = array_view< T >( data_.data( ) + read_bytes_, num_items );
+			read_bytes_ += num_items * sizeof( T );
+		}
+
+		void deserialize( std::string_view& out_item );
+		void deserialize( bytes_view& out_item );
+		void deserialize( string_view_list& out_item );
+
+		// The packet's payload, for anyone who wants to parse it by hand
+		std::span< const std::uint8_t > get_data( ) const;
+		std::size_t get_remaining( ) const;
+
+		// False once we attempted to read more than the packet holds
+		bool is_good( ) const;
+
+		// Has to match what the packet was written with
+		void set_compact( bool compact );
+		bool is_compact( ) const;
 
 	private:
-		template < typename T, ARITHMETIC_TYPE_ONLY >
-		void write_to_buffer( T item ) {
-			serialized_buffer_.insert( 
-				serialized_buffer_.end( ), 
-				reinterpret_cast< std::uint8_t* >( &item ),
-				reinterpret_cast< std::uint8_t* >( &item ) + sizeof( T )
-			);
+		bool can_read( std::size_t length );
+
+		bool read_varint( std::uint64_t& value );
+
+		// Every element takes at least a byte, so a bogus count can't make us allocate
+		template < typename T >
+		void read_varints( std::vector< T >& out_item, std::uint32_t num_items ) {
+			if ( !can_read( num_items ) ) {
+				out_item.clear( );
+				return;
+			}
+
+			out_item.resize( num_items );
+
+			for ( std::uint32_t i = 0; i < num_items; ) {
+				auto in = data_.data( ) + read_bytes_;
+
+				// Runs of small values are the common case, 8 of them come out of a single load
+				if ( num_items - i >= 8 && get_remaining( ) >= 8 ) {
+					std::uint64_t word;
+					memcpy( &word, in, sizeof( word ) );
+
+					if ( !( word & 0x8080808080808080ull ) ) {
+						for ( std::size_t k = 0; k < 8; k++ )
+							from_varint( in[ k ], out_item[ i + k ] );
+
+						read_bytes_ += 8;
+						i += 8;
+						continue;
+					}
+				}
+
+				std::uint64_t value = 0;
+
+				if ( !read_varint( value ) || !from_varint( value, out_item[ i ] ) ) {
+					good_ = false;
+					out_item.clear( );
+					return;
+				}
+
+				i++;
+			}
 		}
 
 		template < typename T, ARITHMETIC_TYPE_ONLY >
 		T read_from_buffer( ) {
-			auto value = *reinterpret_cast< T* >( serialized_buffer_.data( ) + deserialized_bytes_ );
-			deserialized_bytes_ += sizeof( T );
-			
-			return value;
+			T value = { };
+
+			if constexpr ( is_varint< T > ) {
+				if ( compact_ ) {
+					std::uint64_t packed = 0;
+
+					if ( !read_varint( packed ) || !from_varint( packed, value ) ) {
+						good_ = false;
+						return { };
+					}
+
+					return value;
+				}
+			}
+
+			// The receive buffer doesn't care about alignment
+			if ( can_read( sizeof( T ) ) ) {
+				memcpy( &value, data_.data( ) + read_bytes_, sizeof( T ) );
+				read_bytes_ += sizeof( T );
+			}
+
+			return from_wire( value );
 		}
 
-		std::uint32_t deserialized_bytes_ = 0;
-		std::vector< std::uint8_t > serialized_buffer_ = { };
+		std::span< const std::uint8_t > data_ = { };
+		std::size_t read_bytes_ = 0;
+		bool good_ = true;
+		bool compact_ = false;
 	};
 }
\ No newline at end of file
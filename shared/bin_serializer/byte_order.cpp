@@ -0,0 +1,60 @@
+#include "byte_order.h"
+
+#ifdef __ARM_NEON
+#include <arm_neon.h>
+#endif // __ARM_NEON
+
+using namespace fi::packets::detail;
+
+template < typename T >
+static void swap_remaining( std::uint8_t* out, const std::uint8_t* in, std::size_t offset, std::size_t bytes ) {
+	// Simple enough for compilers to vectorize on their own
+	for ( ; offset < bytes; offset += sizeof( T ) ) {
+		T value;
+		memcpy( &value, in + offset, sizeof( T ) );
+
+		value = byteswap( value );
+		memcpy( out + offset, &value, sizeof( T ) );
+	}
+}
+
+void fi::packets::detail::swap_elements( void* dst, const void* src, std::size_t count, std::size_t size ) {
+	auto out = static_cast< std::uint8_t* >( dst );
+	auto in = static_cast< const std::uint8_t* >( src );
+
+	std::size_t bytes = count * size, offset = 0;
+
+#ifdef __ARM_NEON
+	// Reverses the bytes within every 2, 4 or 8 byte lane of a 16 byte register
+	switch ( size ) {
+		case 2:
+			for ( ; offset + 16 <= bytes; offset += 16 )
+				vst1q_u8( out + offset, vrev16q_u8( vld1q_u8( in + offset ) ) );
+			break;
+		case 4:
+			for ( ; offset + 16 <= bytes; offset += 16 )
+				vst1q_u8( out + offset, vrev32q_u8( vld1q_u8( in + offset ) ) );
+			break;
+		case 8:
+			for ( ; offset + 16 <= bytes; offset += 16 )
+				vst1q_u8( out + offset, vrev64q_u8( vld1q_u8( in + offset ) ) );
+			break;
+	}
+#endif // __ARM_NEON
+
+	switch ( size ) {
+		case 2:
+			swap_remaining< std::uint16_t >( out, in, offset, bytes );
+			break;
+		case 4:
+			swap_remaining< std::uint32_t >( out, in, offset, bytes );
+			break;
+		case 8:
+			swap_remaining< std::uint64_t >( out, in, offset, bytes );
+			break;
+		default:
+			if ( out != in && bytes )
+				memcpy( out, in, bytes );
+			break;
+	}
+}
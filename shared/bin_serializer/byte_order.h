@@ -0,0 +1,80 @@
+#pragma once
+#include <bit>
+#include <cstdint>
+#include <cstring>
+#include <cstddef>
+#include <type_traits>
+
+#ifdef _MSC_VER
+#include <stdlib.h>
+#endif // _MSC_VER
+
+// Everything goes over the wire little endian. Hosts that are little endian themselves
+// (x86, ARM and pretty much everything else we run on) copy values as they are, all of
+// this compiles down to plain copies for them. Big endian hosts swap on the way in and out.
+namespace fi::packets::detail {
+	constexpr bool native_wire_order = std::endian::native == std::endian::little;
+
+	template < typename T >
+	T byteswap( T value ) {
+		static_assert( std::is_arithmetic_v< T > && sizeof( T ) <= 8, "only arithmetic types up to 8 bytes go over the wire" );
+
+		if constexpr ( sizeof( T ) == 1 ) {
+			return value;
+		} else if constexpr ( sizeof( T ) == 2 ) {
+		#ifdef _MSC_VER
+			return std::bit_cast< T >( _byteswap_ushort( std::bit_cast< std::uint16_t >( value ) ) );
+		#else
+			return std::bit_cast< T >( __builtin_bswap16( std::bit_cast< std::uint16_t >( value ) ) );
+		#endif // _MSC_VER
+		} else if constexpr ( sizeof( T ) == 4 ) {
+		#ifdef _MSC_VER
+			return std::bit_cast< T >( _byteswap_ulong( std::bit_cast< std::uint32_t >( value ) ) );
+		#else
+			return std::bit_cast< T >( __builtin_bswap32( std::bit_cast< std::uint32_t >( value ) ) );
+		#endif // _MSC_VER
+		} else {
+		#ifdef _MSC_VER
+			return std::bit_cast< T >( _byteswap_uint64( std::bit_cast< std::uint64_t >( value ) ) );
+		#else
+			return std::bit_cast< T >( __builtin_bswap64( std::bit_cast< std::uint64_t >( value ) ) );
+		#endif // _MSC_VER
+		}
+	}
+
+	// Converting is the same either way, both names just say what the value is afterwards
+	template < typename T >
+	T to_wire( T value ) {
+		if constexpr ( native_wire_order )
+			return value;
+		else
+			return byteswap( value );
+	}
+
+	template < typename T >
+	T from_wire( T value ) {
+		return to_wire( value );
+	}
+
+	// Byte swaps count elements of size (2, 4 or 8) bytes from src into dst, which
+	// may be the same buffer. Goes 16 bytes at a time where we have NEON.
+	void swap_elements( void* dst, const void* src, std::size_t count, std::size_t size );
+
+	template < typename T >
+	void copy_to_wire( void* dst, const T* src, std::size_t count ) {
+		if constexpr ( native_wire_order || sizeof( T ) == 1 ) {
+			if ( count )
+				memcpy( dst, src, count * sizeof( T ) );
+		} else
+			swap_elements( dst, src, count, sizeof( T ) );
+	}
+
+	template < typename T >
+	void copy_from_wire( T* dst, const void* src, std::size_t count ) {
+		if constexpr ( native_wire_order || sizeof( T ) == 1 ) {
+			if ( count )
+				memcpy( dst, src, count * sizeof( T ) );
+		} else
+			swap_elements( dst, src, count, sizeof( T ) );
+	}
+} // namespace fi::packets::detail
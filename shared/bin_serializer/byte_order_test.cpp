@@ -0,0 +1,95 @@
+#include "byte_order.h"
+#include "../testing/check.h"
+
+#include <vector>
+
+using namespace fi::packets::detail;
+
+template < typename T >
+static std::vector< std::uint8_t > bytes_of( T value ) {
+	std::vector< std::uint8_t > bytes( sizeof( T ) );
+	memcpy( bytes.data( ), &value, sizeof( T ) );
+
+	return bytes;
+}
+
+static void swapping( ) {
+	FI_CHECK( byteswap( std::uint8_t( 0x12 ) ) == 0x12 );
+	FI_CHECK( byteswap( std::uint16_t( 0x1122 ) ) == 0x2211 );
+	FI_CHECK( byteswap( std::int16_t( 0x0180 ) ) == std::int16_t( 0x8001 ) );
+	FI_CHECK( byteswap( std::uint32_t( 0x11223344 ) ) == 0x44332211 );
+	FI_CHECK( byteswap( std::uint64_t( 0x1122334455667788 ) ) == 0x8877665544332211 );
+
+	FI_CHECK( byteswap( byteswap( 1.5f ) ) == 1.5f );
+	FI_CHECK( byteswap( byteswap( -2.25 ) ) == -2.25 );
+}
+
+// Whatever the host, the wire is little endian
+static void wire_order( ) {
+	FI_CHECK( bytes_of( to_wire( std::uint16_t( 0x1122 ) ) ) == std::vector< std::uint8_t >{ 0x22, 0x11 } );
+	FI_CHECK( bytes_of( to_wire( std::uint32_t( 0x11223344 ) ) ) == std::vector< std::uint8_t >{ 0x44, 0x33, 0x22, 0x11 } );
+	FI_CHECK( bytes_of( to_wire( std::uint64_t( 0x1122334455667788 ) ) ) == std::vector< std::uint8_t >{ 0x88, 0x77, 0x66, 0x55, 0x44, 0x33, 0x22, 0x11 } );
+
+	FI_CHECK( from_wire( to_wire( std::int32_t( -12345 ) ) ) == -12345 );
+	FI_CHECK( from_wire( to_wire( 3.75 ) ) == 3.75 );
+}
+
+template < typename T >
+static void swaps_elements( std::size_t count ) {
+	std::vector< T > values( count ), swapped( count );
+
+	for ( std::size_t i = 0; i < count; i++ )
+		values[ i ] = T( 0x0102030405060708ull * ( i + 1 ) );
+
+	swap_elements( swapped.data( ), values.data( ), count, sizeof( T ) );
+
+	bool matches = true;
+
+	for ( std::size_t i = 0; i < count; i++ )
+		matches &= swapped[ i ] == byteswap( values[ i ] );
+
+	FI_CHECK( matches );
+
+	// In place gets it back
+	swap_elements( swapped.data( ), swapped.data( ), count, sizeof( T ) );
+	FI_CHECK( swapped == values );
+}
+
+static void elements( ) {
+	// Full 16 byte blocks and a tail behind them
+	for ( std::size_t count : { 0, 1, 7, 8, 11, 33 } ) {
+		swaps_elements< std::uint16_t >( count );
+		swaps_elements< std::uint32_t >( count );
+		swaps_elements< std::uint64_t >( count );
+	}
+
+	// Single bytes are just copied
+	const std::uint8_t in[ ] = { 1, 2, 3 };
+	std::uint8_t out[ 3 ] = { };
+
+	swap_elements( out, in, 3, 1 );
+	FI_CHECK( out[ 0 ] == 1 && out[ 1 ] == 2 && out[ 2 ] == 3 );
+}
+
+static void copies( ) {
+	const std::int32_t values[ ] = { 1, -2, 0x11223344, -0x7fffffff };
+
+	std::uint8_t wire[ sizeof( values ) ] = { };
+	copy_to_wire( wire, values, 4 );
+
+	FI_CHECK( wire[ 8 ] == 0x44 && wire[ 11 ] == 0x11 );
+
+	std::int32_t back[ 4 ] = { };
+	copy_from_wire( back, wire, 4 );
+
+	FI_CHECK( back[ 0 ] == 1 && back[ 1 ] == -2 && back[ 2 ] == 0x11223344 && back[ 3 ] == -0x7fffffff );
+}
+
+int main( ) {
+	swapping( );
+	wire_order( );
+	elements( );
+	copies( );
+
+	return fi::testing::result( );
+}
@@ -0,0 +1,258 @@
+#pragma once
+#include "byte_order.h"
+#include "varint.h"
+
+#include <cstdint>
+#include <cstring>
+#include <cstddef>
+#include <vector>
+#include <string>
+#include <string_view>
+#include <span>
+#include <iterator>
+#include <type_traits>
+
+// Packet members that point into the receive buffer instead of copying out of it.
+// Decoding them never allocates, but they're only valid until the handler (or callback)
+// returns, or a coroutine that received them awaits again. Anything you want to keep
+// has to go through to_owned( ). On the wire they're the same as their owning
+// counterparts, so either side may use either.
+namespace fi {
+	// Same as std::vector< std::uint8_t >
+	class bytes_view {
+	public:
+		bytes_view( ) { }
+		bytes_view( std::span< const std::uint8_t > data ) : data_( data ) { }
+
+		const std::uint8_t* data( ) const {
+			return data_.data( );
+		}
+
+		std::size_t size( ) const {
+			return data_.size( );
+		}
+
+		bool empty( ) const {
+			return data_.empty( );
+		}
+
+		std::uint8_t operator[]( std::size_t index ) const {
+			return data_[ index ];
+		}
+
+		auto begin( ) const {
+			return data_.begin( );
+		}
+
+		auto end( ) const {
+			return data_.end( );
+		}
+
+		operator std::span< const std::uint8_t >( ) const {
+			return data_;
+		}
+
+		std::vector< std::uint8_t > to_owned( ) const {
+			return { data_.begin( ), data_.end( ) };
+		}
+
+	private:
+		std::span< const std::uint8_t > data_ = { };
+	};
+
+	// Same as std::vector< T >. Elements are read rather than referenced, the
+	// receive buffer doesn't care about their alignment (or our byte order).
+	// Compact packets pack their integers, only bytes and floats can be borrowed there.
+	template < typename T >
+	class array_view {
+		static_assert( std::is_arithmetic_v< T >, "array_view only holds arithmetic types" );
+
+	public:
+		class iterator {
+		public:
+			using iterator_category = std::input_iterator_tag;
+			using value_type = T;
+			using difference_type = std::ptrdiff_t;
+			using pointer = void;
+			using reference = T;
+
+			iterator( ) { }
+			iterator( const std::uint8_t* at ) : at_( at ) { }
+
+			T operator*( ) const {
+				T value;
+				memcpy( &value, at_, sizeof( T ) );
+
+				return packets::detail::from_wire( value );
+			}
+
+			iterator& operator++( ) {
+				at_ += sizeof( T );
+				return *this;
+			}
+
+			iterator operator++( int ) {
+				auto previous = *this;
+				at_ += sizeof( T );
+
+				return previous;
+			}
+
+			bool operator==( const iterator& other ) const = default;
+
+		private:
+			const std::uint8_t* at_ = nullptr;
+		};
+
+		array_view( ) { }
+		array_view( const std::uint8_t* data, std::size_t count ) : data_( data ), count_( count ) { }
+
+		std::size_t size( ) const {
+			return count_;
+		}
+
+		bool empty( ) const {
+			return count_ == 0;
+		}
+
+		T operator[]( std::size_t index ) const {
+			return *iterator( data_ + index * sizeof( T ) );
+		}
+
+		iterator begin( ) const {
+			return iterator( data_ );
+		}
+
+		iterator end( ) const {
+			return iterator( data_ + count_ * sizeof( T ) );
+		}
+
+		// The elements as they are on the wire, little endian
+		std::span< const std::uint8_t > bytes( ) const {
+			return { data_, count_ * sizeof( T ) };
+		}
+
+		std::vector< T > to_owned( ) const {
+			std::vector< T > out( count_ );
+
+			packets::detail::copy_from_wire( out.data( ), data_, count_ );
+
+			return out;
+		}
+
+	private:
+		const std::uint8_t* data_ = nullptr;
+		std::size_t count_ = 0;
+	};
+
+	// Same as std::vector< std::string >. The strings are walked as you iterate,
+	// so there's no random access. Their length prefixes are varints if the list
+	// came out of a compact packet.
+	class string_view_list {
+	public:
+		class iterator {
+		public:
+			using iterator_category = std::input_iterator_tag;
+			using value_type = std::string_view;
+			using difference_type = std::ptrdiff_t;
+			using pointer = void;
+			using reference = std::string_view;
+
+			iterator( ) { }
+			iterator( const std::uint8_t* at, const std::uint8_t* end, bool compact ) : at_( at ), end_( end ), compact_( compact ) { }
+
+			std::string_view operator*( ) const {
+				std::size_t prefix = 0;
+				auto string_length = length( prefix );
+
+				return { reinterpret_cast< const char* >( at_ + prefix ), string_length };
+			}
+
+			iterator& operator++( ) {
+				std::size_t prefix = 0;
+				auto string_length = length( prefix );
+
+				at_ += prefix + string_length;
+				return *this;
+			}
+
+			iterator operator++( int ) {
+				auto previous = *this;
+				++*this;
+
+				return previous;
+			}
+
+			bool operator==( const iterator& other ) const {
+				return at_ == other.at_;
+			}
+
+		private:
+			// The reader made sure every prefix is good before handing out the list
+			std::size_t length( std::size_t& prefix ) const {
+				if ( compact_ ) {
+					std::uint64_t length = 0;
+					prefix = packets::detail::decode_varint( at_, std::size_t( end_ - at_ ), length );
+
+					return std::size_t( length );
+				}
+
+				std::uint32_t length = 0;
+				memcpy( &length, at_, sizeof( length ) );
+
+				prefix = sizeof( length );
+				return packets::detail::from_wire( length );
+			}
+
+			const std::uint8_t* at_ = nullptr;
+			const std::uint8_t* end_ = nullptr;
+			bool compact_ = false;
+		};
+
+		string_view_list( ) { }
+
+		// data holds count strings, each one prefixed with its length
+		string_view_list( std::span< const std::uint8_t > data, std::size_t count, bool compact = false ) : data_( data ), count_( count ), compact_( compact ) { }
+
+		std::size_t size( ) const {
+			return count_;
+		}
+
+		bool empty( ) const {
+			return count_ == 0;
+		}
+
+		iterator begin( ) const {
+			return iterator( data_.data( ), data_.data( ) + data_.size( ), compact_ );
+		}
+
+		iterator end( ) const {
+			return iterator( data_.data( ) + data_.size( ), data_.data( ) + data_.size( ), compact_ );
+		}
+
+		// The strings as they are on the wire, without the count
+		std::span< const std::uint8_t > bytes( ) const {
+			return data_;
+		}
+
+		// Whether bytes( ) has varint length prefixes
+		bool is_compact( ) const {
+			return compact_;
+		}
+
+		std::vector< std::string > to_owned( ) const {
+			std::vector< std::string > out = { };
+			out.reserve( count_ );
+
+			for ( auto s : *this )
+				out.emplace_back( s );
+
+			return out;
+		}
+
+	private:
+		std::span< const std::uint8_t > data_ = { };
+		std::size_t count_ = 0;
+		bool compact_ = false;
+	};
+} // namespace fi
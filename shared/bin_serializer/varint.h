@@ -0,0 +1,114 @@
+#pragma once
+#include <bit>
+#include <limits>
+#include <cstdint>
+#include <cstring>
+#include <cstddef>
+#include <type_traits>
+
+#include "byte_order.h"
+
+// LEB128 varints for packets using the compact encoding: 7 bits per byte, lowest
+// first, the top bit set on every byte but the last. Signed values are zigzagged
+// first, so small negative numbers stay short too.
+namespace fi::packets::detail {
+	constexpr std::size_t max_varint_size = 10;
+
+	// Integers wider than a byte, anything else is written as is in compact packets too
+	template < typename T >
+	constexpr bool is_varint = std::is_integral_v< T > && sizeof( T ) > 1;
+
+	// 0, -1, 1, -2, ... become 0, 1, 2, 3, ...
+	inline std::uint64_t zigzag_encode( std::int64_t value ) {
+		return ( std::uint64_t( value ) << 1 ) ^ std::uint64_t( value >> 63 );
+	}
+
+	inline std::int64_t zigzag_decode( std::uint64_t value ) {
+		return std::int64_t( ( value >> 1 ) ^ ( ~( value & 1 ) + 1 ) );
+	}
+
+	template < typename T >
+	std::uint64_t to_varint( T value ) {
+		if constexpr ( std::is_signed_v< T > )
+			return zigzag_encode( value );
+		else
+			return value;
+	}
+
+	// False if value doesn't fit into a T
+	template < typename T >
+	bool from_varint( std::uint64_t value, T& out ) {
+		if constexpr ( std::is_signed_v< T > ) {
+			auto decoded = zigzag_decode( value );
+
+			if ( decoded < std::numeric_limits< T >::min( ) || decoded > std::numeric_limits< T >::max( ) )
+				return false;
+
+			out = T( decoded );
+		} else {
+			if ( value > std::numeric_limits< T >::max( ) )
+				return false;
+
+			out = T( value );
+		}
+
+		return true;
+	}
+
+	inline std::size_t varint_size( std::uint64_t value ) {
+		return ( std::size_t( std::bit_width( value | 1 ) ) + 6 ) / 7;
+	}
+
+	// out needs room for varint_size( value ) bytes, returns how many were written
+	inline std::size_t encode_varint( std::uint8_t* out, std::uint64_t value ) {
+		std::size_t length = 0;
+
+		while ( value >= 0x80 ) {
+			out[ length++ ] = std::uint8_t( value | 0x80 );
+			value >>= 7;
+		}
+
+		out[ length++ ] = std::uint8_t( value );
+
+		return length;
+	}
+
+	// Bytes the varint at in took, 0 if it's cut off or longer than 64 bits
+	inline std::size_t decode_varint( const std::uint8_t* in, std::size_t available, std::uint64_t& value ) {
+		// Anything up to 56 bits ends within the next 8 bytes: find the last byte in a single
+		// load and squeeze the 7 bit groups together without looping over them
+		if ( available >= 8 ) {
+			std::uint64_t word;
+			memcpy( &word, in, sizeof( word ) );
+			word = from_wire( word );
+
+			auto ends = ~word & 0x8080808080808080ull;
+
+			if ( ends ) {
+				word &= ( ends ^ ( ends - 1 ) ) & 0x7f7f7f7f7f7f7f7full;
+
+				word = ( word & 0x007f007f007f007full ) | ( ( word & 0x7f007f007f007f00ull ) >> 1 );
+				word = ( word & 0x00003fff00003fffull ) | ( ( word & 0x3fff00003fff0000ull ) >> 2 );
+				word = ( word & 0x000000000fffffffull ) | ( ( word & 0x0fffffff00000000ull ) >> 4 );
+
+				value = word;
+				return std::size_t( std::countr_zero( ends ) + 1 ) / 8;
+			}
+		}
+
+		value = 0;
+
+		for ( std::size_t i = 0; i < max_varint_size && i < available; i++ ) {
+			// The tenth byte only has room for the top bit
+			if ( i == max_varint_size - 1 && in[ i ] > 1 )
+				return 0;
+
+			value |= std::uint64_t( in[ i ] & 0x7f ) << ( 7 * i );
+
+			if ( !( in[ i ] & 0x80 ) )
+				return i + 1;
+		}
+
+		return 0;
+	}
+} // namespace fi::packets::detail
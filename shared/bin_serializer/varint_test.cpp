@@ -0,0 +1,93 @@
+#include "varint.h"
+#include "../testing/check.h"
+
+#include <vector>
+
+using namespace fi::packets::detail;
+
+static void zigzag( ) {
+	FI_CHECK( zigzag_encode( 0 ) == 0 );
+	FI_CHECK( zigzag_encode( -1 ) == 1 );
+	FI_CHECK( zigzag_encode( 1 ) == 2 );
+	FI_CHECK( zigzag_encode( -2 ) == 3 );
+	FI_CHECK( zigzag_encode( std::numeric_limits< std::int64_t >::max( ) ) == ~0ull - 1 );
+	FI_CHECK( zigzag_encode( std::numeric_limits< std::int64_t >::min( ) ) == ~0ull );
+
+	for ( std::int64_t value : { std::int64_t( 0 ), std::int64_t( -1 ), std::int64_t( 63 ), std::int64_t( -64 ), std::int64_t( 1 ) << 40,
+		std::numeric_limits< std::int64_t >::max( ), std::numeric_limits< std::int64_t >::min( ) } )
+		FI_CHECK( zigzag_decode( zigzag_encode( value ) ) == value );
+}
+
+static void ranges( ) {
+	std::int16_t narrow = 0;
+
+	FI_CHECK( from_varint( to_varint( std::int16_t( -32768 ) ), narrow ) && narrow == -32768 );
+	FI_CHECK( !from_varint( to_varint( std::int32_t( 40000 ) ), narrow ) );
+	FI_CHECK( !from_varint( to_varint( std::int32_t( -40000 ) ), narrow ) );
+
+	std::uint16_t unsigned_narrow = 0;
+
+	FI_CHECK( from_varint( 65535, unsigned_narrow ) && unsigned_narrow == 65535 );
+	FI_CHECK( !from_varint( 65536, unsigned_narrow ) );
+}
+
+// Decodes value out of a buffer with room to spare (a single load) and one that ends
+// right behind it (byte by byte), both have to agree with the encoder
+static void round_trips( ) {
+	const std::uint64_t values[ ] = {
+		0, 1, 127, 128, 300, 16383, 16384, ( 1ull << 21 ) - 1, 1ull << 21, ( 1ull << 49 ) - 1,
+		( 1ull << 56 ) - 1, 1ull << 56, ( 1ull << 63 ) - 1, 1ull << 63, ~0ull
+	};
+
+	for ( auto value : values ) {
+		std::uint8_t encoded[ max_varint_size + 8 ] = { };
+
+		auto length = encode_varint( encoded, value );
+
+		FI_CHECK( length == varint_size( value ) );
+		FI_CHECK( length >= 1 && length <= max_varint_size );
+
+		// Garbage behind it mustn't matter
+		for ( std::size_t i = length; i < sizeof( encoded ); i++ )
+			encoded[ i ] = 0xff;
+
+		std::uint64_t decoded = 0;
+
+		FI_CHECK( decode_varint( encoded, sizeof( encoded ), decoded ) == length && decoded == value );
+
+		std::vector< std::uint8_t > exact( encoded, encoded + length );
+		decoded = 0;
+
+		FI_CHECK( decode_varint( exact.data( ), exact.size( ), decoded ) == length && decoded == value );
+	}
+}
+
+static void malformed( ) {
+	std::uint64_t value = 0;
+
+	// Cut off in the middle
+	const std::uint8_t cut[ ] = { 0x80, 0x80, 0x80 };
+	FI_CHECK( decode_varint( cut, sizeof( cut ), value ) == 0 );
+
+	// Nothing ends within 8 bytes and the buffer runs out
+	const std::uint8_t long_cut[ ] = { 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80 };
+	FI_CHECK( decode_varint( long_cut, sizeof( long_cut ), value ) == 0 );
+
+	// More than 64 bits
+	const std::uint8_t too_big[ ] = { 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0x02 };
+	FI_CHECK( decode_varint( too_big, sizeof( too_big ), value ) == 0 );
+
+	const std::uint8_t too_long[ ] = { 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x00 };
+	FI_CHECK( decode_varint( too_long, sizeof( too_long ), value ) == 0 );
+
+	FI_CHECK( decode_varint( cut, 0, value ) == 0 );
+}
+
+int main( ) {
+	zigzag( );
+	ranges( );
+	round_trips( );
+	malformed( );
+
+	return fi::testing::result( );
+}
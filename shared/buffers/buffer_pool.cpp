@@ -0,0 +1,155 @@
+#include "buffer_pool.h"
+
+#include <new>
+#include <bit>
+#include <algorithm>
+
+using namespace fi::detail;
+
+// Destroys the pool of a thread once the thread exits
+struct buffer_pool::thread_owner {
+	buffer_pool* pool = nullptr;
+
+	~thread_owner( ) {
+		if ( pool )
+			std::exchange( pool, nullptr )->orphan( );
+	}
+};
+
+thread_local buffer_pool::thread_owner buffer_pool::local_ = { };
+
+static std::size_t capacity_of( std::uint32_t size_class ) {
+	return buffer_pool::min_pooled_size << size_class;
+}
+
+static std::size_t max_free_blocks( std::uint32_t size_class ) {
+	return std::max< std::size_t >( 4, buffer_pool::max_free_bytes / capacity_of( size_class ) );
+}
+
+static buffer_block* new_block( std::size_t capacity ) {
+	return new ( ::operator new( sizeof( buffer_block ) + capacity ) ) buffer_block( );
+}
+
+static void delete_block( buffer_block* block ) {
+	block->~buffer_block( );
+	::operator delete( block );
+}
+
+buffer_block* buffer_pool::take( std::size_t size ) {
+	// Too big to be worth keeping around
+	if ( size > max_pooled_size ) {
+		auto block = new_block( size );
+		block->size = std::uint32_t( size );
+		block->size_class = unpooled;
+
+		return block;
+	}
+
+	if ( !local_.pool )
+		local_.pool = new buffer_pool( );
+
+	auto& pool = *local_.pool;
+	auto size_class = std::uint32_t( std::bit_width( ( std::max( size, min_pooled_size ) - 1 ) / min_pooled_size ) );
+
+	auto& free = pool.free_[ size_class ];
+
+	if ( free.empty( ) )
+		pool.collect( );
+
+	buffer_block* block = nullptr;
+
+	if ( !free.empty( ) ) {
+		block = free.back( );
+		free.pop_back( );
+
+		block->references.store( 1, std::memory_order_relaxed );
+	} else {
+		block = new_block( capacity_of( size_class ) );
+		block->size_class = size_class;
+		block->pool = &pool;
+	}
+
+	block->size = std::uint32_t( size );
+	pool.outstanding_.fetch_add( 1, std::memory_order_relaxed );
+
+	return block;
+}
+
+void buffer_pool::give_back( buffer_block* block ) {
+	if ( !block->pool ) {
+		delete_block( block );
+		return;
+	}
+
+	auto& pool = *block->pool;
+
+	// Back where it came from, nobody else can be looking at our free lists
+	if ( &pool == local_.pool ) {
+		pool.put( block );
+		pool.outstanding_.fetch_sub( 1, std::memory_order_relaxed );
+		return;
+	}
+
+	bool destroy = false;
+
+	{
+		std::lock_guard guard( pool.mtx_ );
+
+		if ( pool.orphaned_ )
+			delete_block( block );
+		else
+			pool.returned_[ block->size_class ].push_back( block );
+
+		destroy = pool.outstanding_.fetch_sub( 1, std::memory_order_relaxed ) == 1 && pool.orphaned_;
+	}
+
+	if ( destroy )
+		delete &pool;
+}
+
+void buffer_pool::put( buffer_block* block ) {
+	auto& free = free_[ block->size_class ];
+
+	if ( free.size( ) < max_free_blocks( block->size_class ) )
+		free.push_back( block );
+	else
+		delete_block( block );
+}
+
+void buffer_pool::collect( ) {
+	std::lock_guard guard( mtx_ );
+
+	for ( std::uint32_t i = 0; i < num_size_classes; i++ ) {
+		for ( auto block : returned_[ i ] )
+			put( block );
+
+		// Keeps its capacity, the next ones come back without allocating
+		returned_[ i ].clear( );
+	}
+}
+
+void buffer_pool::orphan( ) {
+	bool destroy = false;
+
+	{
+		std::lock_guard guard( mtx_ );
+
+		orphaned_ = true;
+
+		for ( std::uint32_t i = 0; i < num_size_classes; i++ ) {
+			for ( auto block : free_[ i ] )
+				delete_block( block );
+
+			for ( auto block : returned_[ i ] )
+				delete_block( block );
+
+			free_[ i ].clear( );
+			returned_[ i ].clear( );
+		}
+
+		destroy = outstanding_.load( std::memory_order_relaxed ) == 0;
+	}
+
+	if ( destroy )
+		delete this;
+}
@@ -0,0 +1,132 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <atomic>
+#include <utility>
+#include <vector>
+#include <mutex>
+
+namespace fi::detail {
+	class buffer_pool;
+
+	// Header of a pooled buffer, the bytes follow right behind it
+	struct buffer_block {
+		std::atomic_uint32_t references = 1;
+		std::uint32_t size = 0;
+
+		// Index of the pool's free list we go back to, unpooled blocks are freed instead
+		std::uint32_t size_class = 0;
+		buffer_pool* pool = nullptr;
+
+		std::uint8_t* bytes( ) {
+			return reinterpret_cast< std::uint8_t* >( this + 1 );
+		}
+	};
+
+	// Recycles send buffers, so building a packet doesn't have to allocate once the
+	// pool got warm. Every thread takes buffers out of its own pool, they go back to
+	// it once the last reference is gone, whichever thread that happens on (usually
+	// the loop thread that sent them). Buffers of threads that exited are freed.
+	class buffer_pool {
+	public:
+		// Sizes are rounded up to a power of two, bigger buffers aren't pooled
+		static constexpr std::size_t min_pooled_size = 64;
+		static constexpr std::size_t max_pooled_size = 64 * 1024;
+		static constexpr std::uint32_t num_size_classes = 11;
+		static constexpr std::uint32_t unpooled = num_size_classes;
+
+		// Free buffers kept around per size class, anything beyond goes back to the heap
+		static constexpr std::size_t max_free_bytes = 1024 * 1024;
+
+		// A buffer for at least size bytes out of the calling thread's pool, with one reference
+		static buffer_block* take( std::size_t size );
+
+		// Drops the last reference
+		static void give_back( buffer_block* block );
+
+	private:
+		struct thread_owner;
+		static thread_local thread_owner local_;
+
+		buffer_pool( ) { }
+
+		void put( buffer_block* block );
+
+		// Moves whatever other threads gave back over to our free lists
+		void collect( );
+
+		// Our thread exited, we go away once the last of our buffers is back
+		void orphan( );
+
+		// Only touched by the thread owning us
+		std::vector< buffer_block* > free_[ num_size_classes ] = { };
+
+		std::mutex mtx_ = { };
+		std::vector< buffer_block* > returned_[ num_size_classes ] = { };
+		bool orphaned_ = false;
+
+		// Buffers out there somewhere. Other threads only take it down under mtx_.
+		std::atomic_size_t outstanding_ = 0;
+	};
+
+	// A fully built packet. It never changes once built, so the same
+	// buffer can be queued for any number of connections.
+	class shared_buffer {
+	public:
+		shared_buffer( ) { }
+
+		shared_buffer( const shared_buffer& other ) : block_( other.block_ ) {
+			if ( block_ )
+				block_->references.fetch_add( 1, std::memory_order_relaxed );
+		}
+
+		shared_buffer( shared_buffer&& other ) noexcept : block_( std::exchange( other.block_, nullptr ) ) { }
+
+		shared_buffer& operator=( shared_buffer other ) noexcept {
+			std::swap( block_, other.block_ );
+			return *this;
+		}
+
+		~shared_buffer( ) {
+			release( );
+		}
+
+		// A buffer of exactly size bytes. Write the packet into it before handing out any copies.
+		static shared_buffer allocate( std::size_t size ) {
+			return shared_buffer( buffer_pool::take( size ) );
+		}
+
+		std::uint8_t* data( ) const {
+			return block_ ? block_->bytes( ) : nullptr;
+		}
+
+		std::size_t size( ) const {
+			return block_ ? block_->size : 0;
+		}
+
+		bool empty( ) const {
+			return size( ) == 0;
+		}
+
+		explicit operator bool( ) const {
+			return block_ != nullptr;
+		}
+
+		void reset( ) {
+			release( );
+			block_ = nullptr;
+		}
+
+	private:
+		explicit shared_buffer( buffer_block* block ) : block_( block ) { }
+
+		void release( ) {
+			// Whoever drops the last reference has to see every write the others made
+			if ( block_ && block_->references.fetch_sub( 1, std::memory_order_acq_rel ) == 1 )
+				buffer_pool::give_back( block_ );
+		}
+
+		buffer_block* block_ = nullptr;
+	};
+} // namespace fi::detail
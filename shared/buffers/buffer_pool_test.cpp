@@ -0,0 +1,130 @@
+#include "buffer_pool.h"
+#include "../testing/check.h"
+
+#include <thread>
+#include <algorithm>
+#include <vector>
+
+using namespace fi::detail;
+
+static bool in_class( std::size_t size, std::uint32_t size_class ) {
+	auto block = buffer_pool::take( size );
+	bool matches = block->size == size && block->size_class == size_class;
+
+	buffer_pool::give_back( block );
+
+	return matches;
+}
+
+static void size_classes( ) {
+	FI_CHECK( in_class( 0, 0 ) );
+	FI_CHECK( in_class( 1, 0 ) );
+	FI_CHECK( in_class( 64, 0 ) );
+	FI_CHECK( in_class( 65, 1 ) );
+	FI_CHECK( in_class( 128, 1 ) );
+	FI_CHECK( in_class( 129, 2 ) );
+	FI_CHECK( in_class( 1000, 4 ) );
+	FI_CHECK( in_class( 32 * 1024 + 1, 10 ) );
+	FI_CHECK( in_class( buffer_pool::max_pooled_size, buffer_pool::num_size_classes - 1 ) );
+
+	// Too big, comes straight from the heap and goes right back
+	auto big = buffer_pool::take( buffer_pool::max_pooled_size + 1 );
+	FI_CHECK( big->size_class == buffer_pool::unpooled && !big->pool );
+
+	buffer_pool::give_back( big );
+}
+
+static void reused( ) {
+	auto first = shared_buffer::allocate( 100 );
+	auto block = first.data( );
+
+	first.reset( );
+
+	// Same size class, same buffer. Sizes are always exact.
+	auto second = shared_buffer::allocate( 120 );
+	FI_CHECK( second.data( ) == block && second.size( ) == 120 );
+
+	auto other = shared_buffer::allocate( 300 );
+	FI_CHECK( other.data( ) != block );
+
+	// Copies share it, it only goes back with the last of them
+	auto copy = second;
+	second.reset( );
+
+	auto third = shared_buffer::allocate( 100 );
+	FI_CHECK( third.data( ) != block && copy.data( ) == block );
+}
+
+// Buffers usually die on the loop thread that sent them, they come back to our
+// pool through the locked list and get picked up once ours runs dry
+static void returned_by_others( ) {
+	auto data = shared_buffer::allocate( 5000 );
+	auto block = data.data( );
+
+	std::thread other( [ copy = data ]( ) mutable { copy.reset( ); } );
+	data.reset( );
+	other.join( );
+
+	auto again = shared_buffer::allocate( 5000 );
+	FI_CHECK( again.data( ) == block );
+
+	// Same once a lot of them crossed over at once
+	std::vector< shared_buffer > many = { };
+	std::vector< std::uint8_t* > blocks = { };
+
+	for ( int i = 0; i < 50; i++ ) {
+		many.push_back( shared_buffer::allocate( 2000 ) );
+		blocks.push_back( many.back( ).data( ) );
+	}
+
+	std::thread( [ gone = std::move( many ) ]( ) { } ).join( );
+	many.clear( );
+
+	// All of them, none come from the heap
+	std::size_t found = 0;
+
+	for ( int i = 0; i < 50; i++ ) {
+		many.push_back( shared_buffer::allocate( 2000 ) );
+		found += std::find( blocks.begin( ), blocks.end( ), many.back( ).data( ) ) != blocks.end( );
+	}
+
+	FI_CHECK( found == 50 );
+}
+
+// A thread's pool has to stay around until the last of its buffers is back
+static void outlives_thread( ) {
+	shared_buffer kept = { };
+
+	std::thread( [ & ]( ) {
+		// Some go back into its free lists before it exits, they're freed with it
+		for ( int i = 0; i < 10; i++ )
+			shared_buffer::allocate( 64 << ( i % 5 ) );
+
+		kept = shared_buffer::allocate( 256 );
+
+		for ( std::size_t i = 0; i < kept.size( ); i++ )
+			kept.data( )[ i ] = std::uint8_t( i );
+	} ).join( );
+
+	bool intact = true;
+
+	for ( std::size_t i = 0; i < kept.size( ); i++ )
+		intact &= kept.data( )[ i ] == std::uint8_t( i );
+
+	FI_CHECK( intact && kept.size( ) == 256 );
+
+	// Last one back, takes the pool with it (sanitizers would catch it otherwise)
+	kept.reset( );
+
+	// A thread exiting without anything outstanding goes right away
+	std::thread( [ ]( ) { shared_buffer::allocate( 10 ); } ).join( );
+}
+
+int main( ) {
+	size_classes( );
+	reused( );
+	returned_by_others( );
+	outlives_thread( );
+
+	return fi::testing::result( );
+}
@@ -0,0 +1,132 @@
+#include "ring_buffer.h"
+
+#include <algorithm>
+
+using namespace fi::detail;
+
+std::size_t ring_buffer::writable( segment( &out )[ 2 ], std::uint32_t min_free ) {
+	// Start over at the beginning when we run empty, keeps packets from wrapping.
+	// Done on the writing side, the reading side never touches tail_.
+	if ( head_ == tail_ )
+		head_ = tail_ = 0;
+
+	if ( storage_.size( ) - size( ) < min_free )
+		grow( size( ) + min_free );
+
+	auto free = std::uint32_t( storage_.size( ) ) - size( );
+	auto start = tail_ & mask( );
+	auto first = std::min< std::uint32_t >( free, std::uint32_t( storage_.size( ) ) - start );
+
+	out[ 0 ] = { storage_.data( ) + start, first };
+	out[ 1 ] = { storage_.data( ), free - first };
+
+	return out[ 1 ].length ? 2 : 1;
+}
+
+void ring_buffer::commit( std::uint32_t length ) {
+	tail_ += length;
+}
+
+void ring_buffer::append( const void* data, std::uint32_t length ) {
+	segment segments[ 2 ] = { };
+	writable( segments, length );
+
+	auto bytes = reinterpret_cast< const std::uint8_t* >( data );
+	auto first = std::min( length, segments[ 0 ].length );
+
+	memcpy( segments[ 0 ].data, bytes, first );
+	memcpy( segments[ 1 ].data, bytes + first, length - first );
+
+	commit( length );
+}
+
+int ring_buffer::receive( SOCKET from, std::uint32_t min_free ) {
+	segment segments[ 2 ] = { };
+	auto count = writable( segments, min_free );
+
+	int received = receive_into( from, segments, count );
+
+	if ( received > 0 )
+		commit( received );
+
+	return received;
+}
+
+void ring_buffer::peek( void* out, std::uint32_t length ) const {
+	auto start = head_ & mask( );
+	auto first = std::min< std::uint32_t >( length, std::uint32_t( storage_.size( ) ) - start );
+
+	memcpy( out, storage_.data( ) + start, first );
+	memcpy( reinterpret_cast< std::uint8_t* >( out ) + first, storage_.data( ), length - first );
+}
+
+std::uint8_t* ring_buffer::contiguous( std::uint32_t length ) {
+	auto start = head_ & mask( );
+
+	if ( start + length <= storage_.size( ) )
+		return storage_.data( ) + start;
+
+	if ( scratch_.size( ) < length )
+		scratch_.resize( length );
+
+	peek( scratch_.data( ), length );
+	return scratch_.data( );
+}
+
+void ring_buffer::consume( std::uint32_t length ) {
+	head_ += length;
+}
+
+std::uint32_t ring_buffer::size( ) const {
+	return tail_ - head_;
+}
+
+void ring_buffer::clear( ) {
+	head_ = tail_ = 0;
+}
+
+int ring_buffer::receive_into( SOCKET from, const segment* segments, std::size_t count ) {
+#ifdef _WIN32
+	WSABUF buffers[ 2 ] = { };
+
+	for ( std::size_t i = 0; i < count; i++ ) {
+		buffers[ i ].buf = reinterpret_cast< char* >( segments[ i ].data );
+		buffers[ i ].len = segments[ i ].length;
+	}
+
+	DWORD received = 0, flags = 0;
+
+	if ( WSARecv( from, buffers, DWORD( count ), &received, &flags, nullptr, nullptr ) == SOCKET_ERROR )
+		return SOCKET_ERROR;
+
+	return int( received );
+#else
+	iovec buffers[ 2 ] = { };
+
+	for ( std::size_t i = 0; i < count; i++ ) {
+		buffers[ i ].iov_base = segments[ i ].data;
+		buffers[ i ].iov_len = segments[ i ].length;
+	}
+
+	return int( readv( from, buffers, int( count ) ) );
+#endif // _WIN32
+}
+
+void ring_buffer::grow( std::uint32_t min_capacity ) {
+	std::uint32_t capacity = std::max< std::uint32_t >( 64, std::uint32_t( storage_.size( ) ) );
+
+	while ( capacity < min_capacity )
+		capacity *= 2;
+
+	// Unwrap our data while moving it over
+	std::vector< std::uint8_t > storage( capacity );
+	auto length = size( );
+
+	if ( length )
+		peek( storage.data( ), length );
+
+	storage_.swap( storage );
+
+	head_ = 0;
+	tail_ = length;
+}
@@ -0,0 +1,66 @@
+#pragma once
+#include "../platform/platform.h"
+
+#include <cstdint>
+#include <vector>
+
+namespace fi::detail {
+	// Circular receive buffer. Sockets read straight into it and packets are consumed
+	// in place, so pulling a packet out of the front never moves the rest of the data.
+	// Only the writing side ever reallocates, which lets one thread write into the free
+	// space while another one reads from the front (as long as they agree on a lock
+	// around writable/commit and the reading calls).
+	class ring_buffer {
+	public:
+		struct segment {
+			std::uint8_t* data = nullptr;
+			std::uint32_t length = 0;
+		};
+
+		ring_buffer( ) { }
+
+		ring_buffer( const ring_buffer& ) = delete;
+		ring_buffer& operator=( const ring_buffer& ) = delete;
+
+		// Makes room for at least min_free bytes and returns where to write them.
+		// The free space wraps around the end of the ring, so it may be split in two.
+		std::size_t writable( segment( &out )[ 2 ], std::uint32_t min_free );
+
+		// Marks bytes written into the writable segments as received
+		void commit( std::uint32_t length );
+
+		// Copies data in, for when the kernel already put it somewhere else (io_uring)
+		void append( const void* data, std::uint32_t length );
+
+		// Reads from the socket straight into the ring. Returns whatever recv would.
+		int receive( SOCKET from, std::uint32_t min_free );
+
+		// Copies the first bytes out without consuming them
+		void peek( void* out, std::uint32_t length ) const;
+
+		// Returns the first bytes in one piece. Data wrapping around the end of the ring
+		// gets copied into a scratch buffer, the pointer is valid until the next call.
+		std::uint8_t* contiguous( std::uint32_t length );
+
+		void consume( std::uint32_t length );
+
+		std::uint32_t size( ) const;
+		void clear( );
+
+		// Reads into a set of segments with a single syscall
+		static int receive_into( SOCKET from, const segment* segments, std::size_t count );
+
+	private:
+		void grow( std::uint32_t min_capacity );
+
+		std::uint32_t mask( ) const {
+			return std::uint32_t( storage_.size( ) ) - 1;
+		}
+
+		// Always a power of two, so positions can be masked instead of wrapped
+		std::vector< std::uint8_t > storage_ = { }, scratch_ = { };
+
+		// These only ever count up, their difference is the amount of data we hold
+		std::uint32_t head_ = 0, tail_ = 0;
+	};
+} // namespace fi::detail
@@ -0,0 +1,100 @@
+#include "ring_buffer.h"
+#include "../testing/check.h"
+
+#include <vector>
+
+using namespace fi::detail;
+
+static std::vector< std::uint8_t > sequence( std::uint8_t first, std::size_t length ) {
+	std::vector< std::uint8_t > data( length );
+
+	for ( std::size_t i = 0; i < length; i++ )
+		data[ i ] = std::uint8_t( first + i );
+
+	return data;
+}
+
+static bool holds( const std::uint8_t* data, std::uint8_t first, std::size_t length ) {
+	for ( std::size_t i = 0; i < length; i++ ) {
+		if ( data[ i ] != std::uint8_t( first + i ) )
+			return false;
+	}
+
+	return true;
+}
+
+static void wraps_around( ) {
+	ring_buffer ring = { };
+
+	auto first = sequence( 0, 40 );
+	ring.append( first.data( ), 40 );
+	ring.consume( 30 );
+
+	// Fits into the 64 bytes we start out with, but only around the end
+	auto second = sequence( 40, 40 );
+	ring.append( second.data( ), 40 );
+
+	FI_CHECK( ring.size( ) == 50 );
+
+	ring_buffer::segment segments[ 2 ] = { };
+	FI_CHECK( ring.writable( segments, 1 ) == 1 && segments[ 0 ].length == 14 );
+
+	// Crosses the end of the ring, comes out of the scratch buffer in one piece
+	FI_CHECK( holds( ring.contiguous( 50 ), 30, 50 ) );
+
+	// Doesn't cross it, points into the ring
+	FI_CHECK( holds( ring.contiguous( 10 ), 30, 10 ) );
+
+	std::uint8_t peeked[ 50 ] = { };
+	ring.peek( peeked, 50 );
+
+	FI_CHECK( holds( peeked, 30, 50 ) );
+
+	ring.consume( 34 );
+	FI_CHECK( ring.size( ) == 16 && holds( ring.contiguous( 16 ), 64, 16 ) );
+}
+
+static void grows_unwrapped( ) {
+	ring_buffer ring = { };
+
+	auto first = sequence( 0, 60 );
+	ring.append( first.data( ), 60 );
+	ring.consume( 50 );
+
+	auto second = sequence( 60, 30 );
+	ring.append( second.data( ), 30 );
+
+	// Doesn't fit anymore, growing moves the wrapped data to the front
+	auto third = sequence( 90, 100 );
+	ring.append( third.data( ), 100 );
+
+	FI_CHECK( ring.size( ) == 140 );
+	FI_CHECK( holds( ring.contiguous( 140 ), 50, 140 ) );
+}
+
+static void starts_over_when_empty( ) {
+	ring_buffer ring = { };
+
+	auto data = sequence( 0, 48 );
+	ring.append( data.data( ), 48 );
+	ring.consume( 48 );
+
+	// Empty again, so the next write starts at the front instead of wrapping
+	ring_buffer::segment segments[ 2 ] = { };
+
+	FI_CHECK( ring.writable( segments, 32 ) == 1 && segments[ 0 ].length == 64 );
+
+	ring.append( data.data( ), 32 );
+	FI_CHECK( holds( ring.contiguous( 32 ), 0, 32 ) );
+
+	ring.clear( );
+	FI_CHECK( ring.size( ) == 0 );
+}
+
+int main( ) {
+	wraps_around( );
+	grows_unwrapped( );
+	starts_over_when_empty( );
+
+	return fi::testing::result( );
+}
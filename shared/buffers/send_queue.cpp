@@ -0,0 +1,105 @@
+#include "send_queue.h"
+
+#include <algorithm>
+
+using namespace fi::detail;
+
+void send_queue::push( shared_buffer data ) {
+	if ( data.empty( ) )
+		return;
+
+	size_ += data.size( );
+	packets_.push_back( std::move( data ) );
+}
+
+void send_queue::push_front( shared_buffer data ) {
+	if ( data.empty( ) )
+		return;
+
+	size_ += data.size( );
+
+	// A packet that's partially out has to be finished first
+	packets_.insert( offset_ ? packets_.begin( ) + 1 : packets_.begin( ), std::move( data ) );
+}
+
+std::size_t send_queue::gather( std::size_t max_segments ) {
+	auto count = std::min( max_segments, packets_.size( ) );
+
+	segments_.resize( count );
+
+	for ( std::size_t i = 0; i < count; i++ ) {
+		// Only the first packet may have been partially sent
+		auto offset = i == 0 ? offset_ : 0;
+		auto& packet = packets_[ i ];
+
+		// The kernel only ever reads from these
+		auto data = packet.data( ) + offset;
+
+	#ifdef _WIN32
+		segments_[ i ].buf = reinterpret_cast< char* >( data );
+		segments_[ i ].len = ULONG( packet.size( ) - offset );
+	#else
+		segments_[ i ].iov_base = data;
+		segments_[ i ].iov_len = packet.size( ) - offset;
+	#endif // _WIN32
+	}
+
+	return count;
+}
+
+int send_queue::send_gathered( SOCKET to ) {
+#ifdef _WIN32
+	DWORD sent = 0;
+
+	if ( WSASend( to, segments_.data( ), DWORD( segments_.size( ) ), &sent, 0, nullptr, nullptr ) == SOCKET_ERROR )
+		return SOCKET_ERROR;
+
+	return int( sent );
+#else
+	// sendmsg rather than writev, as only send* lets us suppress SIGPIPE
+	return int( sendmsg( to, get_message( ), SOCKET_SEND_FLAGS ) );
+#endif // _WIN32
+}
+
+#ifdef __linux__
+const msghdr* send_queue::get_message( ) {
+	message_ = { };
+	message_.msg_iov = segments_.data( );
+	message_.msg_iovlen = segments_.size( );
+
+	return &message_;
+}
+#endif // __linux__
+
+void send_queue::advance( std::size_t bytes ) {
+	size_ -= std::min( bytes, size_ );
+
+	while ( bytes && !packets_.empty( ) ) {
+		auto remaining = packets_.front( ).size( ) - offset_;
+
+		if ( bytes < remaining ) {
+			offset_ += bytes;
+			return;
+		}
+
+		bytes -= remaining;
+		offset_ = 0;
+
+		packets_.pop_front( );
+	}
+}
+
+bool send_queue::empty( ) const {
+	return packets_.empty( );
+}
+
+std::size_t send_queue::size( ) const {
+	return size_;
+}
+
+void send_queue::clear( ) {
+	packets_.clear( );
+	segments_.clear( );
+
+	offset_ = size_ = 0;
+}
@@ -0,0 +1,63 @@
+#pragma once
+#include "../platform/platform.h"
+#include "buffer_pool.h"
+
+#include <cstdint>
+#include <vector>
+#include <deque>
+
+namespace fi::detail {
+	// Packets waiting to go out on a single connection. Instead of writing them one by
+	// one, we gather as many as we can into a scatter-gather list and hand them to the
+	// kernel in one go.
+	//
+	// Not thread-safe by itself. Packets may be pushed while a gathered list is being
+	// sent (the packets themselves never move), everything else needs the owner's lock.
+	class send_queue {
+	public:
+		send_queue( ) { }
+
+		send_queue( const send_queue& ) = delete;
+		send_queue& operator=( const send_queue& ) = delete;
+
+		void push( shared_buffer data );
+
+		// Puts data ahead of everything that hasn't started going out yet
+		void push_front( shared_buffer data );
+
+		// Collects up to max_segments packets from the front, returns how many were gathered
+		std::size_t gather( std::size_t max_segments );
+
+		// Writes the gathered packets with a single syscall. Returns whatever send would.
+		int send_gathered( SOCKET to );
+
+	#ifdef __linux__
+		// The gathered packets as a message for io_uring, valid until the next gather
+		const msghdr* get_message( );
+	#endif // __linux__
+
+		// Drops whatever the kernel accepted off the front
+		void advance( std::size_t bytes );
+
+		bool empty( ) const;
+
+		// Amount of bytes still waiting to be sent
+		std::size_t size( ) const;
+
+		void clear( );
+
+	private:
+		std::deque< shared_buffer > packets_ = { };
+
+		// How much of the first packet already went out
+		std::size_t offset_ = 0;
+		std::size_t size_ = 0;
+
+	#ifdef _WIN32
+		std::vector< WSABUF > segments_ = { };
+	#else
+		std::vector< iovec > segments_ = { };
+		msghdr message_ = { };
+	#endif // _WIN32
+	};
+} // namespace fi::detail
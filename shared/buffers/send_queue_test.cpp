@@ -0,0 +1,135 @@
+#include "send_queue.h"
+#include "../testing/check.h"
+
+#include <vector>
+
+using namespace fi::detail;
+
+// We look at what gets gathered through get_message, which only exists on Linux
+#ifdef __linux__
+static shared_buffer packet( std::uint8_t first, std::size_t length ) {
+	auto data = shared_buffer::allocate( length );
+
+	for ( std::size_t i = 0; i < length; i++ )
+		data.data( )[ i ] = std::uint8_t( first + i );
+
+	return data;
+}
+
+struct segment {
+	const std::uint8_t* data = nullptr;
+	std::size_t length = 0;
+
+	bool operator==( const segment& ) const = default;
+};
+
+// What a gather hands to the kernel
+static std::vector< segment > gathered( send_queue& queue, std::size_t max_segments ) {
+	std::vector< segment > segments( queue.gather( max_segments ) );
+	auto message = queue.get_message( );
+
+	if ( !FI_CHECK( message->msg_iovlen == segments.size( ) ) )
+		return { };
+
+	for ( std::size_t i = 0; i < segments.size( ); i++ )
+		segments[ i ] = { static_cast< const std::uint8_t* >( message->msg_iov[ i ].iov_base ), message->msg_iov[ i ].iov_len };
+
+	return segments;
+}
+
+static void gathers_and_advances( ) {
+	send_queue queue = { };
+	auto a = packet( 0, 10 ), b = packet( 10, 20 ), c = packet( 30, 30 );
+
+	queue.push( a );
+	queue.push( b );
+	queue.push( c );
+
+	// Empty packets never make it in
+	queue.push( { } );
+
+	FI_CHECK( queue.size( ) == 60 );
+	FI_CHECK( gathered( queue, 8 ) == std::vector< segment >{ { a.data( ), 10 }, { b.data( ), 20 }, { c.data( ), 30 } } );
+	FI_CHECK( gathered( queue, 2 ).size( ) == 2 );
+
+	// The kernel took the first one and half of the second
+	queue.advance( 20 );
+	FI_CHECK( queue.size( ) == 40 );
+	FI_CHECK( gathered( queue, 8 ) == std::vector< segment >{ { b.data( ) + 10, 10 }, { c.data( ), 30 } } );
+
+	// Exactly to the end of a packet
+	queue.advance( 10 );
+	FI_CHECK( queue.size( ) == 30 );
+	FI_CHECK( gathered( queue, 8 ) == std::vector< segment >{ { c.data( ), 30 } } );
+
+	queue.advance( 29 );
+	FI_CHECK( queue.size( ) == 1 && !queue.empty( ) );
+	FI_CHECK( gathered( queue, 8 ) == std::vector< segment >{ { c.data( ) + 29, 1 } } );
+
+	queue.advance( 1 );
+	FI_CHECK( queue.empty( ) && queue.size( ) == 0 );
+	FI_CHECK( gathered( queue, 8 ).empty( ) );
+}
+
+static void pushes_in_front( ) {
+	send_queue queue = { };
+	auto a = packet( 0, 10 ), b = packet( 10, 10 ), first = packet( 100, 5 ), second = packet( 105, 5 );
+
+	queue.push( a );
+	queue.push( b );
+
+	// Nothing went out yet, goes first
+	queue.push_front( first );
+	FI_CHECK( queue.size( ) == 25 );
+	FI_CHECK( gathered( queue, 8 ) == std::vector< segment >{ { first.data( ), 5 }, { a.data( ), 10 }, { b.data( ), 10 } } );
+
+	queue.advance( 5 + 3 );
+
+	// The first packet is partially out, it has to be finished before anything else goes
+	queue.push_front( second );
+	FI_CHECK( queue.size( ) == 22 );
+	FI_CHECK( gathered( queue, 8 ) == std::vector< segment >{ { a.data( ) + 3, 7 }, { second.data( ), 5 }, { b.data( ), 10 } } );
+
+	queue.advance( 7 + 5 );
+	FI_CHECK( gathered( queue, 8 ) == std::vector< segment >{ { b.data( ), 10 } } );
+
+	queue.clear( );
+	FI_CHECK( queue.empty( ) && queue.size( ) == 0 );
+
+	// Same as a push on an empty queue
+	queue.push_front( a );
+	FI_CHECK( gathered( queue, 8 ) == std::vector< segment >{ { a.data( ), 10 } } );
+}
+
+// Packets get pushed while the last gather is out with the kernel, what it
+// points at mustn't move
+static void pushes_while_sending( ) {
+	send_queue queue = { };
+	auto a = packet( 0, 10 );
+
+	queue.push( a );
+	auto before = gathered( queue, 8 );
+
+	for ( int i = 0; i < 1000; i++ )
+		queue.push( packet( std::uint8_t( i ), 64 ) );
+
+	auto message = queue.get_message( );
+
+	FI_CHECK( message->msg_iovlen == 1 && message->msg_iov[ 0 ].iov_base == before[ 0 ].data );
+	FI_CHECK( queue.size( ) == 10 + 1000 * 64 );
+
+	// The packet stays alive as long as the queue holds it
+	a.reset( );
+	FI_CHECK( gathered( queue, 1 ) == before );
+}
+#endif // __linux__
+
+int main( ) {
+#ifdef __linux__
+	gathers_and_advances( );
+	pushes_in_front( );
+	pushes_while_sending( );
+#endif // __linux__
+
+	return fi::testing::result( );
+}
@@ -0,0 +1,174 @@
+#pragma once
+#include "task.h"
+#include "../packets/packet_fields.h"
+#include "../buffers/send_queue.h"
+
+#include <chrono>
+
+namespace fi::detail {
+	// A coroutine waiting for the next packet with a given id. The loop thread
+	// deserializes the packet into the coroutine's frame and resumes it right away.
+	struct receive_waiter {
+		packets::packet_id id = packets::ids::id_none;
+		std::coroutine_handle< > handle = { };
+
+		// Returns false if the packet didn't match its type
+		bool( *deliver )( receive_waiter* waiter, packets::detail::packet_reader& r ) = nullptr;
+	};
+
+	// A coroutine waiting for its packet to be written to the socket. Once the
+	// connection sent bytes in total, the loop thread resumes it.
+	struct send_waiter {
+		std::uint64_t bytes = 0;
+		std::coroutine_handle< > handle = { };
+
+		// Stays false if the connection went away first
+		bool sent = false;
+	};
+
+	// A coroutine waiting for the response to its request. Responses are matched by
+	// their call ID, so they can arrive in any order.
+	struct call_waiter {
+		packets::call_id call = 0;
+		packets::packet_id response_id = packets::ids::id_none;
+
+		// The owner gives up on the call once this has passed
+		std::chrono::steady_clock::time_point deadline = std::chrono::steady_clock::time_point::max( );
+
+		// The owner's timer for the deadline, if any
+		std::uint64_t timer = 0;
+
+		std::coroutine_handle< > handle = { };
+
+		// Returns false if the response didn't match its type
+		bool( *deliver )( call_waiter* waiter, packets::detail::packet_reader& r ) = nullptr;
+	};
+
+	// owner_t registers the waiter with add_receiver, returning false if there's no
+	// connection to wait on. We resume with nullopt if the connection goes away.
+	template < typename owner_t, typename packet_t >
+	class receive_operation : public receive_waiter {
+	public:
+		static_assert( packets::packet_type< packet_t >, "packets have to list their FI_PACKET_FIELDS or be based off base_packet" );
+		static_assert( packet_t::id > packets::ids::num_preset_ids, "packet ids up to num_preset_ids are reserved" );
+
+		explicit receive_operation( owner_t* owner ) : owner_( owner ) {
+			id = packet_t::id;
+			deliver = &deliver_packet;
+		}
+
+		bool await_ready( ) const noexcept {
+			return false;
+		}
+
+		bool await_suspend( std::coroutine_handle< > h ) {
+			handle = h;
+
+			// Don't touch anything after this, we might already be running elsewhere
+			return owner_->add_receiver( *this );
+		}
+
+		std::optional< packet_t > await_resume( ) {
+			return std::move( packet_ );
+		}
+
+	private:
+		static bool deliver_packet( receive_waiter* waiter, packets::detail::packet_reader& r ) {
+			auto self = static_cast< receive_operation* >( waiter );
+
+			packet_t packet = { };
+			packets::detail::read_packet( r, packet );
+
+			if ( !r.is_good( ) )
+				return false;
+
+			self->packet_.emplace( std::move( packet ) );
+			return true;
+		}
+
+		owner_t* owner_ = nullptr;
+		std::optional< packet_t > packet_ = { };
+	};
+
+	// owner_t queues the packet with add_sender, returning false if there's no connection
+	// to send on. Resumes with whether the packet made it to the socket.
+	template < typename owner_t >
+	class send_operation : public send_waiter {
+	public:
+		send_operation( owner_t* owner, shared_buffer data ) : owner_( owner ), data_( std::move( data ) ) { }
+
+		bool await_ready( ) const noexcept {
+			return false;
+		}
+
+		bool await_suspend( std::coroutine_handle< > h ) {
+			handle = h;
+
+			// Don't touch anything after this, we might already be running elsewhere
+			return owner_->add_sender( *this, data_ );
+		}
+
+		bool await_resume( ) const noexcept {
+			return sent;
+		}
+
+	private:
+		owner_t* owner_ = nullptr;
+		shared_buffer data_ = { };
+	};
+	// owner_t queues the request with add_call, returning false if there's no connection
+	// to send on. Resumes with the response, or nullopt if the deadline passed, the
+	// connection went away or the response didn't match its type.
+	template < typename owner_t, typename response_t >
+	class call_operation : public call_waiter {
+	public:
+		static_assert( packets::packet_type< response_t >, "packets have to list their FI_PACKET_FIELDS or be based off base_packet" );
+		static_assert( response_t::id > packets::ids::num_preset_ids, "packet ids up to num_preset_ids are reserved" );
+
+		call_operation( owner_t* owner, packets::call_id id, shared_buffer data, std::chrono::milliseconds timeout )
+			: owner_( owner ), data_( std::move( data ) ), timeout_( timeout ) {
+			call = id;
+			response_id = response_t::id;
+			deliver = &deliver_response;
+		}
+
+		bool await_ready( ) const noexcept {
+			return false;
+		}
+
+		bool await_suspend( std::coroutine_handle< > h ) {
+			handle = h;
+
+			// The deadline starts ticking once we're waiting, not when the call was made
+			if ( timeout_.count( ) > 0 )
+				deadline = std::chrono::steady_clock::now( ) + timeout_;
+
+			// Don't touch anything after this, we might already be running elsewhere
+			return owner_->add_call( *this, data_ );
+		}
+
+		std::optional< response_t > await_resume( ) {
+			return std::move( response_ );
+		}
+
+	private:
+		static bool deliver_response( call_waiter* waiter, packets::detail::packet_reader& r ) {
+			auto self = static_cast< call_operation* >( waiter );
+
+			response_t response = { };
+			packets::detail::read_packet( r, response );
+
+			if ( !r.is_good( ) )
+				return false;
+
+			self->response_.emplace( std::move( response ) );
+			return true;
+		}
+
+		owner_t* owner_ = nullptr;
+		shared_buffer data_ = { };
+
+		std::chrono::milliseconds timeout_ = { };
+		std::optional< response_t > response_ = { };
+	};
+} // namespace fi::detail
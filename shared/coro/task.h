@@ -0,0 +1,218 @@
+#pragma once
+#include <coroutine>
+#include <exception>
+#include <optional>
+#include <utility>
+#include <mutex>
+#include <condition_variable>
+#include <type_traits>
+
+namespace fi {
+	template < typename T = void >
+	class task;
+
+	namespace detail {
+		struct task_promise_base {
+			// Whoever awaits us gets resumed once we're done. Detached
+			// tasks have nobody waiting and clean up after themselves.
+			struct final_awaiter {
+				bool await_ready( ) const noexcept {
+					return false;
+				}
+
+				template < typename promise_t >
+				std::coroutine_handle< > await_suspend( std::coroutine_handle< promise_t > h ) noexcept {
+					auto& promise = h.promise( );
+
+					if ( promise.continuation )
+						return promise.continuation;
+
+					if ( promise.detached )
+						h.destroy( );
+
+					return std::noop_coroutine( );
+				}
+
+				void await_resume( ) noexcept { }
+			};
+
+			std::suspend_always initial_suspend( ) noexcept {
+				return { };
+			}
+
+			final_awaiter final_suspend( ) noexcept {
+				return { };
+			}
+
+			void unhandled_exception( ) {
+				// Nobody could ever see it
+				if ( detached )
+					std::terminate( );
+
+				exception = std::current_exception( );
+			}
+
+			std::coroutine_handle< > continuation = { };
+			std::exception_ptr exception = { };
+
+			bool detached = false;
+		};
+
+		template < typename T >
+		struct task_promise : task_promise_base {
+			task< T > get_return_object( );
+
+			template < typename value_t >
+			void return_value( value_t&& v ) {
+				value.emplace( std::forward< value_t >( v ) );
+			}
+
+			T result( ) {
+				if ( exception )
+					std::rethrow_exception( exception );
+
+				return std::move( *value );
+			}
+
+			std::optional< T > value = { };
+		};
+
+		template < >
+		struct task_promise< void > : task_promise_base {
+			task< void > get_return_object( );
+
+			void return_void( ) { }
+
+			void result( ) {
+				if ( exception )
+					std::rethrow_exception( exception );
+			}
+		};
+	} // namespace detail
+
+	// Lazily started coroutine. Nothing runs until it's awaited (or handed to spawn),
+	// the awaiting coroutine continues right where this one finishes, on whatever
+	// thread that happens to be.
+	template < typename T >
+	class [[nodiscard]] task {
+	public:
+		using promise_type = detail::task_promise< T >;
+
+		task( ) { }
+		explicit task( std::coroutine_handle< promise_type > h ) : handle_( h ) { }
+
+		task( task&& other ) noexcept : handle_( std::exchange( other.handle_, { } ) ) { }
+
+		task& operator=( task&& other ) noexcept {
+			if ( this != &other ) {
+				if ( handle_ )
+					handle_.destroy( );
+
+				handle_ = std::exchange( other.handle_, { } );
+			}
+
+			return *this;
+		}
+
+		task( const task& ) = delete;
+		task& operator=( const task& ) = delete;
+
+		~task( ) {
+			if ( handle_ )
+				handle_.destroy( );
+		}
+
+		auto operator co_await( ) && noexcept {
+			struct awaiter {
+				bool await_ready( ) const noexcept {
+					return !handle || handle.done( );
+				}
+
+				std::coroutine_handle< > await_suspend( std::coroutine_handle< > awaiting ) noexcept {
+					handle.promise( ).continuation = awaiting;
+					return handle;
+				}
+
+				T await_resume( ) {
+					return handle.promise( ).result( );
+				}
+
+				std::coroutine_handle< promise_type > handle;
+			};
+
+			return awaiter{ handle_ };
+		}
+
+		// Gives up ownership, the coroutine frame destroys itself once it's done
+		std::coroutine_handle< promise_type > release( ) {
+			return std::exchange( handle_, { } );
+		}
+
+	private:
+		std::coroutine_handle< promise_type > handle_ = { };
+	};
+
+	template < typename T >
+	task< T > detail::task_promise< T >::get_return_object( ) {
+		return task< T >( std::coroutine_handle< task_promise< T > >::from_promise( *this ) );
+	}
+
+	inline task< void > detail::task_promise< void >::get_return_object( ) {
+		return task< void >( std::coroutine_handle< task_promise< void > >::from_promise( *this ) );
+	}
+
+	// Starts the task right away on the calling thread and lets it run on its own.
+	// Once it suspends, whatever it awaits decides where it continues. Exceptions
+	// escaping a spawned task terminate the program.
+	inline void spawn( task< void > t ) {
+		auto h = t.release( );
+
+		if ( !h )
+			return;
+
+		h.promise( ).detached = true;
+		h.resume( );
+	}
+
+	// Runs the task and blocks the calling thread until it's done. Meant for main
+	// and tests, never call this from a loop thread.
+	template < typename T >
+	T sync_wait( task< T > t ) {
+		std::mutex mtx = { };
+		std::condition_variable done_cv = { };
+
+		bool done = false;
+
+		std::optional< std::conditional_t< std::is_void_v< T >, bool, T > > result = { };
+		std::exception_ptr exception = { };
+
+		auto runner = [ & ]( ) -> task< void > {
+			try {
+				if constexpr ( std::is_void_v< T > ) {
+					co_await std::move( t );
+					result.emplace( true );
+				} else
+					result.emplace( co_await std::move( t ) );
+			} catch ( ... ) {
+				exception = std::current_exception( );
+			}
+
+			// Notify while holding the lock, we're gone the moment the waiter sees done
+			std::lock_guard guard( mtx );
+
+			done = true;
+			done_cv.notify_one( );
+		};
+
+		spawn( runner( ) );
+
+		std::unique_lock lock( mtx );
+		done_cv.wait( lock, [ & ]( ) { return done; } );
+
+		if ( exception )
+			std::rethrow_exception( exception );
+
+		if constexpr ( !std::is_void_v< T > )
+			return std::move( *result );
+	}
+} // namespace fi
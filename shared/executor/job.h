@@ -0,0 +1,155 @@
+#pragma once
+#include <new>
+#include <vector>
+#include <utility>
+#include <cstddef>
+#include <algorithm>
+#include <type_traits>
+
+namespace fi::detail {
+	// Move-only void( ) callable the pool and strands queue. Unlike std::function it
+	// keeps captures of up to inline_size bytes in place, even ones that aren't
+	// trivially copyable, so posting a packet to a worker doesn't allocate.
+	class job {
+	public:
+		static constexpr std::size_t inline_size = 64;
+
+		job( ) { }
+
+		template < typename fn_t > requires ( !std::is_same_v< std::remove_cvref_t< fn_t >, job > && std::is_invocable_v< std::remove_cvref_t< fn_t >& > )
+		job( fn_t&& fn ) {
+			using stored_t = std::remove_cvref_t< fn_t >;
+
+			if constexpr ( stored_inline< stored_t > ) {
+				new ( storage_ ) stored_t( std::forward< fn_t >( fn ) );
+				ops_ = &inline_ops< stored_t >;
+			} else {
+				new ( storage_ ) stored_t*( new stored_t( std::forward< fn_t >( fn ) ) );
+				ops_ = &heap_ops< stored_t >;
+			}
+		}
+
+		job( job&& other ) noexcept {
+			take( other );
+		}
+
+		job& operator=( job&& other ) noexcept {
+			if ( this != &other ) {
+				reset( );
+				take( other );
+			}
+
+			return *this;
+		}
+
+		job( const job& ) = delete;
+		job& operator=( const job& ) = delete;
+
+		~job( ) {
+			reset( );
+		}
+
+		void operator( )( ) {
+			ops_->call( storage_ );
+		}
+
+		explicit operator bool( ) const {
+			return ops_ != nullptr;
+		}
+
+		void reset( ) {
+			if ( ops_ )
+				std::exchange( ops_, nullptr )->destroy( storage_ );
+		}
+
+	private:
+		struct operations {
+			void ( *call )( void* at );
+
+			// Moves into to and destroys what's left at from
+			void ( *relocate )( void* to, void* from );
+			void ( *destroy )( void* at );
+		};
+
+		template < typename T >
+		static constexpr bool stored_inline = sizeof( T ) <= inline_size && alignof( T ) <= alignof( std::max_align_t ) && std::is_nothrow_move_constructible_v< T >;
+
+		template < typename T >
+		static constexpr operations inline_ops = {
+			[ ]( void* at ) { ( *static_cast< T* >( at ) )( ); },
+			[ ]( void* to, void* from ) {
+				new ( to ) T( std::move( *static_cast< T* >( from ) ) );
+				static_cast< T* >( from )->~T( );
+			},
+			[ ]( void* at ) { static_cast< T* >( at )->~T( ); }
+		};
+
+		template < typename T >
+		static constexpr operations heap_ops = {
+			[ ]( void* at ) { ( **static_cast< T** >( at ) )( ); },
+			[ ]( void* to, void* from ) { new ( to ) T*( *static_cast< T** >( from ) ); },
+			[ ]( void* at ) { delete *static_cast< T** >( at ); }
+		};
+
+		void take( job& other ) {
+			if ( !other.ops_ )
+				return;
+
+			other.ops_->relocate( storage_, other.storage_ );
+			ops_ = std::exchange( other.ops_, nullptr );
+		}
+
+		alignas( std::max_align_t ) unsigned char storage_[ inline_size ];
+		const operations* ops_ = nullptr;
+	};
+
+	// Queue of jobs that can be taken from both ends. It's a ring that keeps its
+	// storage, so once it grew large enough queueing doesn't allocate anymore.
+	class job_queue {
+	public:
+		bool empty( ) const {
+			return count_ == 0;
+		}
+
+		std::size_t size( ) const {
+			return count_;
+		}
+
+		void push_back( job&& item ) {
+			if ( count_ == ring_.size( ) )
+				grow( );
+
+			ring_[ ( head_ + count_++ ) & ( ring_.size( ) - 1 ) ] = std::move( item );
+		}
+
+		job pop_front( ) {
+			auto item = std::move( ring_[ head_ ] );
+
+			head_ = ( head_ + 1 ) & ( ring_.size( ) - 1 );
+			count_--;
+
+			return item;
+		}
+
+		job pop_back( ) {
+			count_--;
+
+			return std::move( ring_[ ( head_ + count_ ) & ( ring_.size( ) - 1 ) ] );
+		}
+
+	private:
+		void grow( ) {
+			std::vector< job > ring( std::max< std::size_t >( 16, ring_.size( ) * 2 ) );
+
+			for ( std::size_t i = 0; i < count_; i++ )
+				ring[ i ] = std::move( ring_[ ( head_ + i ) & ( ring_.size( ) - 1 ) ] );
+
+			ring_.swap( ring );
+			head_ = 0;
+		}
+
+		// Always a power of two long
+		std::vector< job > ring_ = { };
+		std::size_t head_ = 0, count_ = 0;
+	};
+} // namespace fi::detail
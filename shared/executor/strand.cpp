@@ -0,0 +1,40 @@
+#include "strand.h"
+
+namespace fi::detail {
+	void strand::post( job task ) {
+		{
+			std::lock_guard guard( mtx_ );
+			tasks_.push_back( std::move( task ) );
+
+			// Whoever is running us picks the task up
+			if ( scheduled_ )
+				return;
+
+			scheduled_ = true;
+		}
+
+		pool_.submit( [ self = shared_from_this( ) ]( ) { self->run( ); } );
+	}
+
+	void strand::run( ) {
+		for ( std::size_t i = 0; i < batch_size_; i++ ) {
+			job task = { };
+
+			{
+				std::lock_guard guard( mtx_ );
+
+				if ( tasks_.empty( ) ) {
+					scheduled_ = false;
+					return;
+				}
+
+				task = tasks_.pop_front( );
+			}
+
+			// Nothing is locked while the task runs
+			task( );
+		}
+
+		pool_.submit( [ self = shared_from_this( ) ]( ) { self->run( ); } );
+	}
+} // namespace fi::detail
@@ -0,0 +1,32 @@
+#pragma once
+#include "thread_pool.h"
+
+namespace fi::detail {
+	// Runs its tasks on a thread pool one at a time, in the order they were posted.
+	// Different strands run in parallel. Must be owned by a shared_ptr, as queued
+	// tasks keep it alive.
+	class strand : public std::enable_shared_from_this< strand > {
+	public:
+		explicit strand( thread_pool& pool ) : pool_( pool ) { }
+
+		strand( const strand& ) = delete;
+		strand& operator=( const strand& ) = delete;
+
+		void post( job task );
+
+	private:
+		void run( );
+
+		thread_pool& pool_;
+
+		std::mutex mtx_ = { };
+		job_queue tasks_ = { };
+
+		// A run of ours is queued on the pool or running
+		bool scheduled_ = false;
+
+		// After this many tasks we go to the back of the pool's queue, so a busy
+		// strand can't keep a worker to itself
+		static constexpr std::size_t batch_size_ = 64;
+	};
+} // namespace fi::detail
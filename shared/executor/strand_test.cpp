@@ -0,0 +1,146 @@
+#include "strand.h"
+#include "../testing/check.h"
+
+#include <vector>
+
+using namespace fi::detail;
+
+// Several threads post interleaved onto a few strands. Every strand has to run its
+// tasks in the order they were posted and never two of them at once.
+static void ordered_per_strand( ) {
+	constexpr std::size_t num_strands = 4, num_posters = 4, per_poster = 5000;
+
+	struct tracked {
+		std::shared_ptr< strand > runner = { };
+
+		// Only ever touched from the strand, no locks on purpose
+		std::vector< std::size_t > last = std::vector< std::size_t >( num_posters, 0 );
+		std::size_t ran = 0;
+
+		std::atomic_bool running = false;
+		std::atomic_bool overlapped = false;
+		std::atomic_bool out_of_order = false;
+	};
+
+	std::vector< tracked > strands( num_strands );
+
+	{
+		thread_pool pool( 4 );
+
+		for ( auto& s : strands )
+			s.runner = std::make_shared< strand >( pool );
+
+		std::vector< std::thread > posters = { };
+
+		for ( std::size_t p = 0; p < num_posters; p++ ) {
+			posters.emplace_back( [ &, p ]( ) {
+				for ( std::size_t i = 1; i <= per_poster; i++ ) {
+					auto& s = strands[ ( p + i ) % num_strands ];
+
+					s.runner->post( [ &s, p, i ]( ) {
+						if ( s.running.exchange( true ) )
+							s.overlapped = true;
+
+						// Each poster's tasks on this strand come in increasing order
+						if ( s.last[ p ] >= i )
+							s.out_of_order = true;
+
+						s.last[ p ] = i;
+						s.ran++;
+
+						s.running = false;
+					} );
+				}
+			} );
+		}
+
+		for ( auto& t : posters )
+			t.join( );
+
+		// Runs whatever is still queued
+	}
+
+	std::size_t ran = 0;
+
+	for ( auto& s : strands ) {
+		FI_CHECK( !s.overlapped );
+		FI_CHECK( !s.out_of_order );
+
+		ran += s.ran;
+	}
+
+	FI_CHECK( ran == num_posters * per_poster );
+}
+
+// Tasks posted from a task of the same strand run after it, not inside it
+static void posts_from_tasks( ) {
+	std::vector< int > order = { };
+
+	{
+		thread_pool pool( 2 );
+		auto runner = std::make_shared< strand >( pool );
+
+		runner->post( [ & ]( ) {
+			order.push_back( 1 );
+			runner->post( [ & ]( ) { order.push_back( 3 ); } );
+			order.push_back( 2 );
+		} );
+	}
+
+	FI_CHECK( order == std::vector< int >{ 1, 2, 3 } );
+}
+
+// The queue both ends of the pool work from, across wrapping around and growing
+static void job_queues( ) {
+	job_queue queue = { };
+	std::vector< int > ran = { };
+
+	for ( int i = 0; i < 10; i++ )
+		queue.push_back( [ &, i ]( ) { ran.push_back( i ); } );
+
+	for ( int i = 0; i < 8; i++ )
+		queue.pop_front( )( );
+
+	// Wraps around the end of the 16 we started out with, then has to grow
+	for ( int i = 10; i < 40; i++ )
+		queue.push_back( [ &, i ]( ) { ran.push_back( i ); } );
+
+	queue.pop_back( )( );
+
+	while ( !queue.empty( ) )
+		queue.pop_front( )( );
+
+	std::vector< int > expected = { };
+
+	for ( int i = 0; i < 8; i++ )
+		expected.push_back( i );
+
+	expected.push_back( 39 );
+
+	for ( int i = 8; i < 39; i++ )
+		expected.push_back( i );
+
+	FI_CHECK( ran == expected );
+
+	// Captures too big to keep inline still work, and get destroyed exactly once
+	auto counted = std::make_shared< int >( 0 );
+	char padding[ job::inline_size ] = { };
+
+	{
+		job big = [ counted, padding ]( ) { ( *counted ) += padding[ 0 ] + 1; };
+		job moved = std::move( big );
+
+		FI_CHECK( !big && moved );
+		moved( );
+	}
+
+	FI_CHECK( *counted == 1 && counted.use_count( ) == 1 );
+}
+
+int main( ) {
+	ordered_per_strand( );
+	posts_from_tasks( );
+	job_queues( );
+
+	return fi::testing::result( );
+}
@@ -0,0 +1,107 @@
+#include "thread_pool.h"
+
+namespace fi::detail {
+	// The pool and queue the current thread works for, if any
+	static thread_local thread_pool* current_pool = nullptr;
+	static thread_local std::size_t current_index = 0;
+
+	thread_pool::thread_pool( std::uint32_t threads ) {
+		for ( std::uint32_t i = 0; i < threads; i++ )
+			workers_.push_back( std::make_unique< worker >( ) );
+
+		// Only start them once all queues exist, they steal from each other right away
+		for ( std::size_t i = 0; i < workers_.size( ); i++ )
+			workers_[ i ]->thread = std::thread( &thread_pool::run, this, i );
+	}
+
+	thread_pool::~thread_pool( ) {
+		{
+			std::lock_guard guard( sleep_mtx_ );
+			stopping_ = true;
+		}
+
+		wake_.notify_all( );
+
+		for ( auto& w : workers_ ) {
+			if ( w->thread.joinable( ) )
+				w->thread.join( );
+		}
+	}
+
+	void thread_pool::submit( job task ) {
+		auto index = current_pool == this ? current_index : next_++ % workers_.size( );
+
+		{
+			std::lock_guard guard( workers_[ index ]->mtx );
+			workers_[ index ]->tasks.push_back( std::move( task ) );
+		}
+
+		pending_++;
+
+		// Sleepers check pending_ after announcing themselves, so either they
+		// see our task or we see them
+		if ( sleeping_ ) {
+			// Taking the lock makes sure a worker that's about to sleep is either
+			// still going to check pending_ or already waiting for our notify
+			{ std::lock_guard guard( sleep_mtx_ ); }
+
+			wake_.notify_one( );
+		}
+	}
+
+	bool thread_pool::pop( std::size_t index, job& task ) {
+		// Our own queue first, oldest task first
+		{
+			auto& w = *workers_[ index ];
+			std::lock_guard guard( w.mtx );
+
+			if ( !w.tasks.empty( ) ) {
+				task = w.tasks.pop_front( );
+
+				return true;
+			}
+		}
+
+		// Steal from the back, the owner keeps working off the front
+		for ( std::size_t i = 1; i < workers_.size( ); i++ ) {
+			auto& w = *workers_[ ( index + i ) % workers_.size( ) ];
+			std::lock_guard guard( w.mtx );
+
+			if ( !w.tasks.empty( ) ) {
+				task = w.tasks.pop_back( );
+
+				return true;
+			}
+		}
+
+		return false;
+	}
+
+	void thread_pool::run( std::size_t index ) {
+		current_pool = this;
+		current_index = index;
+
+		job task = { };
+
+		while ( true ) {
+			if ( pop( index, task ) ) {
+				pending_--;
+
+				task( );
+				task.reset( );
+
+				continue;
+			}
+
+			std::unique_lock lock( sleep_mtx_ );
+
+			sleeping_++;
+			wake_.wait( lock, [ & ]( ) { return pending_ > 0 || stopping_; } );
+			sleeping_--;
+
+			// Keep going until everything that was queued ran
+			if ( stopping_ && pending_ <= 0 )
+				return;
+		}
+	}
+} // namespace fi::detail
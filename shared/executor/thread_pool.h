@@ -0,0 +1,56 @@
+#pragma once
+#include <cstdint>
+#include <vector>
+#include <memory>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <condition_variable>
+
+#include "job.h"
+
+namespace fi::detail {
+	// Work-stealing thread pool. Every worker has its own queue, tasks submitted by a
+	// worker stay on its queue and workers that run dry steal from the others, so
+	// workers rarely contend on the same lock.
+	class thread_pool {
+	public:
+		explicit thread_pool( std::uint32_t threads );
+
+		// Runs everything that's still queued before returning
+		~thread_pool( );
+
+		thread_pool( const thread_pool& ) = delete;
+		thread_pool& operator=( const thread_pool& ) = delete;
+
+		void submit( job task );
+
+	private:
+		struct worker {
+			std::mutex mtx = { };
+			job_queue tasks = { };
+
+			std::thread thread = { };
+		};
+
+		// Takes a task off our own queue, or someone else's if ours is empty
+		bool pop( std::size_t index, job& task );
+
+		void run( std::size_t index );
+
+		std::vector< std::unique_ptr< worker > > workers_ = { };
+
+		// Where submissions from outside the pool go next
+		std::atomic_size_t next_ = 0;
+
+		// Queued tasks over all workers
+		std::atomic_int64_t pending_ = 0;
+
+		// Workers out of work wait here. Submitters only touch the lock if someone's sleeping.
+		std::mutex sleep_mtx_ = { };
+		std::condition_variable wake_ = { };
+		std::atomic_uint32_t sleeping_ = 0;
+
+		bool stopping_ = false;
+	};
+} // namespace fi::detail
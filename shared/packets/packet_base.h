@@ -3,7 +3,7 @@
 
 // Keep this file synchronized between server and client!
 
-#define PACKET_MAGIC		'FI00'
+#define PACKET_MAGIC		0x46493030 // 'FI00'
 #define PACKET_BUFFER_SIZE	4096	// Temporary buffer size for recv
 
 #pragma pack(push, 1)
@@ -14,7 +14,9 @@ namespace fi::packets {
 		fl_handshake_cl		= ( 1 << 0 ),
 		fl_handshake_sv		= ( 1 << 1 ),
 		fl_heartbeat		= ( 1 << 2 ),
-		fl_disconnect		= ( 1 << 3 )
+		fl_disconnect		= ( 1 << 3 ),
+		fl_request			= ( 1 << 4 ),	// Body starts with a call_id, the response carries the same one
+		fl_response			= ( 1 << 5 )
 
 		// Put your custom packet flags here
 	};
@@ -43,16 +45,59 @@ namespace fi::packets {
 	typedef decltype( header::flags ) packet_flags;
 	typedef decltype( header::length ) packet_length;
 
-	// Each packet must be based off this class
+	// Matches responses to their request, so any number of calls can be in flight
+	// on a connection and complete in whatever order the other side answers them
+	typedef std::uint32_t call_id;
+
+	namespace detail {
+		// Headers go over the wire little endian like everything else
+		inline header to_wire( header packet_header ) {
+			packet_header.magic = to_wire( packet_header.magic );
+			packet_header.id = to_wire( packet_header.id );
+			packet_header.flags = to_wire( packet_header.flags );
+			packet_header.length = to_wire( packet_header.length );
+
+			return packet_header;
+		}
+
+		inline header from_wire( const header& packet_header ) {
+			return to_wire( packet_header );
+		}
+	} // namespace detail
+
+	// Packets either list their members with FI_PACKET_FIELDS (example shown in
+	// packets.h) or are based off this class and write serialize/deserialize by hand
 	class base_packet {
 	public:
-		// Override these three methods (example shown in packets.h)
+		// Override these three methods. To use a packet with on< packet_t >,
+		// also give it a static constexpr packet_id id.
 		virtual void serialize( detail::binary_serializer& s ) = 0;
-		virtual void deserialize( detail::binary_serializer& s ) = 0;
+		virtual void deserialize( detail::packet_reader& r ) = 0;
 
 		virtual packet_id get_id( ) = 0;
+
+		// Bytes serialize writes, the send buffer is sized by it. By default serialize runs
+		// once without writing anything. Packets made of fixed-size members can return the
+		// sum of their sizeof instead, mind that serialize must write exactly that much.
+		virtual packet_length serialized_size( ) {
+			detail::binary_serializer measure = { };
+			serialize( measure );
+
+			return measure.get_serialized_data_length( );
+		}
 	};
 
 } // namespace fi::packets
 
-#pragma pack(pop)
\ No newline at end of file
+#pragma pack(pop)
+
+namespace fi::packets {
+	// A packet as handed to batch callbacks, read it with packet_reader( packet.data )
+	struct received_packet {
+		// Everything after the header
+		std::span< const std::uint8_t > data = { };
+
+		packet_id id = ids::id_none;
+		packet_flags flags = flags::fl_none;
+	};
+} // namespace fi::packets
\ No newline at end of file
@@ -0,0 +1,156 @@
+#pragma once
+#include "packet_base.h"
+#include "../buffers/buffer_pool.h"
+
+#include <tuple>
+#include <cstring>
+#include <concepts>
+#include <type_traits>
+
+// Lists a packet's members once, encoding, decoding and sizing are generated from it.
+// Members go over the wire in the order they're listed:
+//
+//	struct chat_packet {
+//		static constexpr packet_id id = ids::id_chat;
+//
+//		std::uint32_t room = 0;
+//		std::string text = { };
+//
+//		FI_PACKET_FIELDS( room, text )
+//	};
+//
+// Packets with mostly small numbers can opt into the compact encoding, which writes
+// integers and length prefixes as varints (see varint.h):
+//
+//		static constexpr bool compact = true;
+#define FI_PACKET_FIELDS( ... ) \
+	auto fields( ) { return std::tie( __VA_ARGS__ ); } \
+	auto fields( ) const { return std::tie( __VA_ARGS__ ); }
+
+namespace fi::packets {
+	// Declared its members with FI_PACKET_FIELDS, no base class and no vtable
+	template < typename packet_t >
+	concept reflected_packet = requires( packet_t& packet, const packet_t& const_packet ) {
+		{ packet_t::id } -> std::convertible_to< packet_id >;
+		packet.fields( );
+		const_packet.fields( );
+	};
+
+	// Anything that can be sent and received: reflected or based off base_packet
+	template < typename packet_t >
+	concept packet_type = reflected_packet< packet_t > || std::is_base_of_v< base_packet, packet_t >;
+
+	// Packets based off base_packet pick their encoding themselves, in serialize and deserialize
+	template < typename packet_t >
+	concept compact_packet = reflected_packet< packet_t > && requires { requires bool( packet_t::compact ); };
+} // namespace fi::packets
+
+namespace fi::packets::detail {
+	// Bytes a member always takes, 0 if it depends on its value
+	template < typename T >
+	struct field_size : std::integral_constant< std::size_t, 0 > { };
+
+	template < typename T > requires std::is_arithmetic_v< T >
+	struct field_size< T > : std::integral_constant< std::size_t, sizeof( T ) > { };
+
+	template < typename tuple_t >
+	struct fields_size;
+
+	template < typename T >
+	struct packed_view : std::false_type { };
+
+	template < typename T >
+	struct packed_view< array_view< T > > : std::bool_constant< is_varint< T > > { };
+
+	template < typename... fields_t >
+	struct fields_size< std::tuple< fields_t... > > {
+		static constexpr bool fixed = ( ( field_size< std::remove_cvref_t< fields_t > >::value != 0 ) && ... );
+		static constexpr std::size_t value = ( field_size< std::remove_cvref_t< fields_t > >::value + ... + 0 );
+
+		static constexpr bool has_packed_views = ( packed_view< std::remove_cvref_t< fields_t > >::value || ... );
+	};
+
+	// Whether every packet_t encodes to the same size, known at compile time. Varints don't.
+	template < reflected_packet packet_t >
+	constexpr bool has_fixed_size = !compact_packet< packet_t > && fields_size< decltype( std::declval< const packet_t& >( ).fields( ) ) >::fixed;
+
+	template < reflected_packet packet_t >
+	constexpr std::size_t fixed_size = fields_size< decltype( std::declval< const packet_t& >( ).fields( ) ) >::value;
+
+	template < typename packet_t >
+	packet_id id_of( packet_t& packet ) {
+		if constexpr ( reflected_packet< packet_t > )
+			return packet_t::id;
+		else
+			return packet.get_id( );
+	}
+
+	// Packets based off base_packet go through the vtable here, we don't know what
+	// they really are. Reflected ones are plain field writes the compiler can fuse.
+	template < typename packet_t >
+	void write_packet( binary_serializer& s, packet_t& packet ) {
+		if constexpr ( reflected_packet< packet_t > ) {
+			s.set_compact( compact_packet< packet_t > );
+			std::apply( [ & ]( const auto&... field ) { ( s.serialize( field ), ... ); }, packet.fields( ) );
+		} else
+			packet.serialize( s );
+	}
+
+	// packet is exactly a packet_t, we made it
+	template < typename packet_t >
+	void read_packet( packet_reader& r, packet_t& packet ) {
+		if constexpr ( reflected_packet< packet_t > ) {
+			static_assert( !compact_packet< packet_t > || !fields_size< decltype( packet.fields( ) ) >::has_packed_views,
+				"compact packets pack their integers, use std::vector instead of array_view for them" );
+
+			r.set_compact( compact_packet< packet_t > );
+			std::apply( [ & ]( auto&... field ) { ( r.deserialize( field ), ... ); }, packet.fields( ) );
+		} else
+			packet.packet_t::deserialize( r );
+	}
+
+	template < typename packet_t >
+	packet_length packet_size( packet_t& packet ) {
+		if constexpr ( !reflected_packet< packet_t > ) {
+			return packet.serialized_size( );
+		} else if constexpr ( has_fixed_size< packet_t > ) {
+			return packet_length( fixed_size< packet_t > );
+		} else {
+			binary_serializer measure = { };
+			write_packet( measure, packet );
+
+			return measure.get_serialized_data_length( );
+		}
+	}
+
+	// Header and payload in a buffer of their own, calls carry their ID ahead of the payload.
+	// Empty if the packet didn't write what its size pass said it would.
+	template < typename packet_t >
+	fi::detail::shared_buffer encode_packet( packet_t& packet, packet_flags flags, call_id call ) {
+		bool is_call = flags & ( flags::fl_request | flags::fl_response );
+
+		packet_length length = packet_size( packet ) + ( is_call ? sizeof( call_id ) : 0 );
+
+		header packet_header = { };
+		packet_header.id = id_of( packet );
+		packet_header.flags = flags;
+		packet_header.length = sizeof( header ) + length;
+
+		packet_header = to_wire( packet_header );
+
+		auto data = fi::detail::shared_buffer::allocate( sizeof( header ) + length );
+		memcpy( data.data( ), &packet_header, sizeof( header ) );
+
+		binary_serializer s( { data.data( ) + sizeof( header ), length } );
+
+		if ( is_call )
+			s.serialize( call );
+
+		write_packet( s, packet );
+
+		if ( !s.is_good( ) || s.get_serialized_data_length( ) != length )
+			return { };
+
+		return data;
+	}
+} // namespace fi::packets::detail
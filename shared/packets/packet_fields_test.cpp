@@ -0,0 +1,178 @@
+#include "packets.h"
+#include "../testing/check.h"
+
+#include <string>
+#include <vector>
+
+using namespace fi::packets;
+
+struct fixed_packet {
+	static constexpr packet_id id = packet_id( ids::id_example + 1 );
+
+	std::int32_t a = 0;
+	std::uint16_t b = 0;
+	double c = 0;
+
+	FI_PACKET_FIELDS( a, b, c )
+};
+
+struct mixed_packet {
+	static constexpr packet_id id = packet_id( ids::id_example + 2 );
+
+	std::int64_t number = 0;
+	std::string text = { };
+	std::vector< std::int32_t > numbers = { };
+	std::vector< std::string > words = { };
+
+	FI_PACKET_FIELDS( number, text, numbers, words )
+};
+
+struct compact_mixed_packet : mixed_packet {
+	static constexpr packet_id id = packet_id( ids::id_example + 3 );
+	static constexpr bool compact = true;
+};
+
+struct view_packet {
+	static constexpr packet_id id = packet_id( ids::id_example + 4 );
+
+	std::uint32_t tag = 0;
+	fi::array_view< std::uint16_t > values = { };
+	fi::bytes_view blob = { };
+	std::string_view name = { };
+	fi::string_view_list names = { };
+
+	FI_PACKET_FIELDS( tag, values, blob, name, names )
+};
+
+static_assert( detail::has_fixed_size< fixed_packet > && detail::fixed_size< fixed_packet > == 14 );
+static_assert( !detail::has_fixed_size< mixed_packet > );
+static_assert( reflected_packet< compact_mixed_packet > && compact_packet< compact_mixed_packet > && !compact_packet< mixed_packet > );
+
+// Encodes the packet, checks the header and hands the payload to a reader
+template < typename packet_t >
+static std::vector< std::uint8_t > encode( packet_t& packet, packet_flags flags = flags::fl_none, call_id call = 0 ) {
+	auto data = detail::encode_packet( packet, flags, call );
+
+	if ( !FI_CHECK( data.size( ) >= sizeof( header ) ) )
+		return { };
+
+	header packet_header = { };
+	memcpy( &packet_header, data.data( ), sizeof( header ) );
+	packet_header = detail::from_wire( packet_header );
+
+	FI_CHECK( packet_header.magic == PACKET_MAGIC );
+	FI_CHECK( packet_header.id == packet_t::id );
+	FI_CHECK( packet_header.flags == flags );
+	FI_CHECK( packet_header.length == data.size( ) );
+
+	return { data.data( ) + sizeof( header ), data.data( ) + data.size( ) };
+}
+
+static void fixed( ) {
+	fixed_packet out = { };
+	out.a = -5;
+	out.b = 60000;
+	out.c = 0.25;
+
+	auto payload = encode( out );
+	FI_CHECK( payload.size( ) == 14 );
+
+	fixed_packet in = { };
+	detail::packet_reader r( payload );
+	detail::read_packet( r, in );
+
+	FI_CHECK( r.is_good( ) && r.get_remaining( ) == 0 );
+	FI_CHECK( in.a == -5 && in.b == 60000 && in.c == 0.25 );
+
+	// One byte short, the reader notices
+	payload.pop_back( );
+
+	detail::packet_reader short_reader( payload );
+	detail::read_packet( short_reader, in );
+
+	FI_CHECK( !short_reader.is_good( ) );
+}
+
+template < typename packet_t >
+static std::size_t round_trip( ) {
+	packet_t out = { };
+	out.number = -3;
+	out.text = "hello";
+	out.numbers = { 0, 1, -1, 127, -128, 1 << 20, std::numeric_limits< std::int32_t >::min( ), 5, 6, 7 };
+	out.words = { "a", "", "words" };
+
+	auto payload = encode( out );
+
+	packet_t in = { };
+	detail::packet_reader r( payload );
+	detail::read_packet( r, in );
+
+	FI_CHECK( r.is_good( ) && r.get_remaining( ) == 0 );
+	FI_CHECK( in.number == out.number && in.text == out.text && in.numbers == out.numbers && in.words == out.words );
+
+	// The size pass has to agree with what's written
+	FI_CHECK( detail::packet_size( out ) == payload.size( ) );
+
+	return payload.size( );
+}
+
+static void mixed( ) {
+	auto plain = round_trip< mixed_packet >( );
+	auto compact = round_trip< compact_mixed_packet >( );
+
+	// Mostly small numbers, varints win
+	FI_CHECK( compact < plain );
+}
+
+static void calls( ) {
+	fixed_packet out = { };
+	out.a = 9;
+
+	auto payload = encode( out, flags::fl_request, 0x11223344 );
+	FI_CHECK( payload.size( ) == sizeof( call_id ) + 14 );
+
+	detail::packet_reader r( payload );
+
+	call_id call = 0;
+	r.deserialize( call );
+
+	fixed_packet in = { };
+	detail::read_packet( r, in );
+
+	FI_CHECK( r.is_good( ) && call == 0x11223344 && in.a == 9 );
+}
+
+static void views( ) {
+	const std::uint8_t blob[ ] = { 9, 8, 7 };
+
+	// Views point at data that is already in wire order
+	std::vector< std::uint8_t > values_wire( 3 * sizeof( std::uint16_t ) );
+	const std::uint16_t values[ ] = { 1, 0x1234, 0xffff };
+	detail::copy_to_wire( values_wire.data( ), values, 3 );
+
+	view_packet out = { };
+	out.tag = 77;
+	out.values = fi::array_view< std::uint16_t >( values_wire.data( ), 3 );
+	out.blob = fi::bytes_view( blob );
+	out.name = "name";
+
+	auto payload = encode( out );
+
+	view_packet in = { };
+	detail::packet_reader r( payload );
+	detail::read_packet( r, in );
+
+	FI_CHECK( r.is_good( ) && r.get_remaining( ) == 0 );
+	FI_CHECK( in.tag == 77 && in.name == "name" && in.names.size( ) == 0 );
+	FI_CHECK( in.values.size( ) == 3 && in.values[ 0 ] == 1 && in.values[ 1 ] == 0x1234 && in.values[ 2 ] == 0xffff );
+	FI_CHECK( in.blob.to_owned( ) == std::vector< std::uint8_t >( blob, blob + 3 ) );
+}
+
+int main( ) {
+	fixed( );
+	mixed( );
+	calls( );
+	views( );
+
+	return fi::testing::result( );
+}
@@ -0,0 +1,74 @@
+#pragma once
+#include "packet_fields.h"
+
+#include <vector>
+#include <memory>
+#include <type_traits>
+
+namespace fi::packets::detail {
+	// Typed packet handlers, looked up by indexing a flat table with the packet id.
+	// Every entry calls a function made for its packet type, which deserializes
+	// straight into that type and hands it to the handler without any virtual calls.
+	// args_t are whatever the owner passes to its handlers ahead of the packet.
+	template < typename... args_t >
+	class handler_table {
+	public:
+		template < typename packet_t, typename fn_t >
+		void on( fn_t&& fn ) {
+			static_assert( packet_type< packet_t >, "packets have to list their FI_PACKET_FIELDS or be based off base_packet" );
+			static_assert( std::is_default_constructible_v< packet_t >, "packets need a default constructor" );
+			static_assert( std::is_same_v< std::remove_cv_t< decltype( packet_t::id ) >, packet_id >, "packets need a static constexpr packet_id id" );
+			static_assert( packet_t::id > ids::num_preset_ids, "packet ids up to num_preset_ids are reserved" );
+			static_assert( std::is_invocable_v< std::decay_t< fn_t >&, args_t..., packet_t& >, "handler can't be called with this packet" );
+
+			if ( packet_t::id >= entries_.size( ) )
+				entries_.resize( std::size_t( packet_t::id ) + 1 );
+
+			auto& e = entries_[ packet_t::id ];
+
+			e.handler = std::make_shared< std::decay_t< fn_t > >( std::forward< fn_t >( fn ) );
+			e.invoke = &invoke< packet_t, std::decay_t< fn_t > >;
+		}
+
+		// Returns false if there's no handler for the packet
+		bool dispatch( packet_id id, packet_reader& r, args_t... args ) const {
+			if ( id >= entries_.size( ) || !entries_[ id ].invoke )
+				return false;
+
+			auto& e = entries_[ id ];
+			e.invoke( e.handler.get( ), r, args... );
+
+			return true;
+		}
+
+		bool contains( packet_id id ) const {
+			return id < entries_.size( ) && entries_[ id ].invoke;
+		}
+
+		bool empty( ) const {
+			return entries_.empty( );
+		}
+
+	private:
+		template < typename packet_t, typename fn_t >
+		static void invoke( void* handler, packet_reader& r, args_t... args ) {
+			packet_t packet = { };
+
+			// We know exactly what we made, so this never goes through a vtable
+			read_packet( r, packet );
+
+			// Packets that don't match their type are dropped
+			if ( !r.is_good( ) )
+				return;
+
+			( *static_cast< fn_t* >( handler ) )( args..., packet );
+		}
+
+		struct entry {
+			void( *invoke )( void* handler, packet_reader& r, args_t... args ) = nullptr;
+			std::shared_ptr< void > handler = { };
+		};
+
+		std::vector< entry > entries_ = { };
+	};
+} // namespace fi::packets::detail
@@ -1,5 +1,5 @@
 #pragma once
-#include "packet_base.h"
+#include "packet_fields.h"
 
 /*
 	Allowed types for members:
@@ -14,44 +14,40 @@
 	std::vector< base_types >
 	std::vector< std::string >
 
-	Any other combination should not be used, unless you add it to binary_serializer.
+	views into the receive buffer, no allocations but only valid while the packet is handled:
+	std::string_view, fi::bytes_view, fi::array_view< base_types >, fi::string_view_list
+
+	Packets with static constexpr bool compact = true write integers and lengths as varints,
+	they can't borrow integers with fi::array_view.
+
+	Any other combination should not be used, unless you add it to binary_serializer and packet_reader.
 	Remember to use platform-independent types (base_types, cstdint.h)
 	to make sure everything works fine across different architectures.
 */
 
 namespace fi::packets {
-	class example_packet : public base_packet {
+	// List the members with FI_PACKET_FIELDS and you're done: encoding, decoding and
+	// sizing are generated from that list, without a base class or any virtual calls.
+	// Packets based off base_packet with their own serialize/deserialize work too.
+	class example_packet {
 	public:
+		// Lets handlers registered with on< example_packet > find us at compile time
+		static constexpr packet_id id = ids::id_example;
+
 		// If you want to, you can implement a custom constructor for your members,
 		// but it is not needed.
 		example_packet( ) { }
 
-		example_packet( detail::binary_serializer& s ) {
-			deserialize( s );
-		}
-
-		virtual void serialize( detail::binary_serializer& s ) {
-			// Serialize our items here
-			s.serialize( some_short );
-			s.serialize( some_array );
-			s.serialize( some_string_array );
-		}
-
-		virtual void deserialize( detail::binary_serializer& s ) {
-			// Deserialize our items here.
-			// IMPORTANT: Deserialize them in the same order you serialized them in!
-			s.deserialize( some_short );
-			s.deserialize( some_array );
-			s.deserialize( some_string_array );
-		}
-	
-		virtual packet_id get_id( ) {
-			return ids::id_example;
+		example_packet( detail::packet_reader& r ) {
+			detail::read_packet( r, *this );
 		}
 
 		// Make your members public to be able to access them.
 		std::uint16_t some_short = 0;
 		std::vector< std::uint8_t > some_array = { };
 		std::vector< std::string > some_string_array = { };
+
+		// They go over the wire in this order
+		FI_PACKET_FIELDS( some_short, some_array, some_string_array )
 	};
 }
\ No newline at end of file
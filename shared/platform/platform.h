@@ -0,0 +1,155 @@
+#pragma once
+
+#ifdef _WIN32	// Windows Machine
+
+#include <WinSock2.h>
+#include <WS2tcpip.h>
+
+#pragma comment(lib, "ws2_32.lib")
+
+#define SOCKET_SEND_FLAGS	0
+
+#elif __linux__	// Linux machine
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/ioctl.h>
+#include <sys/uio.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <netdb.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <poll.h>
+
+// Map the WinSock names we use onto their BSD counterparts
+typedef int SOCKET;
+
+#define INVALID_SOCKET		( -1 )
+#define SOCKET_ERROR		( -1 )
+
+#define SD_SEND				SHUT_WR
+#define SD_BOTH				SHUT_RDWR
+
+#define closesocket			close
+
+// Writing to a socket the peer has closed must not raise SIGPIPE
+#define SOCKET_SEND_FLAGS	MSG_NOSIGNAL
+
+#else
+#error OS unknown or not supported.
+#endif // _WIN32
+
+#include <cerrno>
+#include <cstring>
+
+namespace fi::detail {
+	inline bool set_non_blocking( SOCKET s ) {
+	#ifdef _WIN32
+		unsigned long mode = 1;
+		return ioctlsocket( s, FIONBIO, &mode ) == 0;
+	#else
+		int flags = fcntl( s, F_GETFL, 0 );
+		return flags != -1 && fcntl( s, F_SETFL, flags | O_NONBLOCK ) != -1;
+	#endif // _WIN32
+	}
+
+	// Accepts a pending connection and hands it back non-blocking
+	inline SOCKET accept_non_blocking( SOCKET listener ) {
+	#ifdef _WIN32
+		SOCKET s = accept( listener, nullptr, nullptr );
+
+		if ( s != INVALID_SOCKET && !set_non_blocking( s ) ) {
+			closesocket( s );
+			return INVALID_SOCKET;
+		}
+
+		return s;
+	#else
+		return accept4( listener, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC );
+	#endif // _WIN32
+	}
+
+	// Whether the last socket call failed only because it would have blocked
+	inline bool would_block( ) {
+	#ifdef _WIN32
+		return WSAGetLastError( ) == WSAEWOULDBLOCK;
+	#else
+		return errno == EAGAIN || errno == EWOULDBLOCK;
+	#endif // _WIN32
+	}
+
+	inline bool interrupted( ) {
+	#ifdef _WIN32
+		return WSAGetLastError( ) == WSAEINTR;
+	#else
+		return errno == EINTR;
+	#endif // _WIN32
+	}
+
+	// The peer gave up on a connection before we got around to accepting it
+	inline bool connection_aborted( ) {
+	#ifdef _WIN32
+		return WSAGetLastError( ) == WSAECONNRESET;
+	#else
+		return errno == ECONNABORTED;
+	#endif // _WIN32
+	}
+
+	// We (or the whole system) ran out of descriptors or socket buffers
+	inline bool out_of_descriptors( int error ) {
+	#ifdef _WIN32
+		return error == WSAEMFILE || error == WSAENOBUFS;
+	#else
+		return error == EMFILE || error == ENFILE || error == ENOBUFS || error == ENOMEM;
+	#endif // _WIN32
+	}
+
+	inline bool out_of_descriptors( ) {
+	#ifdef _WIN32
+		return out_of_descriptors( WSAGetLastError( ) );
+	#else
+		return out_of_descriptors( errno );
+	#endif // _WIN32
+	}
+
+	// A non-blocking connect that's still underway
+	inline bool connect_in_progress( ) {
+	#ifdef _WIN32
+		return WSAGetLastError( ) == WSAEWOULDBLOCK;
+	#else
+		return errno == EINPROGRESS;
+	#endif // _WIN32
+	}
+
+	// The socket's pending error, which is how a non-blocking connect turned out
+	inline int socket_error( SOCKET s ) {
+		int error = 0;
+		socklen_t length = sizeof( error );
+
+		if ( getsockopt( s, SOL_SOCKET, SO_ERROR, reinterpret_cast< char* >( &error ), &length ) == SOCKET_ERROR )
+			return -1;
+
+		return error;
+	}
+
+	// Blocks until a non-blocking socket can be written to again.
+	// A negative timeout waits indefinitely.
+	inline bool wait_writable( SOCKET s, int timeout_ms ) {
+	#ifdef _WIN32
+		WSAPOLLFD fd = { s, POLLWRNORM, 0 };
+		return WSAPoll( &fd, 1, timeout_ms ) > 0 && !( fd.revents & ( POLLERR | POLLHUP | POLLNVAL ) );
+	#else
+		pollfd fd = { s, POLLOUT, 0 };
+
+		int result = 0;
+		do {
+			result = poll( &fd, 1, timeout_ms );
+		} while ( result < 0 && errno == EINTR );
+
+		return result > 0 && !( fd.revents & ( POLLERR | POLLHUP | POLLNVAL ) );
+	#endif // _WIN32
+	}
+} // namespace fi::detail
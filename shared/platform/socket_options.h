@@ -0,0 +1,110 @@
+#pragma once
+#include "platform.h"
+
+#include <cstdint>
+#include <vector>
+#include <thread>
+
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#endif // __linux__
+
+namespace fi {
+	// How client and server set up their sockets and loop threads. Zeros and empty
+	// lists leave the OS defaults alone.
+	struct socket_options {
+		// Sends small packets right away rather than holding them back until everything
+		// before them got acked (Nagle). We gather packets into a single write ourselves,
+		// so Nagle only ever adds latency: a packet queued right behind the handshake
+		// would wait for the other side's delayed ack.
+		bool no_delay = true;
+
+		// Acks everything right away rather than waiting to piggyback the ack onto an
+		// answer. The kernel drops back to delayed acks on its own, so we set it again
+		// after every receive. Linux only.
+		bool quick_ack = false;
+
+		// Microseconds the kernel busy polls the device queue for new data before
+		// sleeping on a receive. Linux only, raising it above net.core.busy_read
+		// needs CAP_NET_ADMIN.
+		std::uint32_t busy_poll = 0;
+
+		// Kernel socket buffer sizes in bytes. They also decide the TCP window
+		// scale, so they're set before connecting or listening.
+		std::uint32_t receive_buffer = 0, send_buffer = 0;
+
+		// CPUs the loop threads get pinned to, thread i runs on cpu_affinity[ i % size ]
+		std::vector< std::uint32_t > cpu_affinity = { };
+
+		// Trades a few more packets and some CPU for latency. Pin the loop threads
+		// yourself, which CPUs to use depends on the machine.
+		static socket_options latency( ) {
+			socket_options options = { };
+			options.no_delay = true;
+			options.quick_ack = true;
+			options.busy_poll = 50;
+
+			return options;
+		}
+	};
+} // namespace fi
+
+namespace fi::detail {
+	// Everything but the CPU affinity, returns false if the OS refused any of it
+	inline bool apply_socket_options( SOCKET s, const socket_options& options ) {
+		auto set = [ s ]( int level, int name, int value ) {
+			return setsockopt( s, level, name, reinterpret_cast< const char* >( &value ), sizeof( value ) ) != SOCKET_ERROR;
+		};
+
+		bool success = true;
+
+		if ( options.no_delay )
+			success &= set( IPPROTO_TCP, TCP_NODELAY, 1 );
+
+		if ( options.receive_buffer )
+			success &= set( SOL_SOCKET, SO_RCVBUF, int( options.receive_buffer ) );
+
+		if ( options.send_buffer )
+			success &= set( SOL_SOCKET, SO_SNDBUF, int( options.send_buffer ) );
+
+	#ifdef __linux__
+		if ( options.quick_ack )
+			success &= set( IPPROTO_TCP, TCP_QUICKACK, 1 );
+
+		if ( options.busy_poll )
+			success &= set( SOL_SOCKET, SO_BUSY_POLL, int( options.busy_poll ) );
+	#endif // __linux__
+
+		return success;
+	}
+
+	// TCP_QUICKACK only lasts until the kernel decides otherwise, callers set it again after receiving
+	inline void quick_ack( SOCKET s ) {
+	#ifdef __linux__
+		int enable = 1;
+		setsockopt( s, IPPROTO_TCP, TCP_QUICKACK, &enable, sizeof( enable ) );
+	#endif // __linux__
+	}
+
+	// Pins the index-th of a set of loop threads, false if the OS refused
+	inline bool pin_thread( std::thread& thread, const std::vector< std::uint32_t >& cpus, std::size_t index ) {
+		if ( cpus.empty( ) )
+			return true;
+
+		auto cpu = cpus[ index % cpus.size( ) ];
+
+	#ifdef _WIN32
+		return cpu < 64 && SetThreadAffinityMask( thread.native_handle( ), DWORD_PTR( 1 ) << cpu ) != 0;
+	#else
+		if ( cpu >= CPU_SETSIZE )
+			return false;
+
+		cpu_set_t set;
+		CPU_ZERO( &set );
+		CPU_SET( cpu, &set );
+
+		return pthread_setaffinity_np( thread.native_handle( ), sizeof( set ), &set ) == 0;
+	#endif // _WIN32
+	}
+} // namespace fi::detail
@@ -0,0 +1,11 @@
+#pragma once
+#include "reactor.h"
+#include "uring.h"
+
+namespace fi {
+	// Selects how client and server talk to the OS
+	enum class io_engine : std::uint8_t {
+		reactor = 0,	// Readiness based (epoll on Linux, WSAPoll on Windows)
+		uring			// Completion based io_uring, Linux 6.0+ only
+	};
+} // namespace fi
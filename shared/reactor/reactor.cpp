@@ -0,0 +1,239 @@
+#include "reactor.h"
+
+#include <thread>
+#include <chrono>
+#include <algorithm>
+
+using namespace fi::detail;
+
+// Token reserved for our wakeup descriptor
+constexpr std::uint64_t wake_token = ~0ull;
+
+reactor::~reactor( ) {
+	destroy( );
+}
+
+#ifdef __linux__
+
+static std::uint32_t to_epoll_events( std::uint32_t events ) {
+	std::uint32_t result = EPOLLET | EPOLLRDHUP;
+
+	if ( events & reactor::ev_read )
+		result |= EPOLLIN;
+
+	if ( events & reactor::ev_write )
+		result |= EPOLLOUT;
+
+	return result;
+}
+
+bool reactor::create( ) {
+	if ( epoll_fd_ != -1 )
+		return true;
+
+	epoll_fd_ = epoll_create1( EPOLL_CLOEXEC );
+	wake_fd_ = eventfd( 0, EFD_NONBLOCK | EFD_CLOEXEC );
+
+	if ( epoll_fd_ == -1 || wake_fd_ == -1 ) {
+		destroy( );
+		return false;
+	}
+
+	// The wakeup descriptor is level-triggered, we only reset it when we feel like it
+	epoll_event ev = { };
+	ev.events = EPOLLIN;
+	ev.data.u64 = wake_token;
+
+	if ( epoll_ctl( epoll_fd_, EPOLL_CTL_ADD, wake_fd_, &ev ) == -1 ) {
+		destroy( );
+		return false;
+	}
+
+	return true;
+}
+
+void reactor::destroy( ) {
+	if ( wake_fd_ != -1 )
+		close( wake_fd_ );
+
+	if ( epoll_fd_ != -1 )
+		close( epoll_fd_ );
+
+	wake_fd_ = epoll_fd_ = -1;
+}
+
+bool reactor::add( SOCKET s, std::uint64_t token, std::uint32_t events ) {
+	epoll_event ev = { };
+	ev.events = to_epoll_events( events );
+	ev.data.u64 = token;
+
+	return epoll_ctl( epoll_fd_, EPOLL_CTL_ADD, s, &ev ) != -1;
+}
+
+bool reactor::modify( SOCKET s, std::uint64_t token, std::uint32_t events ) {
+	epoll_event ev = { };
+	ev.events = to_epoll_events( events );
+	ev.data.u64 = token;
+
+	return epoll_ctl( epoll_fd_, EPOLL_CTL_MOD, s, &ev ) != -1;
+}
+
+void reactor::remove( SOCKET s ) {
+	epoll_ctl( epoll_fd_, EPOLL_CTL_DEL, s, nullptr );
+}
+
+std::size_t reactor::wait( std::vector< event >& out, int timeout_ms ) {
+	epoll_events_.resize( out.size( ) );
+
+	int num_events = epoll_wait( epoll_fd_, epoll_events_.data( ), int( epoll_events_.size( ) ), timeout_ms );
+
+	if ( num_events <= 0 )
+		return 0;
+
+	std::size_t written = 0;
+	for ( int i = 0; i < num_events; i++ ) {
+		auto& ev = epoll_events_[ i ];
+
+		if ( ev.data.u64 == wake_token ) {
+			std::uint64_t value = 0;
+			read( wake_fd_, &value, sizeof( value ) );
+			continue;
+		}
+
+		std::uint32_t events = ev_none;
+
+		if ( ev.events & EPOLLIN )
+			events |= ev_read;
+
+		if ( ev.events & EPOLLOUT )
+			events |= ev_write;
+
+		if ( ev.events & ( EPOLLHUP | EPOLLRDHUP | EPOLLERR ) )
+			events |= ev_close;
+
+		out[ written++ ] = { ev.data.u64, events };
+	}
+
+	return written;
+}
+
+void reactor::wake( ) {
+	std::uint64_t value = 1;
+	write( wake_fd_, &value, sizeof( value ) );
+}
+
+#else
+
+// WSAPoll cannot be interrupted, so we cap how long a single wait may take
+constexpr int max_poll_timeout_ms = 1;
+
+static short to_poll_events( std::uint32_t events ) {
+	short result = 0;
+
+	if ( events & reactor::ev_read )
+		result |= POLLRDNORM;
+
+	if ( events & reactor::ev_write )
+		result |= POLLWRNORM;
+
+	return result;
+}
+
+bool reactor::create( ) {
+	return true;
+}
+
+void reactor::destroy( ) {
+	std::lock_guard guard( mtx_ );
+
+	poll_fds_.clear( );
+	poll_tokens_.clear( );
+}
+
+bool reactor::add( SOCKET s, std::uint64_t token, std::uint32_t events ) {
+	std::lock_guard guard( mtx_ );
+
+	poll_fds_.push_back( { s, to_poll_events( events ), 0 } );
+	poll_tokens_.push_back( token );
+
+	return true;
+}
+
+bool reactor::modify( SOCKET s, std::uint64_t token, std::uint32_t events ) {
+	std::lock_guard guard( mtx_ );
+
+	for ( std::size_t i = 0; i < poll_fds_.size( ); i++ ) {
+		if ( poll_fds_[ i ].fd != s )
+			continue;
+
+		poll_fds_[ i ].events = to_poll_events( events );
+		poll_tokens_[ i ] = token;
+		return true;
+	}
+
+	return false;
+}
+
+void reactor::remove( SOCKET s ) {
+	std::lock_guard guard( mtx_ );
+
+	for ( std::size_t i = 0; i < poll_fds_.size( ); i++ ) {
+		if ( poll_fds_[ i ].fd != s )
+			continue;
+
+		poll_fds_.erase( poll_fds_.begin( ) + i );
+		poll_tokens_.erase( poll_tokens_.begin( ) + i );
+		return;
+	}
+}
+
+std::size_t reactor::wait( std::vector< event >& out, int timeout_ms ) {
+	std::vector< WSAPOLLFD > fds = { };
+	std::vector< std::uint64_t > tokens = { };
+
+	{
+		std::lock_guard guard( mtx_ );
+		fds = poll_fds_;
+		tokens = poll_tokens_;
+	}
+
+	int timeout = timeout_ms < 0 ? max_poll_timeout_ms : std::min( timeout_ms, max_poll_timeout_ms );
+
+	// WSAPoll refuses to wait on an empty set
+	if ( fds.empty( ) ) {
+		std::this_thread::sleep_for( std::chrono::milliseconds( timeout ) );
+		return 0;
+	}
+
+	if ( WSAPoll( fds.data( ), ULONG( fds.size( ) ), timeout ) <= 0 )
+		return 0;
+
+	std::size_t written = 0;
+	for ( std::size_t i = 0; i < fds.size( ) && written < out.size( ); i++ ) {
+		auto revents = fds[ i ].revents;
+
+		if ( !revents )
+			continue;
+
+		std::uint32_t events = ev_none;
+
+		if ( revents & POLLRDNORM )
+			events |= ev_read;
+
+		if ( revents & POLLWRNORM )
+			events |= ev_write;
+
+		if ( revents & ( POLLHUP | POLLERR | POLLNVAL ) )
+			events |= ev_close;
+
+		out[ written++ ] = { tokens[ i ], events };
+	}
+
+	return written;
+}
+
+void reactor::wake( ) {
+	// Nothing to do, waits never exceed max_poll_timeout_ms
+}
+
+#endif // __linux__
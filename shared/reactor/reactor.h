@@ -0,0 +1,59 @@
+#pragma once
+#include "../platform/platform.h"
+
+#include <cstdint>
+#include <vector>
+#include <mutex>
+
+namespace fi::detail {
+	// Thin wrapper around the OS readiness API. On Linux this is an edge-triggered
+	// epoll instance, so callers have to drain a socket until it would block.
+	// Windows has no edge-triggered equivalent and falls back to WSAPoll.
+	class reactor {
+	public:
+		enum events : std::uint32_t {
+			ev_none		= 0,
+			ev_read		= ( 1 << 0 ),
+			ev_write	= ( 1 << 1 ),
+			ev_close	= ( 1 << 2 )	// Peer hung up or the socket errored
+		};
+
+		struct event {
+			std::uint64_t token = 0;
+			std::uint32_t events = ev_none;
+		};
+
+		reactor( ) { }
+		~reactor( );
+
+		reactor( const reactor& ) = delete;
+		reactor& operator=( const reactor& ) = delete;
+
+		bool create( );
+		void destroy( );
+
+		// Sockets are reported back with a token of the caller's choosing
+		bool add( SOCKET s, std::uint64_t token, std::uint32_t events );
+		bool modify( SOCKET s, std::uint64_t token, std::uint32_t events );
+		void remove( SOCKET s );
+
+		// Waits for events and returns how many were written to out.
+		// A negative timeout waits indefinitely.
+		std::size_t wait( std::vector< event >& out, int timeout_ms );
+
+		// Interrupts a thread blocked in wait
+		void wake( );
+
+	private:
+	#ifdef __linux__
+		int epoll_fd_ = -1, wake_fd_ = -1;
+
+		std::vector< epoll_event > epoll_events_ = { };
+	#else
+		std::mutex mtx_ = { };
+
+		std::vector< WSAPOLLFD > poll_fds_ = { };
+		std::vector< std::uint64_t > poll_tokens_ = { };
+	#endif // __linux__
+	};
+} // namespace fi::detail
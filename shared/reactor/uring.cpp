@@ -0,0 +1,492 @@
+#include "uring.h"
+
+using namespace fi::detail;
+
+#ifdef __linux__
+
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#include <atomic>
+#include <cerrno>
+#include <cstddef>
+#include <algorithm>
+
+// Buffer group all our multishot receives pick from
+constexpr std::uint16_t buffer_group = 0;
+
+// The upper byte of user_data holds the operation, the rest is the caller's data
+static std::uint64_t encode_user_data( uring::op type, std::uint64_t data ) {
+	return ( std::uint64_t( type ) << 56 ) | ( data & 0x00FFFFFFFFFFFFFFull );
+}
+
+static unsigned load_acquire( unsigned* p ) {
+	return std::atomic_ref< unsigned >( *p ).load( std::memory_order_acquire );
+}
+
+static void store_release( unsigned* p, unsigned value ) {
+	std::atomic_ref< unsigned >( *p ).store( value, std::memory_order_release );
+}
+
+uring::~uring( ) {
+	destroy( );
+}
+
+bool uring::create( std::uint32_t entries, std::uint16_t buffer_count, std::uint32_t buffer_size ) {
+	if ( ring_fd_ != -1 )
+		return true;
+
+	// The kernel indexes the buffer ring with a mask
+	if ( !buffer_count || ( buffer_count & ( buffer_count - 1 ) ) )
+		return false;
+
+	io_uring_params params = { };
+
+	ring_fd_ = int( syscall( __NR_io_uring_setup, entries, &params ) );
+
+	if ( ring_fd_ < 0 ) {
+		ring_fd_ = -1;
+		return false;
+	}
+
+	// Older kernels are missing things we rely on
+	if ( !( params.features & IORING_FEAT_SINGLE_MMAP ) || !( params.features & IORING_FEAT_EXT_ARG ) ) {
+		destroy( );
+		return false;
+	}
+
+	ring_size_ = std::max(
+		params.sq_off.array + params.sq_entries * sizeof( unsigned ),
+		params.cq_off.cqes + params.cq_entries * sizeof( io_uring_cqe )
+	);
+
+	ring_ = mmap( nullptr, ring_size_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd_, IORING_OFF_SQ_RING );
+
+	if ( ring_ == MAP_FAILED ) {
+		ring_ = nullptr;
+		destroy( );
+		return false;
+	}
+
+	sqes_size_ = params.sq_entries * sizeof( io_uring_sqe );
+	sqes_ = reinterpret_cast< io_uring_sqe* >( mmap( nullptr, sqes_size_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd_, IORING_OFF_SQES ) );
+
+	if ( sqes_ == MAP_FAILED ) {
+		sqes_ = nullptr;
+		destroy( );
+		return false;
+	}
+
+	auto ring = reinterpret_cast< std::uint8_t* >( ring_ );
+
+	sq_head_ = reinterpret_cast< unsigned* >( ring + params.sq_off.head );
+	sq_tail_ = reinterpret_cast< unsigned* >( ring + params.sq_off.tail );
+	sq_array_ = reinterpret_cast< unsigned* >( ring + params.sq_off.array );
+	sq_mask_ = *reinterpret_cast< unsigned* >( ring + params.sq_off.ring_mask );
+	sq_entries_ = params.sq_entries;
+
+	cq_head_ = reinterpret_cast< unsigned* >( ring + params.cq_off.head );
+	cq_tail_ = reinterpret_cast< unsigned* >( ring + params.cq_off.tail );
+	cqes_ = reinterpret_cast< io_uring_cqe* >( ring + params.cq_off.cqes );
+	cq_mask_ = *reinterpret_cast< unsigned* >( ring + params.cq_off.ring_mask );
+
+	sqe_head_ = sqe_tail_ = *sq_tail_;
+
+	// Register the ring of buffers our multishot receives pick from
+	buffer_ring_size_ = buffer_count * sizeof( io_uring_buf );
+	buffer_ring_ = reinterpret_cast< io_uring_buf* >( mmap( nullptr, buffer_ring_size_, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0 ) );
+
+	if ( buffer_ring_ == MAP_FAILED ) {
+		buffer_ring_ = nullptr;
+		destroy( );
+		return false;
+	}
+
+	io_uring_buf_reg reg = { };
+	reg.ring_addr = reinterpret_cast< std::uint64_t >( buffer_ring_ );
+	reg.ring_entries = buffer_count;
+	reg.bgid = buffer_group;
+
+	if ( syscall( __NR_io_uring_register, ring_fd_, IORING_REGISTER_PBUF_RING, &reg, 1 ) < 0 ) {
+		destroy( );
+		return false;
+	}
+
+	buffer_size_ = buffer_size;
+	buffer_mask_ = buffer_count - 1;
+	buffer_tail_ = 0;
+	buffers_.resize( std::size_t( buffer_count ) * buffer_size );
+
+	for ( std::uint32_t i = 0; i < buffer_count; i++ )
+		recycle_buffer( std::uint16_t( i ) );
+
+	// Kernels before 6.0 have everything we checked so far, but no multishot receives
+	if ( !probe_recv_multishot( ) ) {
+		destroy( );
+		return false;
+	}
+
+	// eventfd we can poke to interrupt a wait. It has to be blocking, otherwise
+	// io_uring would fail our read instead of waiting for it to become readable.
+	wake_fd_ = eventfd( 0, EFD_CLOEXEC );
+
+	if ( wake_fd_ == -1 ) {
+		destroy( );
+		return false;
+	}
+
+	arm_wake( );
+
+	return true;
+}
+
+void uring::destroy( ) {
+	// Closing the ring cancels everything that's still in flight
+	if ( ring_fd_ != -1 )
+		close( ring_fd_ );
+
+	if ( wake_fd_ != -1 )
+		close( wake_fd_ );
+
+	if ( sqes_ )
+		munmap( sqes_, sqes_size_ );
+
+	if ( ring_ )
+		munmap( ring_, ring_size_ );
+
+	if ( buffer_ring_ )
+		munmap( buffer_ring_, buffer_ring_size_ );
+
+	ring_fd_ = wake_fd_ = -1;
+	wake_armed_ = false;
+	sqes_ = nullptr;
+	ring_ = nullptr;
+	buffer_ring_ = nullptr;
+
+	buffers_.clear( );
+	buffers_.shrink_to_fit( );
+}
+
+bool uring::accept_multishot( SOCKET listener, std::uint64_t data ) {
+	auto sqe = get_sqe( );
+
+	if ( !sqe )
+		return false;
+
+	sqe->opcode = IORING_OP_ACCEPT;
+	sqe->fd = listener;
+	sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+	sqe->user_data = encode_user_data( op::accept, data );
+
+	return true;
+}
+
+bool uring::recv_multishot( SOCKET s, std::uint64_t data ) {
+	auto sqe = get_sqe( );
+
+	if ( !sqe )
+		return false;
+
+	sqe->opcode = IORING_OP_RECV;
+	sqe->fd = s;
+	sqe->ioprio = IORING_RECV_MULTISHOT;
+	sqe->flags = IOSQE_BUFFER_SELECT;
+	sqe->buf_group = buffer_group;
+	sqe->user_data = encode_user_data( op::recv, data );
+
+	return true;
+}
+
+bool uring::send( SOCKET s, const void* buffer, std::uint32_t length, std::uint64_t data ) {
+	auto sqe = get_sqe( );
+
+	if ( !sqe )
+		return false;
+
+	sqe->opcode = IORING_OP_SEND;
+	sqe->fd = s;
+	sqe->addr = reinterpret_cast< std::uint64_t >( buffer );
+	sqe->len = length;
+	sqe->msg_flags = MSG_NOSIGNAL | MSG_WAITALL;
+	sqe->user_data = encode_user_data( op::send, data );
+
+	return true;
+}
+
+bool uring::send_message( SOCKET s, const msghdr* message, std::uint64_t data ) {
+	auto sqe = get_sqe( );
+
+	if ( !sqe )
+		return false;
+
+	sqe->opcode = IORING_OP_SENDMSG;
+	sqe->fd = s;
+	sqe->addr = reinterpret_cast< std::uint64_t >( message );
+	sqe->len = 1;
+	sqe->msg_flags = MSG_NOSIGNAL | MSG_WAITALL;
+	sqe->user_data = encode_user_data( op::send, data );
+
+	return true;
+}
+
+bool uring::connect( SOCKET s, const sockaddr* address, std::uint32_t length, std::uint64_t data ) {
+	auto sqe = get_sqe( );
+
+	if ( !sqe )
+		return false;
+
+	sqe->opcode = IORING_OP_CONNECT;
+	sqe->fd = s;
+	sqe->addr = reinterpret_cast< std::uint64_t >( address );
+	sqe->off = length;
+	sqe->user_data = encode_user_data( op::connect, data );
+
+	return true;
+}
+
+bool uring::cancel( op type, std::uint64_t data ) {
+	auto sqe = get_sqe( );
+
+	if ( !sqe )
+		return false;
+
+	sqe->opcode = IORING_OP_ASYNC_CANCEL;
+	sqe->fd = -1;
+	sqe->addr = encode_user_data( type, data );
+	sqe->user_data = encode_user_data( op::cancel, data );
+
+	return true;
+}
+
+const std::uint8_t* uring::buffer( std::uint16_t id ) const {
+	return buffers_.data( ) + std::size_t( id ) * buffer_size_;
+}
+
+void uring::recycle_buffer( std::uint16_t id ) {
+	auto& buf = buffer_ring_[ buffer_tail_ & buffer_mask_ ];
+
+	buf.addr = reinterpret_cast< std::uint64_t >( buffers_.data( ) + std::size_t( id ) * buffer_size_ );
+	buf.len = buffer_size_;
+	buf.bid = id;
+
+	buffer_tail_++;
+
+	// The ring tail overlays the reserved field of the first entry
+	auto tail = reinterpret_cast< std::uint16_t* >( reinterpret_cast< std::uint8_t* >( buffer_ring_ ) + offsetof( io_uring_buf, resv ) );
+	std::atomic_ref< std::uint16_t >( *tail ).store( buffer_tail_, std::memory_order_release );
+}
+
+void uring::submit_and_wait( int timeout_ms ) {
+	// Rearming failed last time around, a wake would go unnoticed without it
+	if ( !wake_armed_ )
+		arm_wake( );
+
+	unsigned to_submit = flush( );
+
+	// Don't bother waiting if there's completions ready for us
+	bool wait = load_acquire( cq_tail_ ) == *cq_head_;
+
+	unsigned flags = wait ? IORING_ENTER_GETEVENTS : 0;
+
+	if ( !to_submit && !wait )
+		return;
+
+	__kernel_timespec ts = { };
+	io_uring_getevents_arg arg = { };
+
+	void* enter_arg = nullptr;
+	std::size_t enter_arg_size = 0;
+
+	if ( wait && timeout_ms >= 0 ) {
+		ts.tv_sec = timeout_ms / 1000;
+		ts.tv_nsec = ( timeout_ms % 1000 ) * 1000000ll;
+
+		arg.ts = reinterpret_cast< std::uint64_t >( &ts );
+
+		flags |= IORING_ENTER_EXT_ARG;
+		enter_arg = &arg;
+		enter_arg_size = sizeof( arg );
+	}
+
+	// Errors here are EINTR/ETIME/EBUSY, all of which just mean "check your completions"
+	syscall( __NR_io_uring_enter, ring_fd_, to_submit, wait ? 1 : 0, flags, enter_arg, enter_arg_size );
+}
+
+std::size_t uring::completions( std::vector< completion >& out ) {
+	unsigned head = *cq_head_;
+	unsigned tail = load_acquire( cq_tail_ );
+
+	std::size_t written = 0;
+	for ( ; head != tail && written < out.size( ); head++ ) {
+		auto& cqe = cqes_[ head & cq_mask_ ];
+
+		auto type = static_cast< op >( cqe.user_data >> 56 );
+
+		if ( type == op::wake ) {
+			wake_armed_ = false;
+			arm_wake( );
+			continue;
+		}
+
+		auto& c = out[ written++ ];
+
+		c.type = type;
+		c.data = cqe.user_data & 0x00FFFFFFFFFFFFFFull;
+		c.result = cqe.res;
+		c.more = cqe.flags & IORING_CQE_F_MORE;
+		c.has_buffer = cqe.flags & IORING_CQE_F_BUFFER;
+		c.buffer_id = std::uint16_t( cqe.flags >> IORING_CQE_BUFFER_SHIFT );
+	}
+
+	store_release( cq_head_, head );
+
+	return written;
+}
+
+void uring::wake( ) {
+	// Rings that were never created (or already destroyed) have nobody to wake
+	if ( wake_fd_ == -1 )
+		return;
+
+	std::uint64_t value = 1;
+	write( wake_fd_, &value, sizeof( value ) );
+}
+
+io_uring_sqe* uring::get_sqe( ) {
+	// Hand our queued requests to the kernel if we ran out of space
+	if ( sqe_tail_ - load_acquire( sq_head_ ) >= sq_entries_ ) {
+		syscall( __NR_io_uring_enter, ring_fd_, flush( ), 0, 0, nullptr, 0 );
+
+		if ( sqe_tail_ - load_acquire( sq_head_ ) >= sq_entries_ )
+			return nullptr;
+	}
+
+	auto sqe = &sqes_[ sqe_tail_++ & sq_mask_ ];
+	memset( sqe, 0, sizeof( io_uring_sqe ) );
+
+	return sqe;
+}
+
+unsigned uring::flush( ) {
+	unsigned tail = *sq_tail_;
+	unsigned to_submit = sqe_tail_ - sqe_head_;
+
+	for ( ; sqe_head_ != sqe_tail_; sqe_head_++, tail++ )
+		sq_array_[ tail & sq_mask_ ] = sqe_head_ & sq_mask_;
+
+	store_release( sq_tail_, tail );
+
+	return to_submit;
+}
+
+bool uring::probe_recv_multishot( ) {
+	int fds[ 2 ] = { -1, -1 };
+
+	if ( socketpair( AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, fds ) == -1 )
+		return false;
+
+	// Waits for the next completion and takes it off the queue
+	auto next_completion = [ & ]( io_uring_cqe& cqe ) {
+		while ( load_acquire( cq_tail_ ) == *cq_head_ ) {
+			if ( syscall( __NR_io_uring_enter, ring_fd_, flush( ), 1, IORING_ENTER_GETEVENTS, nullptr, 0 ) < 0 && errno != EINTR )
+				return false;
+		}
+
+		cqe = cqes_[ *cq_head_ & cq_mask_ ];
+		store_release( cq_head_, *cq_head_ + 1 );
+
+		return true;
+	};
+
+	// Older kernels fail the receive right away, newer ones hand us the byte and keep it armed
+	char byte = 0;
+	io_uring_cqe cqe = { };
+
+	bool supported = ::send( fds[ 1 ], &byte, 1, MSG_NOSIGNAL ) == 1 && recv_multishot( fds[ 0 ], 0 ) && next_completion( cqe )
+		&& cqe.res == 1 && ( cqe.flags & IORING_CQE_F_MORE );
+
+	if ( cqe.flags & IORING_CQE_F_BUFFER )
+		recycle_buffer( std::uint16_t( cqe.flags >> IORING_CQE_BUFFER_SHIFT ) );
+
+	// Closing the other end ends the receive, we wait for that so it can't show up later on
+	close( fds[ 1 ] );
+
+	while ( supported && ( cqe.flags & IORING_CQE_F_MORE ) ) {
+		if ( !next_completion( cqe ) ) {
+			supported = false;
+			break;
+		}
+
+		if ( cqe.flags & IORING_CQE_F_BUFFER )
+			recycle_buffer( std::uint16_t( cqe.flags >> IORING_CQE_BUFFER_SHIFT ) );
+	}
+
+	close( fds[ 0 ] );
+
+	return supported;
+}
+
+void uring::arm_wake( ) {
+	auto sqe = get_sqe( );
+
+	if ( !sqe )
+		return;
+
+	sqe->opcode = IORING_OP_READ;
+	sqe->fd = wake_fd_;
+	sqe->addr = reinterpret_cast< std::uint64_t >( &wake_value_ );
+	sqe->len = sizeof( wake_value_ );
+	sqe->user_data = encode_user_data( op::wake, 0 );
+
+	wake_armed_ = true;
+}
+
+#else
+
+uring::~uring( ) { }
+
+// io_uring is Linux only, creation always fails elsewhere
+bool uring::create( std::uint32_t entries, std::uint16_t buffer_count, std::uint32_t buffer_size ) {
+	return false;
+}
+
+void uring::destroy( ) { }
+
+bool uring::accept_multishot( SOCKET listener, std::uint64_t data ) {
+	return false;
+}
+
+bool uring::recv_multishot( SOCKET s, std::uint64_t data ) {
+	return false;
+}
+
+bool uring::send( SOCKET s, const void* buffer, std::uint32_t length, std::uint64_t data ) {
+	return false;
+}
+
+bool uring::send_message( SOCKET s, const msghdr* message, std::uint64_t data ) {
+	return false;
+}
+
+bool uring::connect( SOCKET s, const sockaddr* address, std::uint32_t length, std::uint64_t data ) {
+	return false;
+}
+
+bool uring::cancel( op type, std::uint64_t data ) {
+	return false;
+}
+
+const std::uint8_t* uring::buffer( std::uint16_t id ) const {
+	return nullptr;
+}
+
+void uring::recycle_buffer( std::uint16_t id ) { }
+void uring::submit_and_wait( int timeout_ms ) { }
+
+std::size_t uring::completions( std::vector< completion >& out ) {
+	return 0;
+}
+
+void uring::wake( ) { }
+
+#endif // __linux__
@@ -0,0 +1,130 @@
+#pragma once
+#include "../platform/platform.h"
+
+#include <cstdint>
+#include <vector>
+
+#ifdef __linux__
+#include <linux/io_uring.h>
+#else
+struct msghdr;
+#endif // __linux__
+
+namespace fi::detail {
+	// Minimal io_uring wrapper. We talk to the kernel directly so we don't pull in liburing.
+	// Everything except wake must be called from the thread that drives the ring.
+	// Needs Linux 6.0 or newer (multishot recv, provided buffer rings); create fails otherwise.
+	class uring {
+	public:
+		enum class op : std::uint8_t {
+			none = 0,
+			wake,
+			accept,
+			recv,
+			send,
+			connect,
+			cancel
+		};
+
+		struct completion {
+			op type = op::none;
+
+			// Whatever the caller passed along when queueing the request
+			std::uint64_t data = 0;
+
+			// Same meaning as the return value of the matching syscall, negative errno on failure
+			std::int32_t result = 0;
+
+			// Set if the kernel will post more completions for this (multishot) request
+			bool more = false;
+
+			// Provided buffer the kernel received into, if any
+			bool has_buffer = false;
+			std::uint16_t buffer_id = 0;
+		};
+
+		uring( ) { }
+		~uring( );
+
+		uring( const uring& ) = delete;
+		uring& operator=( const uring& ) = delete;
+
+		bool create( std::uint32_t entries, std::uint16_t buffer_count, std::uint32_t buffer_size );
+		void destroy( );
+
+		// Requests fail to queue if the kernel has no room for them: it doesn't take any
+		// while its completion queue overflows. Try again once you reaped completions.
+
+		// Multishot requests keep posting completions until they fail or get cancelled
+		bool accept_multishot( SOCKET listener, std::uint64_t data );
+		bool recv_multishot( SOCKET s, std::uint64_t data );
+
+		bool send( SOCKET s, const void* buffer, std::uint32_t length, std::uint64_t data );
+
+		// Scatter-gather send. The message has to stay untouched until the send completes.
+		bool send_message( SOCKET s, const msghdr* message, std::uint64_t data );
+
+		// The address has to stay untouched until the connect completes
+		bool connect( SOCKET s, const sockaddr* address, std::uint32_t length, std::uint64_t data );
+
+		// Cancels whatever request of the given type was queued with data. The request
+		// completes with -ECANCELED, the cancellation itself posts an op::cancel completion.
+		bool cancel( op type, std::uint64_t data );
+
+		// Provided buffers have to be handed back once we're done with their data
+		const std::uint8_t* buffer( std::uint16_t id ) const;
+		void recycle_buffer( std::uint16_t id );
+
+		// Submits everything queued up in a single syscall and waits for at least one
+		// completion. A negative timeout waits indefinitely.
+		void submit_and_wait( int timeout_ms );
+
+		// Reaps completions and returns how many were written to out
+		std::size_t completions( std::vector< completion >& out );
+
+		// Interrupts a thread blocked in submit_and_wait, may be called from any thread
+		void wake( );
+
+	private:
+	#ifdef __linux__
+		io_uring_sqe* get_sqe( );
+		unsigned flush( );
+
+		bool probe_recv_multishot( );
+
+		void arm_wake( );
+		bool wake_armed_ = false;
+
+		int ring_fd_ = -1, wake_fd_ = -1;
+
+		// Shared memory regions
+		void* ring_ = nullptr;
+		std::size_t ring_size_ = 0;
+
+		io_uring_sqe* sqes_ = nullptr;
+		std::size_t sqes_size_ = 0;
+
+		// Submission queue
+		unsigned* sq_head_ = nullptr, * sq_tail_ = nullptr, * sq_array_ = nullptr;
+		unsigned sq_mask_ = 0, sq_entries_ = 0;
+
+		// SQEs we handed out but did not publish to the kernel yet
+		unsigned sqe_head_ = 0, sqe_tail_ = 0;
+
+		// Completion queue
+		unsigned* cq_head_ = nullptr, * cq_tail_ = nullptr;
+		io_uring_cqe* cqes_ = nullptr;
+		unsigned cq_mask_ = 0;
+
+		// Provided buffer ring the kernel receives into
+		io_uring_buf* buffer_ring_ = nullptr;
+		std::size_t buffer_ring_size_ = 0;
+		std::uint16_t buffer_tail_ = 0, buffer_mask_ = 0;
+		std::uint32_t buffer_size_ = 0;
+
+		std::vector< std::uint8_t > buffers_ = { };
+
+		std::uint64_t wake_value_ = 0;
+	#endif // __linux__
+	};
+} // namespace fi::detail
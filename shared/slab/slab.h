@@ -0,0 +1,122 @@
+#pragma once
+#include <cstdint>
+#include <vector>
+#include <array>
+#include <memory>
+#include <optional>
+
+namespace fi::detail {
+	// Fixed-size slots handed out by index. Every slot carries a generation which
+	// changes whenever the slot is released, so an (index, generation) pair stays
+	// invalid once its item is gone, even if the slot has been reused since.
+	// Slots live in chunks that never move, so items keep their address while the
+	// slab grows.
+	template < typename T, std::size_t chunk_size = 256 >
+	class slab {
+	public:
+		// Tokens carry index and generation in 56 bits (io_uring keeps the upper byte of
+		// its user data for itself), which leaves 24 bits for the index
+		static constexpr std::size_t max_slots = std::size_t( 1 ) << 24;
+
+		slab( ) { }
+
+		slab( const slab& ) = delete;
+		slab& operator=( const slab& ) = delete;
+
+		// Constructs an item in a free slot and returns its index, mind full( )
+		template < typename... args_t >
+		std::uint32_t emplace( args_t&&... args ) {
+			if ( free_.empty( ) ) {
+				auto first = std::uint32_t( chunks_.size( ) * chunk_size );
+
+				chunks_.push_back( std::make_unique< chunk >( ) );
+
+				// Hand out lower indices first
+				for ( std::size_t i = chunk_size; i > 0; i-- )
+					free_.push_back( first + std::uint32_t( i - 1 ) );
+			}
+
+			auto index = free_.back( );
+			free_.pop_back( );
+
+			slot_at( index ).item.emplace( std::forward< args_t >( args )... );
+			size_++;
+
+			return index;
+		}
+
+		// Destroys the item and invalidates every handle pointing at it
+		void release( std::uint32_t index ) {
+			auto& s = slot_at( index );
+
+			if ( !s.item )
+				return;
+
+			s.item.reset( );
+			size_--;
+
+			// Starting over would make handles from 4 billion items ago valid again,
+			// the slot is retired instead. Generation 0 never refers to a live item.
+			if ( !++s.generation )
+				return;
+
+			free_.push_back( index );
+		}
+
+		// No free slot left and no room to add any
+		bool full( ) const {
+			return free_.empty( ) && chunks_.size( ) * chunk_size >= max_slots;
+		}
+
+		// Returns nullptr if the slot is empty or was reused since the handle was given out
+		T* get( std::uint32_t index, std::uint32_t generation ) {
+			if ( index >= chunks_.size( ) * chunk_size )
+				return nullptr;
+
+			auto& s = slot_at( index );
+
+			if ( !s.item || s.generation != generation )
+				return nullptr;
+
+			return &*s.item;
+		}
+
+		std::uint32_t generation( std::uint32_t index ) const {
+			return chunks_[ index / chunk_size ]->at( index % chunk_size ).generation;
+		}
+
+		// Calls fn( index, item ) for every live item
+		template < typename fn_t >
+		void for_each( fn_t&& fn ) {
+			for ( std::size_t c = 0; c < chunks_.size( ); c++ ) {
+				for ( std::size_t i = 0; i < chunk_size; i++ ) {
+					auto& s = ( *chunks_[ c ] )[ i ];
+
+					if ( s.item )
+						fn( std::uint32_t( c * chunk_size + i ), *s.item );
+				}
+			}
+		}
+
+		std::size_t size( ) const {
+			return size_;
+		}
+
+	private:
+		struct slot {
+			std::optional< T > item = { };
+			std::uint32_t generation = 1;
+		};
+
+		typedef std::array< slot, chunk_size > chunk;
+
+		slot& slot_at( std::uint32_t index ) {
+			return ( *chunks_[ index / chunk_size ] )[ index % chunk_size ];
+		}
+
+		std::vector< std::unique_ptr< chunk > > chunks_ = { };
+		std::vector< std::uint32_t > free_ = { };
+
+		std::size_t size_ = 0;
+	};
+} // namespace fi::detail
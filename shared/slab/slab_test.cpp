@@ -0,0 +1,84 @@
+#include "slab.h"
+#include "../testing/check.h"
+
+#include <string>
+
+using namespace fi::detail;
+
+static void handles_go_stale( ) {
+	slab< std::string > items = { };
+
+	auto index = items.emplace( "first" );
+	auto generation = items.generation( index );
+
+	FI_CHECK( generation != 0 );
+	FI_CHECK( items.get( index, generation ) && *items.get( index, generation ) == "first" );
+	FI_CHECK( !items.get( index, generation + 1 ) );
+
+	items.release( index );
+
+	FI_CHECK( !items.get( index, generation ) );
+	FI_CHECK( items.size( ) == 0 );
+
+	// Releasing twice doesn't bump the generation again
+	items.release( index );
+	FI_CHECK( items.generation( index ) == generation + 1 );
+
+	// The slot gets reused, the old handle still doesn't find anything
+	auto reused = items.emplace( "second" );
+
+	FI_CHECK( reused == index );
+	FI_CHECK( !items.get( index, generation ) );
+	FI_CHECK( items.get( reused, items.generation( reused ) ) && *items.get( reused, items.generation( reused ) ) == "second" );
+}
+
+static void out_of_range( ) {
+	slab< int, 4 > items = { };
+
+	FI_CHECK( !items.get( 0, 1 ) );
+
+	items.emplace( 1 );
+
+	FI_CHECK( !items.get( 4, 1 ) );
+	FI_CHECK( !items.get( 1000, 1 ) );
+}
+
+static void grows_without_moving( ) {
+	slab< int, 4 > items = { };
+
+	auto first = items.emplace( 7 );
+	auto address = items.get( first, items.generation( first ) );
+
+	// Lower indices go out first
+	FI_CHECK( first == 0 );
+
+	for ( int i = 1; i < 20; i++ )
+		FI_CHECK( items.emplace( i ) == std::uint32_t( i ) );
+
+	FI_CHECK( items.size( ) == 20 );
+	FI_CHECK( items.get( first, items.generation( first ) ) == address && *address == 7 );
+	FI_CHECK( !items.full( ) );
+
+	items.release( 3 );
+	items.release( 11 );
+
+	int live = 0, sum = 0;
+
+	items.for_each( [ & ]( std::uint32_t index, int& item ) {
+		FI_CHECK( index != 3 && index != 11 );
+
+		live++;
+		sum += item;
+	} );
+
+	FI_CHECK( live == 18 );
+	FI_CHECK( sum == 7 + ( 19 * 20 / 2 ) - 3 - 11 );
+}
+
+int main( ) {
+	handles_go_stale( );
+	out_of_range( );
+	grows_without_moving( );
+
+	return fi::testing::result( );
+}
@@ -0,0 +1,29 @@
+#pragma once
+#include <cstdio>
+
+// Bare bones checks for the unit tests living next to the components. Every test
+// is an executable of its own, main returns fi::testing::result( ) for ctest.
+namespace fi::testing {
+	inline int& failures( ) {
+		static int count = 0;
+		return count;
+	}
+
+	inline bool check( bool passed, const char* expression, const char* file, int line ) {
+		if ( !passed ) {
+			fprintf( stderr, "%s:%i: check failed: %s\n", file, line, expression );
+			failures( )++;
+		}
+
+		return passed;
+	}
+
+	inline int result( ) {
+		if ( failures( ) )
+			fprintf( stderr, "%i check(s) failed\n", failures( ) );
+
+		return failures( ) ? 1 : 0;
+	}
+} // namespace fi::testing
+
+#define FI_CHECK( ... ) fi::testing::check( bool( __VA_ARGS__ ), #__VA_ARGS__, __FILE__, __LINE__ )
@@ -0,0 +1,178 @@
+#include "timer_wheel.h"
+
+#include <algorithm>
+
+namespace fi::detail {
+	timer_wheel::timer_wheel( ) : origin_( clock::now( ) ) {
+		for ( auto& level : heads_ )
+			level.fill( none_ );
+	}
+
+	timer_wheel::timer_id timer_wheel::schedule( clock::time_point when, std::function< void( ) > fn ) {
+		auto index = timers_.emplace( );
+		auto& t = *timers_.get( index, timers_.generation( index ) );
+
+		// Round up, timers may fire late but never early
+		auto expires = when > origin_ ? std::uint64_t( std::chrono::ceil< std::chrono::milliseconds >( when - origin_ ).count( ) ) : 0;
+
+		t.expires = std::max( expires, current_ + 1 );
+		t.fn = std::move( fn );
+
+		link( index );
+
+		return std::uint64_t( timers_.generation( index ) ) << 32 | index;
+	}
+
+	bool timer_wheel::cancel( timer_id id ) {
+		auto index = std::uint32_t( id );
+
+		if ( !timers_.get( index, std::uint32_t( id >> 32 ) ) )
+			return false;
+
+		unlink( index );
+		timers_.release( index );
+
+		return true;
+	}
+
+	void timer_wheel::advance( clock::time_point now ) {
+		auto target = tick_of( now );
+
+		while ( current_ < target ) {
+			// Nothing is waiting on any of the ticks in between
+			if ( !timers_.size( ) ) {
+				current_ = target;
+				break;
+			}
+
+			current_++;
+
+			// Once a level wraps around, the next slot of the level above is due.
+			// Start with the coarsest one, its timers might land in the finer ones.
+			std::uint32_t wrapped = 0;
+
+			while ( wrapped + 1 < levels_ && !( current_ & ( ( std::uint64_t( 1 ) << ( ( wrapped + 1 ) * slot_bits_ ) ) - 1 ) ) )
+				wrapped++;
+
+			for ( auto level = wrapped; level > 0; level-- )
+				cascade( level );
+
+			expire( );
+		}
+	}
+
+	int timer_wheel::next_timeout( clock::time_point now, int max_ms ) {
+		if ( !timers_.size( ) )
+			return max_ms < 0 ? -1 : max_ms;
+
+		// Timers in coarse levels only need us once their slot gets cascaded,
+		// so the earliest slot boundary of all levels is when we're needed next
+		auto wake_at = ~0ull;
+
+		for ( std::uint32_t level = 0; level < levels_; level++ ) {
+			auto shift = level * slot_bits_;
+			auto position = current_ >> shift;
+
+			for ( std::uint64_t i = 1; i <= slots_; i++ ) {
+				auto boundary = ( position + i ) << shift;
+
+				if ( boundary >= wake_at )
+					break;
+
+				if ( heads_[ level ][ ( position + i ) & ( slots_ - 1 ) ] != none_ ) {
+					wake_at = boundary;
+					break;
+				}
+			}
+		}
+
+		auto remaining = std::chrono::ceil< std::chrono::milliseconds >( origin_ + std::chrono::milliseconds( wake_at ) - now ).count( );
+		remaining = std::max< long long >( remaining, 0 );
+
+		if ( max_ms >= 0 )
+			remaining = std::min< long long >( remaining, max_ms );
+
+		return int( std::min< long long >( remaining, INT32_MAX ) );
+	}
+
+	std::uint64_t timer_wheel::tick_of( clock::time_point when ) const {
+		if ( when <= origin_ )
+			return 0;
+
+		return std::uint64_t( std::chrono::duration_cast< std::chrono::milliseconds >( when - origin_ ).count( ) );
+	}
+
+	void timer_wheel::link( std::uint32_t index ) {
+		auto& t = *timers_.get( index, timers_.generation( index ) );
+
+		// Timers beyond the last level wait in its furthest slot and get
+		// linked again once that one is cascaded
+		auto expires = std::min( t.expires, current_ + ( std::uint64_t( 1 ) << ( levels_ * slot_bits_ ) ) - 1 );
+		auto delta = expires - current_;
+
+		std::uint32_t level = 0;
+
+		while ( level + 1 < levels_ && delta >= ( std::uint64_t( 1 ) << ( ( level + 1 ) * slot_bits_ ) ) )
+			level++;
+
+		t.level = std::uint16_t( level );
+		t.slot = std::uint16_t( ( expires >> ( level * slot_bits_ ) ) & ( slots_ - 1 ) );
+
+		auto& head = heads_[ t.level ][ t.slot ];
+
+		t.prev = none_;
+		t.next = head;
+
+		if ( head != none_ )
+			timers_.get( head, timers_.generation( head ) )->prev = index;
+
+		head = index;
+	}
+
+	void timer_wheel::unlink( std::uint32_t index ) {
+		auto& t = *timers_.get( index, timers_.generation( index ) );
+
+		if ( t.prev != none_ )
+			timers_.get( t.prev, timers_.generation( t.prev ) )->next = t.next;
+		else
+			heads_[ t.level ][ t.slot ] = t.next;
+
+		if ( t.next != none_ )
+			timers_.get( t.next, timers_.generation( t.next ) )->prev = t.prev;
+
+		t.prev = t.next = none_;
+	}
+
+	void timer_wheel::cascade( std::uint32_t level ) {
+		auto& head = heads_[ level ][ ( current_ >> ( level * slot_bits_ ) ) & ( slots_ - 1 ) ];
+
+		// Take the whole list, every timer in it moves to a finer level (or the same
+		// slot again if it's still beyond the last level)
+		auto index = head;
+		head = none_;
+
+		while ( index != none_ ) {
+			auto next = timers_.get( index, timers_.generation( index ) )->next;
+
+			link( index );
+			index = next;
+		}
+	}
+
+	void timer_wheel::expire( ) {
+		auto& head = heads_[ 0 ][ current_ & ( slots_ - 1 ) ];
+
+		// Callbacks can't add timers to this slot, everything they schedule is due later on
+		while ( head != none_ ) {
+			auto index = head;
+			auto& t = *timers_.get( index, timers_.generation( index ) );
+
+			auto fn = std::move( t.fn );
+
+			unlink( index );
+			timers_.release( index );
+
+			fn( );
+		}
+	}
+} // namespace fi::detail
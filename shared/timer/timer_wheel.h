@@ -0,0 +1,82 @@
+#pragma once
+#include "../slab/slab.h"
+
+#include <cstdint>
+#include <array>
+#include <chrono>
+#include <functional>
+
+namespace fi::detail {
+	// Hierarchical timer wheel with millisecond ticks. Scheduling and cancelling are
+	// O(1), expiring is O(1) amortized: timers far out sit in a coarse level and
+	// only get moved down a level whenever the finer one wraps around.
+	// Not thread safe, meant to be owned by a single loop thread.
+	class timer_wheel {
+	public:
+		typedef std::chrono::steady_clock clock;
+
+		// 0 never refers to a timer
+		typedef std::uint64_t timer_id;
+
+		timer_wheel( );
+
+		timer_wheel( const timer_wheel& ) = delete;
+		timer_wheel& operator=( const timer_wheel& ) = delete;
+
+		// Calls fn once the given point in time has passed. Timers due in the
+		// past fire on the next advance.
+		timer_id schedule( clock::time_point when, std::function< void( ) > fn );
+
+		// Returns false if the timer already fired or was cancelled
+		bool cancel( timer_id id );
+
+		// Fires every timer that's due. Callbacks may schedule and cancel timers.
+		void advance( clock::time_point now );
+
+		// How long the owner may sleep before it has to call advance again, at
+		// most max_ms. Negative max_ms means no limit, -1 is returned if no timers
+		// are scheduled in that case.
+		int next_timeout( clock::time_point now, int max_ms );
+
+		std::size_t size( ) const {
+			return timers_.size( );
+		}
+
+	private:
+		static constexpr std::uint32_t slot_bits_ = 8;
+		static constexpr std::uint32_t slots_ = 1 << slot_bits_;
+		static constexpr std::uint32_t levels_ = 4;
+
+		// Timers are linked into their slot by index
+		static constexpr std::uint32_t none_ = ~0u;
+
+		struct timer {
+			std::uint64_t expires = 0;
+			std::uint32_t prev = none_, next = none_;
+
+			// Level and slot we're linked into
+			std::uint16_t level = 0, slot = 0;
+
+			std::function< void( ) > fn = { };
+		};
+
+		std::uint64_t tick_of( clock::time_point when ) const;
+
+		void link( std::uint32_t index );
+		void unlink( std::uint32_t index );
+
+		// Moves the timers of a coarse slot into the finer levels
+		void cascade( std::uint32_t level );
+
+		// Fires the timers in the current level 0 slot
+		void expire( );
+
+		clock::time_point origin_ = { };
+		std::uint64_t current_ = 0;
+
+		slab< timer > timers_ = { };
+
+		// Head of every slot's list
+		std::array< std::array< std::uint32_t, slots_ >, levels_ > heads_ = { };
+	};
+} // namespace fi::detail
@@ -0,0 +1,134 @@
+#include "timer_wheel.h"
+#include "../testing/check.h"
+
+#include <vector>
+
+using namespace fi::detail;
+using namespace std::chrono_literals;
+
+// Timers never fire early and, advancing a tick at a time, at most a tick late
+static void cascades_down( ) {
+	timer_wheel wheel = { };
+	auto start = timer_wheel::clock::now( );
+
+	// Every level, and the boundaries between them
+	const std::vector< std::int64_t > delays = { 1, 5, 255, 256, 257, 1000, 65535, 65536, 65537, 100000 };
+	std::vector< std::int64_t > fired( delays.size( ), -1 );
+
+	std::int64_t now = 0;
+
+	for ( std::size_t i = 0; i < delays.size( ); i++ )
+		wheel.schedule( start + std::chrono::milliseconds( delays[ i ] ), [ &, i ]( ) { fired[ i ] = now; } );
+
+	FI_CHECK( wheel.size( ) == delays.size( ) );
+
+	for ( now = 1; now <= 100001; now++ )
+		wheel.advance( start + std::chrono::milliseconds( now ) );
+
+	for ( std::size_t i = 0; i < delays.size( ); i++ )
+		FI_CHECK( fired[ i ] >= delays[ i ] && fired[ i ] <= delays[ i ] + 1 );
+
+	FI_CHECK( wheel.size( ) == 0 );
+}
+
+static void far_out( ) {
+	timer_wheel wheel = { };
+	auto start = timer_wheel::clock::now( );
+
+	bool early = false, late = false;
+
+	// Beyond the last level, waits in its furthest slot until it gets close enough
+	wheel.schedule( start + 20000000ms, [ & ]( ) { late = true; } );
+	wheel.schedule( start + 16000000ms, [ & ]( ) { early = true; } );
+
+	wheel.advance( start + 15999999ms );
+	FI_CHECK( !early && !late );
+
+	wheel.advance( start + 16000001ms );
+	FI_CHECK( early && !late );
+
+	wheel.advance( start + 19999999ms );
+	FI_CHECK( !late );
+
+	wheel.advance( start + 20000001ms );
+	FI_CHECK( late );
+}
+
+static void cancelling( ) {
+	timer_wheel wheel = { };
+	auto start = timer_wheel::clock::now( );
+
+	int fired = 0;
+
+	auto near = wheel.schedule( start + 10ms, [ & ]( ) { fired++; } );
+	auto far = wheel.schedule( start + 70000ms, [ & ]( ) { fired++; } );
+	wheel.schedule( start + 70000ms, [ & ]( ) { fired++; } );
+
+	FI_CHECK( wheel.cancel( near ) );
+	FI_CHECK( !wheel.cancel( near ) );
+
+	// Cascaded a level down by now, cancelling still finds it
+	wheel.advance( start + 69990ms );
+	FI_CHECK( wheel.cancel( far ) );
+
+	wheel.advance( start + 70001ms );
+	FI_CHECK( fired == 1 );
+	FI_CHECK( !wheel.cancel( far ) );
+
+	// Reused slots don't answer to ids handed out for earlier timers
+	timer_wheel::timer_id reused[ 3 ] = { };
+
+	for ( auto& id : reused )
+		id = wheel.schedule( start + 70100ms, [ & ]( ) { fired++; } );
+
+	FI_CHECK( !wheel.cancel( near ) && !wheel.cancel( far ) );
+
+	for ( auto id : reused )
+		FI_CHECK( wheel.cancel( id ) );
+
+	FI_CHECK( wheel.size( ) == 0 );
+}
+
+static void from_callbacks( ) {
+	timer_wheel wheel = { };
+	auto start = timer_wheel::clock::now( );
+
+	int fired = 0;
+
+	// Rescheduling from a callback, like heartbeats do
+	std::function< void( ) > again = [ & ]( ) {
+		if ( ++fired < 5 )
+			wheel.schedule( start + std::chrono::milliseconds( 300 * ( fired + 1 ) ), again );
+	};
+
+	wheel.schedule( start + 300ms, again );
+	wheel.advance( start + 10s );
+
+	FI_CHECK( fired == 5 );
+}
+
+static void timeouts( ) {
+	timer_wheel wheel = { };
+	auto start = timer_wheel::clock::now( );
+
+	FI_CHECK( wheel.next_timeout( start, -1 ) == -1 );
+	FI_CHECK( wheel.next_timeout( start, 50 ) == 50 );
+
+	wheel.schedule( start + 20ms, [ ]( ) { } );
+
+	auto timeout = wheel.next_timeout( start, -1 );
+
+	FI_CHECK( timeout >= 20 && timeout <= 21 );
+	FI_CHECK( wheel.next_timeout( start, 5 ) == 5 );
+	FI_CHECK( wheel.next_timeout( start + 30ms, -1 ) == 0 );
+}
+
+int main( ) {
+	cascades_down( );
+	far_out( );
+	cancelling( );
+	from_callbacks( );
+	timeouts( );
+
+	return fi::testing::result( );
+}